@@ -7,6 +7,8 @@ layout(location = 1) in vec3 in_normal;
 layout(location = 2) in vec2 in_uv;
 layout(location = 3) in vec4 in_tangent_bitangent_sign;
 layout(location = 4) in vec3 in_color;
+// Per-instance attribute of indirect draws, the base instance of the command selects the range of its group
+layout(location = 5) in uint in_instance;
 
 layout(location = 0) out vec3 out_normal;
 layout(location = 1) out vec2 out_uv;
@@ -21,13 +23,14 @@ layout(binding = 0) uniform Data {
 
 uniform mat4 model;
 uniform bool instanced;
+uniform bool indirect;
 
 layout(binding = 2) buffer ObjectModels {
     mat4 models[];
 };
 
 void main() {
-    const mat4 model_matrix = instanced ? models[gl_InstanceID] : model;
+    const mat4 model_matrix = indirect ? models[in_instance] : (instanced ? models[gl_InstanceID] : model);
     const vec4 position = model_matrix * vec4(in_pos, 1.0);
 
     out_normal = normalize(mat3(model_matrix) * in_normal);
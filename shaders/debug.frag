@@ -5,6 +5,7 @@
 layout(binding = 0) uniform sampler2D in_albedo;
 layout(binding = 1) uniform sampler2D in_normal;
 layout(binding = 2) uniform sampler2D in_depth;
+layout(binding = 3) uniform sampler2D in_hiz;
 
 layout(location = 0) out vec4 out_color;
 
@@ -12,8 +13,10 @@ layout(location = 0) out vec4 out_color;
 const uint ALBEDO = 1;
 const uint NORMALS = 2;
 const uint DEPTH = 3;
+const uint HIZ = 6;
 
 uniform uint debug;
+uniform uint hiz_level;
 
 void main() {
     
@@ -32,5 +35,11 @@ void main() {
         depth *= 1e5;
         out_color = vec4(depth, depth, depth, 1.0);
     }
+    else if (debug == HIZ) {
+        const ivec2 level_coord = coord * textureSize(in_hiz, int(hiz_level)) / textureSize(in_depth, 0);
+        float depth = texelFetch(in_hiz, level_coord, int(hiz_level)).x;
+        depth *= 1e5;
+        out_color = vec4(depth, depth, depth, 1.0);
+    }
 }
 
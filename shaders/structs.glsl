@@ -19,3 +19,35 @@ struct PointLight {
     float padding_1;
 };
 
+
+// Flattened hierarchy node, instance is ~0 for inner nodes and parent is ~0 for the root
+struct BVHNode {
+    vec3 aabb_min;
+    uint parent;
+    vec3 aabb_max;
+    uint instance;
+};
+
+// Layout expected by glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand {
+    uint count;
+    uint instance_count;
+    uint first_index;
+    int base_vertex;
+    uint base_instance;
+};
+
+// Cluster of triangles of a mesh, in mesh space. Its triangles face away from any point of the cone of apex cone_apex, axis
+// -cone_axis and half angle acos(cone_cutoff). A cutoff above 1 means the cluster has no such cone.
+struct Meshlet {
+    vec3 center;
+    float radius;
+    vec3 cone_apex;
+    float cone_cutoff;
+    vec3 cone_axis;
+    uint first_index;
+    uint index_count;
+    uint padding_1;
+    uint padding_2;
+    uint padding_3;
+};
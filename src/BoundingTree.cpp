@@ -1,284 +1,1985 @@
 #include "BoundingTree.h"
 
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/matrix_inverse.hpp>
+
 #include <algorithm>
+#include <array>
+#include <functional>
 #include <limits>
+#include <numeric>
+#include <queue>
+
+namespace OM3D {
+
+BoundingTree::BoundingTree() {}
+
+// Number of bins evaluated per axis by the SAH builder
+static constexpr u32 sah_bins = 16;
+
+// Ranges smaller than this are processed by a single thread
+static constexpr u32 parallel_partition_threshold = 16 * 1024;
+// Subtrees smaller than this are built by the task that created them
+static constexpr u32 parallel_subtree_threshold = 2 * 1024;
+
+// Bits sorted per radix sort pass by the linear builder
+static constexpr u32 radix_bits = 11;
+// Bits per axis of the Morton codes, 3 * 21 bits fit in a u64
+static constexpr u32 morton_bits = 21;
+
+// Grandchild exchanges and rotations applied per treelet, each one is the best of its search
+static constexpr u32 max_treelet_passes = 4;
+// Treelets optimized per task
+static constexpr size_t treelet_grain = 256;
+
+// Rotations and treelet exchanges are only searched below nodes with few enough children, the searches are cubic in the fanout
+static constexpr u32 max_rotation_fanout = 16;
+
+// A node is degraded when its surface area exceeds its built area by this factor
+static constexpr float rebuild_area_ratio = 2.0f;
+// Leaves refit() may rebuild per moved object, bounds the amortized cost of the quality monitor
+static constexpr size_t rebuild_leaves_per_moved_object = 1;
+
+static float surface_area(const glm::vec3 &min, const glm::vec3 &max) {
+    const glm::vec3 d = glm::max(max - min, glm::vec3(0.0f));
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static bool is_linear(BuildStrategy strategy) {
+    return strategy == BuildStrategy::LBVH || strategy == BuildStrategy::LBVHTreelets;
+}
+
+// Inserts two zero bits between each of the low 21 bits
+static u64 spread_bits(u64 x) {
+    x &= 0x1FFFFF;
+    x = (x | x << 32) & 0x1F00000000FFFF;
+    x = (x | x << 16) & 0x1F0000FF0000FF;
+    x = (x | x << 8) & 0x100F00F00F00F00F;
+    x = (x | x << 4) & 0x10C30C30C30C30C3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+struct BoundingTree::BuildContext {
+    std::vector<u32> indices;
+    std::vector<glm::vec3> min_corners;
+    std::vector<glm::vec3> max_corners;
+    // Morton code of the centroid of every entry of indices, only used by the linear builder
+    std::vector<u64> codes;
+
+    size_t subdivisions;
+    BuildStrategy strategy;
+
+    // nullptr for a serial build
+    ThreadPool *pool = nullptr;
+
+    glm::vec3 centroid(u32 instance) const {
+        return (min_corners[instance] + max_corners[instance]) * 0.5f;
+    }
+
+    bool is_parallel(u32 begin, u32 end) const {
+        return pool && end - begin >= parallel_partition_threshold;
+    }
+
+    u32 chunk_size(u32 begin, u32 end) const {
+        return std::max(parallel_partition_threshold / 4, u32((end - begin) / (pool->thread_count() * 4)) + 1);
+    }
+
+    // Calls f(chunk_index, chunk_begin, chunk_end) on every chunk, returns the number of chunks.
+    // Results combined in chunk order do not depend on the number of threads.
+    template<typename F>
+    u32 for_chunks(u32 begin, u32 end, F &&f) {
+        if (!is_parallel(begin, end)) {
+            f(0, begin, end);
+            return 1;
+        }
+
+        const u32 chunk = chunk_size(begin, end);
+        pool->parallel_for(begin, end, chunk, [&](size_t b, size_t e) {
+            f(u32((b - begin) / chunk), u32(b), u32(e));
+        });
+        return (end - begin + chunk - 1) / chunk;
+    }
+
+    u32 chunk_count(u32 begin, u32 end) const {
+        return is_parallel(begin, end) ? (end - begin + chunk_size(begin, end) - 1) / chunk_size(begin, end) : 1;
+    }
+
+    std::pair<glm::vec3, glm::vec3> bounds(u32 begin, u32 end) {
+        std::vector<std::pair<glm::vec3, glm::vec3>> partial(chunk_count(begin, end));
+        for_chunks(begin, end, [&](u32 chunk, u32 b, u32 e) {
+            glm::vec3 min = min_corners[indices[b]];
+            glm::vec3 max = max_corners[indices[b]];
+            for (u32 i = b + 1; i < e; i++) {
+                min = glm::min(min, min_corners[indices[i]]);
+                max = glm::max(max, max_corners[indices[i]]);
+            }
+            partial[chunk] = { min, max };
+        });
+
+        for (size_t i = 1; i < partial.size(); i++) {
+            partial[0].first = glm::min(partial[0].first, partial[i].first);
+            partial[0].second = glm::max(partial[0].second, partial[i].second);
+        }
+        return partial[0];
+    }
+
+    // Sorts chunks in parallel and merges them pairwise, the comparator must be a strict total order
+    template<typename C>
+    void sort(u32 begin, u32 end, C cmp) {
+        const auto first = indices.begin() + begin;
+        if (!is_parallel(begin, end)) {
+            std::sort(first, indices.begin() + end, cmp);
+            return;
+        }
+
+        const u32 chunk = chunk_size(begin, end);
+        for_chunks(begin, end, [&](u32, u32 b, u32 e) {
+            std::sort(indices.begin() + b, indices.begin() + e, cmp);
+        });
+
+        for (u32 width = chunk; width < end - begin; width *= 2) {
+            const u32 pairs = (end - begin + 2 * width - 1) / (2 * width);
+            pool->parallel_for(0, pairs, 1, [&](size_t p, size_t) {
+                const u32 lo = u32(p) * 2 * width;
+                const u32 mid = std::min(lo + width, end - begin);
+                const u32 hi = std::min(lo + 2 * width, end - begin);
+                std::inplace_merge(first + lo, first + mid, first + hi, cmp);
+            });
+        }
+    }
+
+    // Stable partition, returns the first index for which pred is false
+    template<typename P>
+    u32 partition(u32 begin, u32 end, P pred) {
+        if (!is_parallel(begin, end)) {
+            return u32(std::stable_partition(indices.begin() + begin, indices.begin() + end, pred) - indices.begin());
+        }
+
+        std::vector<u32> counts(chunk_count(begin, end) + 1, 0);
+        for_chunks(begin, end, [&](u32 chunk, u32 b, u32 e) {
+            counts[chunk + 1] = u32(std::count_if(indices.begin() + b, indices.begin() + e, pred));
+        });
+
+        // Exclusive prefix sum of the chunks' true counts
+        for (size_t i = 1; i < counts.size(); i++) {
+            counts[i] += counts[i - 1];
+        }
+        const u32 total = counts.back();
+
+        std::vector<u32> partitioned(end - begin);
+        for_chunks(begin, end, [&](u32 chunk, u32 b, u32 e) {
+            u32 true_offset = counts[chunk];
+            u32 false_offset = total + (b - begin) - counts[chunk];
+            for (u32 i = b; i < e; i++) {
+                partitioned[pred(indices[i]) ? true_offset++ : false_offset++] = indices[i];
+            }
+        });
+
+        for_chunks(begin, end, [&](u32, u32 b, u32 e) {
+            std::copy(partitioned.begin() + (b - begin), partitioned.begin() + (e - begin), indices.begin() + b);
+        });
+
+        return begin + total;
+    }
+
+    // Computes the Morton codes of all indices and sorts both with a stable LSD radix sort.
+    // Every pass histograms the chunks in parallel, then scatters them in chunk order.
+    void sort_morton() {
+        const u32 count = u32(indices.size());
+
+        std::vector<std::pair<glm::vec3, glm::vec3>> partial(chunk_count(0, count));
+        for_chunks(0, count, [&](u32 chunk, u32 b, u32 e) {
+            glm::vec3 min = centroid(indices[b]);
+            glm::vec3 max = min;
+            for (u32 i = b + 1; i < e; i++) {
+                min = glm::min(min, centroid(indices[i]));
+                max = glm::max(max, centroid(indices[i]));
+            }
+            partial[chunk] = { min, max };
+        });
+
+        glm::vec3 min = partial[0].first;
+        glm::vec3 max = partial[0].second;
+        for (size_t i = 1; i < partial.size(); i++) {
+            min = glm::min(min, partial[i].first);
+            max = glm::max(max, partial[i].second);
+        }
+
+        // Quantize the centroids on a grid of cubic cells, so that flat scenes are not split along their thin axis as often as along the others
+        const float cells = float((1 << morton_bits) - 1);
+        const glm::vec3 extent = max - min;
+        const float largest = std::max(extent.x, std::max(extent.y, extent.z));
+        const float scale = largest > 0.0f ? cells / largest : 0.0f;
+
+        codes.resize(count);
+        for_chunks(0, count, [&](u32, u32 b, u32 e) {
+            for (u32 i = b; i < e; i++) {
+                const glm::vec3 cell = glm::clamp((centroid(indices[i]) - min) * scale, glm::vec3(0.0f), glm::vec3(cells));
+                codes[i] = spread_bits(u64(cell.x)) << 2 | spread_bits(u64(cell.y)) << 1 | spread_bits(u64(cell.z));
+            }
+        });
+
+        constexpr u32 buckets = 1 << radix_bits;
+        std::vector<std::array<u32, buckets>> offsets(chunk_count(0, count));
+        std::vector<u64> sorted_codes(count);
+        std::vector<u32> sorted_indices(count);
+
+        for (u32 shift = 0; shift < 3 * morton_bits; shift += radix_bits) {
+            for_chunks(0, count, [&](u32 chunk, u32 b, u32 e) {
+                offsets[chunk].fill(0);
+                for (u32 i = b; i < e; i++) {
+                    offsets[chunk][(codes[i] >> shift) & (buckets - 1)]++;
+                }
+            });
+
+            // Exclusive prefix sum in bucket then chunk order, which keeps the sort stable
+            u32 offset = 0;
+            bool shared_digit = false;
+            for (u32 bucket = 0; bucket < buckets; bucket++) {
+                const u32 bucket_begin = offset;
+                for (auto &chunk : offsets) {
+                    const u32 n = chunk[bucket];
+                    chunk[bucket] = offset;
+                    offset += n;
+                }
+                shared_digit |= offset - bucket_begin == count;
+            }
+
+            // Every code has the same digit, the pass would not move anything
+            if (shared_digit)
+                continue;
+
+            for_chunks(0, count, [&](u32 chunk, u32 b, u32 e) {
+                for (u32 i = b; i < e; i++) {
+                    const u32 to = offsets[chunk][(codes[i] >> shift) & (buckets - 1)]++;
+                    sorted_codes[to] = codes[i];
+                    sorted_indices[to] = indices[i];
+                }
+            });
+
+            codes.swap(sorted_codes);
+            indices.swap(sorted_indices);
+        }
+    }
+};
+
+void BoundingTree::build(std::vector<std::shared_ptr<SceneObject>> instances, size_t subdivisions, BuildStrategy strategy, ThreadPool *pool) {
+    *this = BoundingTree();
+    _instances = std::move(instances);
+    _subdivisions = subdivisions;
+    _strategy = strategy;
+
+    const u32 count = u32(_instances.size());
+    if (count == 0)
+        return;
+
+    _leaf.assign(count, invalid_index);
+    _spheres.resize(count);
+
+    BuildContext ctx;
+    ctx.subdivisions = subdivisions;
+    ctx.strategy = strategy;
+    ctx.pool = pool && pool->thread_count() > 1 ? pool : nullptr;
+    ctx.min_corners.resize(count);
+    ctx.max_corners.resize(count);
+    ctx.indices.resize(count);
+    std::iota(ctx.indices.begin(), ctx.indices.end(), 0);
+
+    // Copy every world AABB once, the builder only works on indices afterwards
+    ctx.for_chunks(0, count, [&](u32, u32 b, u32 e) {
+        for (u32 i = b; i < e; i++) {
+            const auto &aabb = _instances[i]->get_aabb();
+            ctx.min_corners[i] = aabb.first;
+            ctx.max_corners[i] = aabb.second;
+            set_sphere(i);
+        }
+    });
+
+    // A tree with at least two children per inner node has fewer than twice as many nodes as leaves
+    reserve_nodes(2 * size_t(count));
+    allocate_nodes(1);
+    if (count == 1) {
+        set_leaf(0, 0, ctx.min_corners[0], ctx.max_corners[0]);
+        return;
+    }
+
+    if (is_linear(strategy))
+        ctx.sort_morton();
+
+    build_recursive(ctx, 0, 0, count);
+
+    if (strategy == BuildStrategy::LBVHTreelets)
+        optimize_treelets(ctx.pool);
+}
+
+void BoundingTree::build_recursive(BuildContext &ctx, u32 node, u32 begin, u32 end) {
+    const u32 count = end - begin;
+
+    // The linear builder does not need the bounds to split, they are fitted bottom-up once the children are built
+    const bool linear = is_linear(ctx.strategy);
+    if (!linear) {
+        const auto [min, max] = ctx.bounds(begin, end);
+        _min_x[node] = min.x; _min_y[node] = min.y; _min_z[node] = min.z;
+        _max_x[node] = max.x; _max_y[node] = max.y; _max_z[node] = max.z;
+        _built_area[node] = surface_area(min, max);
+    }
+
+    // Ranges of ctx.indices that become the children of this node
+    std::vector<std::pair<u32, u32>> ranges;
+    if (ctx.subdivisions <= 1 || count <= ctx.subdivisions) {
+        for (u32 i = begin; i < end; i++) {
+            ranges.emplace_back(i, i + 1);
+        }
+    }
+    else if (linear) {
+        partition_morton(ctx, begin, end, ranges);
+    }
+    else if (ctx.strategy == BuildStrategy::SAH) {
+        partition_sah(ctx, begin, end, ranges);
+    }
+    else {
+        partition_median(ctx, begin, end, min_corner(node), max_corner(node), ranges);
+    }
+
+    // Allocate the whole sibling range first so that children are contiguous
+    const u32 groups = u32(ranges.size());
+    const u32 first = allocate_nodes(groups);
+    _first_child[node] = first;
+    _child_count[node] = groups;
+
+    for (u32 i = 0; i < groups; i++) {
+        _parent[first + i] = node;
+    }
+
+    // Large subtrees are built concurrently in their own storage, then appended in child order,
+    // which gives the same layout as the depth-first serial build
+    std::vector<BoundingTree> subtrees(ctx.pool && count >= parallel_subtree_threshold ? groups : 0);
+    ThreadPool::TaskGroup tasks;
+
+    for (u32 i = 0; i < groups; i++) {
+        const u32 child = first + i;
+        const auto [child_begin, child_end] = ranges[i];
+
+        if (child_end - child_begin == 1) {
+            const u32 instance = ctx.indices[child_begin];
+            set_leaf(child, instance, ctx.min_corners[instance], ctx.max_corners[instance]);
+        }
+        else if (!subtrees.empty()) {
+            BoundingTree &subtree = subtrees[i];
+            ctx.pool->run(tasks, [&ctx, &subtree, b = child_begin, e = child_end] {
+                subtree.allocate_nodes(1);
+                subtree.build_recursive(ctx, 0, b, e);
+            });
+        }
+        else {
+            build_recursive(ctx, child, child_begin, child_end);
+        }
+    }
+
+    if (!subtrees.empty()) {
+        ctx.pool->wait(tasks);
+        for (u32 i = 0; i < groups; i++) {
+            if (!subtrees[i].is_empty())
+                append_subtree(subtrees[i], first + i);
+        }
+    }
+
+    if (linear) {
+        fit_children(node);
+        _built_area[node] = surface_area(min_corner(node), max_corner(node));
+    }
+}
+
+void BoundingTree::append_subtree(const BoundingTree &subtree, u32 node) {
+    // The subtree root goes in node, the rest is appended with its indices shifted
+    const u32 count = u32(subtree._instance.size());
+    const u32 offset = allocate_nodes(count - 1) - 1;
+    auto remap = [&](u32 index) {
+        return index == invalid_index ? invalid_index : (index == 0 ? node : index + offset);
+    };
+
+    for (u32 i = 0; i < count; i++) {
+        const u32 to = remap(i);
+
+        _min_x[to] = subtree._min_x[i];
+        _min_y[to] = subtree._min_y[i];
+        _min_z[to] = subtree._min_z[i];
+        _max_x[to] = subtree._max_x[i];
+        _max_y[to] = subtree._max_y[i];
+        _max_z[to] = subtree._max_z[i];
+
+        _first_child[to] = remap(subtree._first_child[i]);
+        _child_count[to] = subtree._child_count[i];
+        _instance[to] = subtree._instance[i];
+        _built_area[to] = subtree._built_area[i];
+        if (i != 0)
+            _parent[to] = remap(subtree._parent[i]);
+
+        link_leaf(to);
+    }
+}
+
+void BoundingTree::partition_median(BuildContext &ctx, u32 begin, u32 end, const glm::vec3 &min, const glm::vec3 &max,
+                                    std::vector<std::pair<u32, u32>> &ranges) const {
+    const u32 count = end - begin;
+    const u32 groups = u32(ctx.subdivisions);
+
+    glm::vec3 length = max - min;
+    int longest_axis = length.x > length.y ? (length.x > length.z ? 0 : 2)
+                                           : (length.y > length.z ? 1 : 2);
+
+    // Compare the objects center relative to the longest axis of the current node,
+    // ties are broken by index so that the order does not depend on the sort implementation
+    auto cmp = [&](u32 a, u32 b) {
+        const float center_a = (ctx.min_corners[a][longest_axis] + ctx.max_corners[a][longest_axis]) * 0.5f;
+        const float center_b = (ctx.min_corners[b][longest_axis] + ctx.max_corners[b][longest_axis]) * 0.5f;
+        return center_a < center_b || (center_a == center_b && a < b);
+    };
+
+    ctx.sort(begin, end, cmp);
+
+    // Split into equal-count buckets
+    for (u32 i = 0; i < groups; i++) {
+        ranges.emplace_back(begin + u32(u64(count) * i / groups), begin + u32(u64(count) * (i + 1) / groups));
+    }
+}
+
+void BoundingTree::partition_sah(BuildContext &ctx, u32 begin, u32 end, std::vector<std::pair<u32, u32>> &ranges) const {
+    struct Cluster {
+        u32 begin;
+        u32 end;
+        float area;
+    };
+
+    auto make_cluster = [&](u32 b, u32 e) {
+        const auto [min, max] = ctx.bounds(b, e);
+        return Cluster{ b, e, surface_area(min, max) };
+    };
+
+    // Binary SAH splits are applied to the biggest cluster until the fanout is reached
+    std::vector<Cluster> clusters = { make_cluster(begin, end) };
+    while (clusters.size() < ctx.subdivisions) {
+        size_t best = clusters.size();
+        for (size_t i = 0; i < clusters.size(); i++) {
+            if (clusters[i].end - clusters[i].begin > 1 && (best == clusters.size() || clusters[i].area > clusters[best].area))
+                best = i;
+        }
+
+        if (best == clusters.size())
+            break;
+
+        const Cluster cluster = clusters[best];
+        const u32 mid = split_sah(ctx, cluster.begin, cluster.end);
+
+        clusters[best] = make_cluster(cluster.begin, mid);
+        clusters.insert(clusters.begin() + best + 1, make_cluster(mid, cluster.end));
+    }
+
+    for (const Cluster &c : clusters) {
+        ranges.emplace_back(c.begin, c.end);
+    }
+}
+
+void BoundingTree::partition_morton(BuildContext &ctx, u32 begin, u32 end, std::vector<std::pair<u32, u32>> &ranges) const {
+    // The sorted codes form an implicit binary radix tree: splitting the range whose first and last codes differ
+    // at the highest bit expands that tree level by level until the fanout is reached
+    auto split_key = [&](const std::pair<u32, u32> &range) {
+        const u64 diff = ctx.codes[range.first] ^ ctx.codes[range.second - 1];
+        return std::pair(diff ? 64 - count_leading_zeros(diff) : 0, range.second - range.first);
+    };
+
+    ranges.emplace_back(begin, end);
+    while (ranges.size() < ctx.subdivisions) {
+        size_t best = ranges.size();
+        for (size_t i = 0; i < ranges.size(); i++) {
+            if (ranges[i].second - ranges[i].first > 1 && (best == ranges.size() || split_key(ranges[i]) > split_key(ranges[best])))
+                best = i;
+        }
+
+        if (best == ranges.size())
+            break;
+
+        const auto [b, e] = ranges[best];
+        const u64 diff = ctx.codes[b] ^ ctx.codes[e - 1];
+
+        // Identical codes are split by count
+        u32 mid = b + (e - b) / 2;
+        if (diff != 0) {
+            const u64 bit = u64(1) << (63 - count_leading_zeros(diff));
+            mid = u32(std::partition_point(ctx.codes.begin() + b, ctx.codes.begin() + e, [&](u64 code) { return !(code & bit); }) - ctx.codes.begin());
+        }
+
+        ranges[best] = { b, mid };
+        ranges.insert(ranges.begin() + best + 1, { mid, e });
+    }
+}
+
+u32 BoundingTree::split_sah(BuildContext &ctx, u32 begin, u32 end) const {
+    const u32 count = end - begin;
+
+    struct Bin {
+        glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+        glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+        u32 count = 0;
+
+        void add(const glm::vec3 &bin_min, const glm::vec3 &bin_max, u32 bin_count) {
+            min = glm::min(min, bin_min);
+            max = glm::max(max, bin_max);
+            count += bin_count;
+        }
+    };
+
+    // Centroid bounds
+    std::vector<Bin> centroid_bounds(ctx.chunk_count(begin, end));
+    ctx.for_chunks(begin, end, [&](u32 chunk, u32 b, u32 e) {
+        for (u32 i = b; i < e; i++) {
+            const glm::vec3 c = ctx.centroid(ctx.indices[i]);
+            centroid_bounds[chunk].add(c, c, 1);
+        }
+    });
+    for (size_t i = 1; i < centroid_bounds.size(); i++) {
+        centroid_bounds[0].add(centroid_bounds[i].min, centroid_bounds[i].max, 0);
+    }
+
+    const glm::vec3 centroid_min = centroid_bounds[0].min;
+    const glm::vec3 extent = centroid_bounds[0].max - centroid_min;
+
+    auto bin_index = [&](const glm::vec3 &c, int axis) {
+        const u32 bin = u32((c[axis] - centroid_min[axis]) / extent[axis] * sah_bins);
+        return std::min(bin, sah_bins - 1);
+    };
+
+    // Bin the objects on the three axes at once
+    using AxisBins = std::array<std::array<Bin, sah_bins>, 3>;
+    std::vector<AxisBins> chunk_bins(ctx.chunk_count(begin, end));
+    ctx.for_chunks(begin, end, [&](u32 chunk, u32 b, u32 e) {
+        AxisBins &bins = chunk_bins[chunk];
+        for (u32 i = b; i < e; i++) {
+            const u32 instance = ctx.indices[i];
+            const glm::vec3 c = ctx.centroid(instance);
+            for (int axis = 0; axis < 3; axis++) {
+                if (extent[axis] > 0.0f)
+                    bins[axis][bin_index(c, axis)].add(ctx.min_corners[instance], ctx.max_corners[instance], 1);
+            }
+        }
+    });
+
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = -1;
+    u32 best_bin = 0;
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0.0f)
+            continue;
+
+        std::array<Bin, sah_bins> bins = chunk_bins[0][axis];
+        for (size_t i = 1; i < chunk_bins.size(); i++) {
+            for (u32 b = 0; b < sah_bins; b++) {
+                bins[b].add(chunk_bins[i][axis][b].min, chunk_bins[i][axis][b].max, chunk_bins[i][axis][b].count);
+            }
+        }
+
+        // Sweep from the right to get the cost of every right side
+        float right_area[sah_bins];
+        u32 right_count[sah_bins];
+        Bin acc;
+        for (u32 b = sah_bins; b-- > 1;) {
+            acc.add(bins[b].min, bins[b].max, bins[b].count);
+            right_area[b] = acc.count ? surface_area(acc.min, acc.max) : 0.0f;
+            right_count[b] = acc.count;
+        }
+
+        acc = Bin();
+        for (u32 b = 0; b + 1 < sah_bins; b++) {
+            acc.add(bins[b].min, bins[b].max, bins[b].count);
+
+            if (acc.count == 0 || right_count[b + 1] == 0)
+                continue;
+
+            const float cost = surface_area(acc.min, acc.max) * acc.count + right_area[b + 1] * right_count[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    // Every centroid is at the same place, split by count
+    if (best_axis < 0)
+        return begin + count / 2;
+
+    return ctx.partition(begin, end, [&](u32 instance) {
+        return bin_index(ctx.centroid(instance), best_axis) <= best_bin;
+    });
+}
+
+void BoundingTree::optimize_treelets(ThreadPool *pool) {
+    // Children are stored after their parent in a fresh build, so depths can be computed in one pass
+    const u32 nodes = u32(_instance.size());
+    std::vector<u32> depth(nodes, 0);
+    std::vector<std::vector<u32>> levels(1, std::vector<u32>{ 0 });
+    for (u32 node = 1; node < nodes; node++) {
+        depth[node] = depth[_parent[node]] + 1;
+        if (depth[node] >= levels.size())
+            levels.emplace_back();
+        levels[depth[node]].push_back(node);
+    }
+
+    // Bottom-up, so that every treelet is made of already optimized subtrees.
+    // Treelets rooted at the same depth do not overlap and are optimized concurrently.
+    for (size_t level = levels.size(); level-- > 0;) {
+        const std::vector<u32> &roots = levels[level];
+        if (pool && roots.size() >= treelet_grain) {
+            pool->parallel_for(0, roots.size(), treelet_grain, [&](size_t b, size_t e) {
+                for (size_t i = b; i < e; i++) {
+                    optimize_treelet(roots[i]);
+                }
+            });
+        }
+        else {
+            for (u32 node : roots) {
+                optimize_treelet(node);
+            }
+        }
+    }
+}
+
+void BoundingTree::optimize_treelet(u32 node) {
+    const u32 first = _first_child[node];
+    const u32 count = _child_count[node];
+    if (count < 2 || count > max_rotation_fanout)
+        return;
+
+    // Exchanging two grandchildren under different children only changes the bounds of these two children
+    std::array<glm::vec3, max_rotation_fanout + 1> prefix_min, prefix_max, suffix_min, suffix_max;
+    std::array<std::array<std::pair<glm::vec3, glm::vec3>, max_rotation_fanout>, max_rotation_fanout> others;
+
+    for (u32 pass = 0; pass < max_treelet_passes; pass++) {
+        // Bounds of every child without each of its grandchildren
+        for (u32 c = 0; c < count; c++) {
+            const u32 child = first + c;
+            const u32 grand_first = _first_child[child];
+            const u32 grand_count = _child_count[child];
+            if (grand_count > max_rotation_fanout)
+                return;
+
+            prefix_min[0] = suffix_min[grand_count] = glm::vec3(std::numeric_limits<float>::max());
+            prefix_max[0] = suffix_max[grand_count] = glm::vec3(std::numeric_limits<float>::lowest());
+            for (u32 i = 0; i < grand_count; i++) {
+                prefix_min[i + 1] = glm::min(prefix_min[i], min_corner(grand_first + i));
+                prefix_max[i + 1] = glm::max(prefix_max[i], max_corner(grand_first + i));
+            }
+            for (u32 i = grand_count; i-- > 0;) {
+                suffix_min[i] = glm::min(suffix_min[i + 1], min_corner(grand_first + i));
+                suffix_max[i] = glm::max(suffix_max[i + 1], max_corner(grand_first + i));
+            }
+            for (u32 i = 0; i < grand_count; i++) {
+                others[c][i] = { glm::min(prefix_min[i], suffix_min[i + 1]), glm::max(prefix_max[i], suffix_max[i + 1]) };
+            }
+        }
+
+        float best_gain = 0.0f;
+        u32 best_a = invalid_index;
+        u32 best_b = invalid_index;
+
+        for (u32 a = 0; a < count; a++) {
+            const u32 child_a = first + a;
+            const u32 count_a = _child_count[child_a];
+            const float area_a = surface_area(min_corner(child_a), max_corner(child_a));
+
+            for (u32 b = a + 1; b < count; b++) {
+                const u32 child_b = first + b;
+                const u32 count_b = _child_count[child_b];
+                const float area_b = surface_area(min_corner(child_b), max_corner(child_b));
+
+                for (u32 i = 0; i < count_a; i++) {
+                    const u32 grand_a = _first_child[child_a] + i;
+                    for (u32 j = 0; j < count_b; j++) {
+                        const u32 grand_b = _first_child[child_b] + j;
+
+                        const float swapped_a = surface_area(glm::min(others[a][i].first, min_corner(grand_b)), glm::max(others[a][i].second, max_corner(grand_b)));
+                        const float swapped_b = surface_area(glm::min(others[b][j].first, min_corner(grand_a)), glm::max(others[b][j].second, max_corner(grand_a)));
+                        const float gain = count_a * (area_a - swapped_a) + count_b * (area_b - swapped_b);
+                        if (gain > best_gain) {
+                            best_gain = gain;
+                            best_a = grand_a;
+                            best_b = grand_b;
+                        }
+                    }
+                }
+            }
+        }
+
+        if (best_a == invalid_index)
+            break;
+
+        const u32 parent_a = _parent[best_a];
+        const u32 parent_b = _parent[best_b];
+        swap_nodes(best_a, best_b);
+        fit_children(parent_a);
+        fit_children(parent_b);
+    }
+
+    // Rotations also move subtrees between levels, which exchanges can not do
+    for (u32 pass = 0; pass < max_treelet_passes && rotate(node); pass++) {
+    }
+
+    for (u32 c = first; c < first + count; c++) {
+        _built_area[c] = surface_area(min_corner(c), max_corner(c));
+    }
+}
+
+void BoundingTree::reserve_nodes(size_t count) {
+    _min_x.reserve(count);
+    _min_y.reserve(count);
+    _min_z.reserve(count);
+    _max_x.reserve(count);
+    _max_y.reserve(count);
+    _max_z.reserve(count);
+
+    _first_child.reserve(count);
+    _child_count.reserve(count);
+    _parent.reserve(count);
+    _instance.reserve(count);
+    _built_area.reserve(count);
+}
+
+u32 BoundingTree::allocate_nodes(u32 count) {
+    const u32 first = u32(_first_child.size());
+    const size_t size = first + size_t(count);
+
+    _min_x.resize(size);
+    _min_y.resize(size);
+    _min_z.resize(size);
+    _max_x.resize(size);
+    _max_y.resize(size);
+    _max_z.resize(size);
+
+    _first_child.resize(size, invalid_index);
+    _child_count.resize(size, 0);
+    _parent.resize(size, invalid_index);
+    _instance.resize(size, invalid_index);
+    _built_area.resize(size, 0.0f);
+
+    return first;
+}
+
+u32 BoundingTree::add_instance(std::shared_ptr<SceneObject> object) {
+    u32 instance = 0;
+    if (!_free_instances.empty()) {
+        instance = _free_instances.back();
+        _free_instances.pop_back();
+        _instances[instance] = std::move(object);
+    }
+    else {
+        instance = u32(_instances.size());
+        _instances.emplace_back(std::move(object));
+        _leaf.resize(_instances.size(), invalid_index);
+        _spheres.resize(_instances.size());
+    }
+    set_sphere(instance);
+
+    return instance;
+}
+
+void BoundingTree::set_sphere(u32 instance) {
+    const BoundingSphere &sphere = _instances[instance]->get_bounding_sphere();
+    const auto &[min, max] = _instances[instance]->get_aabb();
+
+    // Spheres larger than the box would never reject anything the box does not
+    const glm::vec3 size = max - min;
+    const float sphere_volume = 4.0f / 3.0f * glm::pi<float>() * sphere.radius * sphere.radius * sphere.radius;
+    const bool tighter = sphere_volume < size.x * size.y * size.z;
+    _spheres[instance] = glm::vec4(sphere.origin, tighter ? sphere.radius : -1.0f);
+}
+
+void BoundingTree::set_leaf(u32 node, u32 instance, const glm::vec3 &min, const glm::vec3 &max) {
+    _instance[node] = instance;
+    _first_child[node] = invalid_index;
+    _child_count[node] = 0;
+
+    _min_x[node] = min.x; _min_y[node] = min.y; _min_z[node] = min.z;
+    _max_x[node] = max.x; _max_y[node] = max.y; _max_z[node] = max.z;
+
+    link_leaf(node);
+}
+
+void BoundingTree::link_leaf(u32 node) {
+    // Subtrees built in their own storage have no leaf table, their leaves are linked once appended
+    const u32 instance = _instance[node];
+    if (instance != invalid_index && instance < _leaf.size())
+        _leaf[instance] = node;
+}
+
+void BoundingTree::move_node(u32 from, u32 to) {
+    _min_x[to] = _min_x[from];
+    _min_y[to] = _min_y[from];
+    _min_z[to] = _min_z[from];
+    _max_x[to] = _max_x[from];
+    _max_y[to] = _max_y[from];
+    _max_z[to] = _max_z[from];
+
+    _first_child[to] = _first_child[from];
+    _child_count[to] = _child_count[from];
+    _parent[to] = _parent[from];
+    _instance[to] = _instance[from];
+    _built_area[to] = _built_area[from];
+    link_leaf(to);
+
+    for (u32 c = _first_child[to]; c < _first_child[to] + _child_count[to]; c++) {
+        _parent[c] = to;
+    }
+}
+
+void BoundingTree::compact() {
+    BoundingTree compacted;
+    compacted._instances = std::move(_instances);
+    compacted._free_instances = std::move(_free_instances);
+    compacted._leaf = std::move(_leaf);
+    compacted._spheres = std::move(_spheres);
+    compacted._moved = std::move(_moved);
+    compacted._rebuild_budget = _rebuild_budget;
+    compacted._subdivisions = _subdivisions;
+    compacted._strategy = _strategy;
+    compacted.allocate_nodes(1);
+
+    // Copy the live nodes, allocating sibling ranges in the same depth-first order as the builder
+    std::vector<std::pair<u32, u32>> stack = { { 0, 0 } };
+    while (!stack.empty()) {
+        const auto [from, to] = stack.back();
+        stack.pop_back();
+
+        compacted._min_x[to] = _min_x[from];
+        compacted._min_y[to] = _min_y[from];
+        compacted._min_z[to] = _min_z[from];
+        compacted._max_x[to] = _max_x[from];
+        compacted._max_y[to] = _max_y[from];
+        compacted._max_z[to] = _max_z[from];
+        compacted._instance[to] = _instance[from];
+        compacted._built_area[to] = _built_area[from];
+        compacted.link_leaf(to);
+
+        const u32 count = _child_count[from];
+        if (count == 0)
+            continue;
+
+        const u32 first = compacted.allocate_nodes(count);
+        compacted._first_child[to] = first;
+        compacted._child_count[to] = count;
+
+        for (u32 i = count; i-- > 0;) {
+            compacted._parent[first + i] = to;
+            stack.emplace_back(_first_child[from] + i, first + i);
+        }
+    }
+
+    *this = std::move(compacted);
+}
+
+bool BoundingTree::fit_children(u32 node) {
+    const u32 first = _first_child[node];
+    const u32 last = first + _child_count[node];
+
+    float min_x = _min_x[first], min_y = _min_y[first], min_z = _min_z[first];
+    float max_x = _max_x[first], max_y = _max_y[first], max_z = _max_z[first];
+
+    for (u32 c = first + 1; c < last; c++) {
+        min_x = std::min(min_x, _min_x[c]);
+        min_y = std::min(min_y, _min_y[c]);
+        min_z = std::min(min_z, _min_z[c]);
+        max_x = std::max(max_x, _max_x[c]);
+        max_y = std::max(max_y, _max_y[c]);
+        max_z = std::max(max_z, _max_z[c]);
+    }
+
+    const bool changed = min_x != _min_x[node] || min_y != _min_y[node] || min_z != _min_z[node]
+                      || max_x != _max_x[node] || max_y != _max_y[node] || max_z != _max_z[node];
+
+    _min_x[node] = min_x; _min_y[node] = min_y; _min_z[node] = min_z;
+    _max_x[node] = max_x; _max_y[node] = max_y; _max_z[node] = max_z;
+
+    return changed;
+}
+
+u32 BoundingTree::refit_upward(u32 node) {
+    // Stop as soon as a node keeps its bounds, its ancestors can not change either
+    while (node != invalid_index && fit_children(node)) {
+        node = _parent[node];
+    }
+    return node;
+}
+
+bool BoundingTree::mark_moved(InstanceHandle handle) {
+    if (handle >= _leaf.size() || _leaf[handle] == invalid_index)
+        return false;
+
+    _moved.push_back(handle);
+    return true;
+}
+
+bool BoundingTree::has_moved_objects() const {
+    return !_moved.empty();
+}
+
+BoundingTree BoundingTree::snapshot() const {
+    BoundingTree copy = *this;
+    for (std::shared_ptr<SceneObject> &object : copy._instances) {
+        if (!object)
+            continue;
+
+        auto frozen = std::make_shared<SceneObject>(object->get_mesh(), object->get_material());
+        frozen->set_transform(object->transform());
+        object = std::move(frozen);
+    }
+    return copy;
+}
+
+RefitStats BoundingTree::refit(ThreadPool *pool) {
+    RefitStats stats;
+    if (_moved.empty())
+        return stats;
+
+    // Touched nodes are refitted deepest first, so every node is refitted once, after all its children.
+    // Equal entries are popped consecutively, which removes duplicates.
+    std::priority_queue<std::pair<u32, u32>> queue;
+    for (const u32 instance : _moved) {
+        const u32 leaf = _leaf[instance];
+        // Removed since it was marked
+        if (leaf == invalid_index)
+            continue;
+
+        const auto &aabb = _instances[instance]->get_aabb();
+        set_sphere(instance);
+        _min_x[leaf] = aabb.first.x; _min_y[leaf] = aabb.first.y; _min_z[leaf] = aabb.first.z;
+        _max_x[leaf] = aabb.second.x; _max_y[leaf] = aabb.second.y; _max_z[leaf] = aabb.second.z;
+        stats.moved_objects++;
+
+        u32 depth = 0;
+        for (u32 n = _parent[leaf]; n != invalid_index; n = _parent[n]) {
+            depth++;
+        }
+        if (depth != 0)
+            queue.emplace(depth - 1, _parent[leaf]);
+    }
+    _moved.clear();
+
+    // Degraded nodes, with the growth of their surface area
+    std::vector<std::pair<float, u32>> degraded;
+    std::pair<u32, u32> previous = { invalid_index, invalid_index };
+    while (!queue.empty()) {
+        const auto [depth, node] = queue.top();
+        queue.pop();
+        if (previous.first == depth && previous.second == node)
+            continue;
+        previous = { depth, node };
+
+        stats.refit_nodes++;
+        if (!fit_children(node))
+            continue;
+
+        const float area = surface_area(min_corner(node), max_corner(node));
+        if (_built_area[node] <= 0.0f) {
+            // Created by insert()
+            _built_area[node] = area;
+        }
+        else if (area > rebuild_area_ratio * _built_area[node]) {
+            degraded.emplace_back(area - _built_area[node], node);
+        }
+
+        if (depth != 0)
+            queue.emplace(depth - 1, _parent[node]);
+    }
+
+    // The nodes that degraded the most are handled first, until the budget is spent.
+    // Unused budget is kept, so that large subtrees are rebuilt once enough objects moved.
+    std::sort(degraded.begin(), degraded.end(), std::greater<>());
+    _rebuild_budget = std::min(_rebuild_budget + stats.moved_objects * rebuild_leaves_per_moved_object, _instances.size());
+    std::vector<u32> rebuilt;
+
+    for (const auto &[growth, degraded_node] : degraded) {
+        // Rebuilding a node does not make it smaller: the subtree that is rebuilt is the first ancestor
+        // large enough for the leaves of the degraded node to be regrouped with their new neighbours
+        const float area = surface_area(min_corner(degraded_node), max_corner(degraded_node));
+        u32 node = degraded_node;
+        while (_parent[node] != invalid_index && surface_area(min_corner(node), max_corner(node)) < rebuild_area_ratio * area) {
+            node = _parent[node];
+        }
+
+        // Slots of rebuilt subtrees are dead, but still lead to the rebuilt node through their parents
+        bool nested = false;
+        for (u32 n = node; n != invalid_index && !nested; n = _parent[n]) {
+            nested = std::find(rebuilt.begin(), rebuilt.end(), n) != rebuilt.end();
+        }
+        if (nested)
+            continue;
+
+        const size_t leaves = rebuild_subtree(node, _rebuild_budget, pool);
+        if (leaves > _rebuild_budget)
+            break;
 
-namespace OM3D {
+        if (leaves) {
+            rebuilt.push_back(node);
+            _rebuild_budget -= leaves;
+            stats.rebuilt_subtrees++;
+        }
+    }
 
-BoundingTree::BoundingTree() {}
+    if (_dead_nodes > node_count())
+        compact();
 
-BoundingTree::BoundingTree(std::shared_ptr<SceneObject> object)
-    : _object(object)
-    , _children(std::vector<BoundingTree>())
-{
-    auto aabb = object->get_aabb();
-    _min_corner = aabb.first;
-    _max_corner = aabb.second;
+    return stats;
 }
 
-BoundingTree::BoundingTree(std::vector<BoundingTree> &children)
-    : _object(nullptr)
-    , _children(std::move(children))
-{
-    // Fit new bounding box to children bounding boxes
-    fit_children();
+size_t BoundingTree::rebuild_subtree(u32 node, size_t max_leaves, ThreadPool *pool) {
+    BuildContext ctx;
+    ctx.subdivisions = _subdivisions;
+    ctx.strategy = _strategy;
+    ctx.pool = pool && pool->thread_count() > 1 ? pool : nullptr;
+
+    // Gather the leaves, the builder works on local indices into instances
+    std::vector<u32> instances;
+    size_t released = 0;
+    std::vector<u32> stack = { node };
+    while (!stack.empty()) {
+        const u32 n = stack.back();
+        stack.pop_back();
+
+        if (_instance[n] != invalid_index) {
+            instances.push_back(_instance[n]);
+            ctx.min_corners.push_back(min_corner(n));
+            ctx.max_corners.push_back(max_corner(n));
+
+            if (instances.size() > max_leaves)
+                return instances.size();
+            continue;
+        }
+
+        released += _child_count[n];
+        for (u32 c = _first_child[n]; c < _first_child[n] + _child_count[n]; c++) {
+            stack.push_back(c);
+        }
+    }
+
+    // Few enough leaves to be direct children, a rebuild would give the same node
+    if (instances.size() <= _subdivisions) {
+        _built_area[node] = surface_area(min_corner(node), max_corner(node));
+        return 0;
+    }
+
+    const u32 count = u32(instances.size());
+    ctx.indices.resize(count);
+    std::iota(ctx.indices.begin(), ctx.indices.end(), 0);
+
+    if (is_linear(ctx.strategy))
+        ctx.sort_morton();
+
+    BoundingTree subtree;
+    subtree._subdivisions = _subdivisions;
+    subtree.allocate_nodes(1);
+    subtree.build_recursive(ctx, 0, 0, count);
+    if (_strategy == BuildStrategy::LBVHTreelets)
+        subtree.optimize_treelets(ctx.pool);
+
+    for (u32 &instance : subtree._instance) {
+        if (instance != invalid_index)
+            instance = instances[instance];
+    }
+
+    // The old slots below node are dead, the new subtree is appended
+    _dead_nodes += released;
+    append_subtree(subtree, node);
+
+    return count;
 }
 
-void BoundingTree::subdivise(size_t subdivisions) {
-    if (_children.size() <= subdivisions)
-        return;
+InstanceHandle BoundingTree::insert(std::shared_ptr<SceneObject> object, size_t subdivisions) {
+    const auto aabb = object->get_aabb();
+    const u32 instance = add_instance(std::move(object));
+
+    if (is_empty()) {
+        allocate_nodes(1);
+        set_leaf(0, instance, aabb.first, aabb.second);
+        return instance;
+    }
+
+    const auto [node, paired] = find_insert_position(aabb.first, aabb.second, subdivisions);
+
+    if (paired) {
+        // The node is replaced by a new node with the current node and the new object as children
+        const u32 first = allocate_nodes(2);
+        move_node(node, first);
+        set_leaf(first + 1, instance, aabb.first, aabb.second);
+        _parent[first] = node;
+        _parent[first + 1] = node;
+
+        _instance[node] = invalid_index;
+        _first_child[node] = first;
+        _child_count[node] = 2;
+        _built_area[node] = surface_area(glm::min(min_corner(first), aabb.first), glm::max(max_corner(first), aabb.second));
+    }
+    else {
+        // The sibling range is moved to the end of the array with one more slot
+        const u32 count = _child_count[node];
+        const u32 old_first = _first_child[node];
+        const u32 first = allocate_nodes(count + 1);
+
+        for (u32 i = 0; i < count; i++) {
+            move_node(old_first + i, first + i);
+        }
+        set_leaf(first + count, instance, aabb.first, aabb.second);
+        _parent[first + count] = node;
+
+        _first_child[node] = first;
+        _child_count[node] = count + 1;
+        _dead_nodes += count;
+    }
 
-    float x_length = _max_corner.x - _min_corner.x;
-    float y_length = _max_corner.y - _min_corner.y;
-    float z_length = _max_corner.z - _min_corner.z;
-    int longest_axis = x_length > y_length ? (x_length > z_length ? 0 : 2)
-                                           : (y_length > z_length ? 1 : 2);
-    
-    // Compare the objects center relative to the longest axis of the current bounding tree
-    auto cmp = [&](const BoundingTree &a, const BoundingTree &b) {
-        return (a._min_corner[longest_axis] + a._max_corner[longest_axis]) * 0.5
-             < (b._min_corner[longest_axis] + b._max_corner[longest_axis]) * 0.5;
+    rotate_upward(node, refit_upward(node));
+
+    if (_dead_nodes > node_count())
+        compact();
+
+    return instance;
+}
+
+std::pair<u32, bool> BoundingTree::find_insert_position(const glm::vec3 &min, const glm::vec3 &max, size_t subdivisions) const {
+    // Branch and bound search with the cost model of sah_cost(), where a node costs its area times its number of children.
+    // The leaf either becomes a child of a node with room left, or is paired with a node under a new node.
+    // Every placement below a node pays for the growth of that node, which bounds the cost of its subtree.
+    struct Candidate {
+        float bound;
+        float inherited; // Growth of the ancestors
+        u32 node;
+
+        bool operator<(const Candidate &other) const {
+            return bound > other.bound;
+        }
     };
 
-    std::sort(_children.begin(), _children.end(), cmp);
+    const float leaf_area = surface_area(min, max);
+
+    std::priority_queue<Candidate> queue;
+    queue.push(Candidate{ 0.0f, 0.0f, 0 });
+
+    float best_cost = std::numeric_limits<float>::max();
+    std::pair<u32, bool> best = { 0, true };
 
-    std::vector<BoundingTree> new_children(subdivisions);
-    for (size_t i = 0; i < subdivisions; i++) {
+    while (!queue.empty()) {
+        const Candidate candidate = queue.top();
+        queue.pop();
+        if (candidate.bound >= best_cost)
+            break;
 
-        // New vector containing every child in the space's subdivision
-        std::vector<BoundingTree> new_child(
-            _children.begin() + _children.size() * i / subdivisions,
-            _children.begin() + _children.size() * (i + 1) / subdivisions
-        );
+        const u32 node = candidate.node;
+        const float area = surface_area(min_corner(node), max_corner(node));
+        const float merged_area = surface_area(glm::min(min_corner(node), min), glm::max(max_corner(node), max));
 
-        if (new_child.size() == 1) {
-            new_children[i] = new_child.front();
+        const float paired_cost = candidate.inherited + 2.0f * merged_area;
+        if (paired_cost < best_cost) {
+            best_cost = paired_cost;
+            best = { node, true };
+        }
+
+        if (_instance[node] != invalid_index)
+            continue;
+
+        const u32 count = _child_count[node];
+        const float growth = count * (merged_area - area);
+
+        if (count < subdivisions) {
+            const float child_cost = candidate.inherited + growth + merged_area;
+            if (child_cost < best_cost) {
+                best_cost = child_cost;
+                best = { node, false };
+            }
+        }
+
+        const float inherited = candidate.inherited + growth;
+        if (inherited + leaf_area >= best_cost)
+            continue;
+
+        const u32 first = _first_child[node];
+        for (u32 c = first; c < first + count; c++) {
+            // Either paired with the child, or placed below it which pays for its growth and at least the area of the leaf
+            const float child_area = surface_area(min_corner(c), max_corner(c));
+            const float child_merged_area = surface_area(glm::min(min_corner(c), min), glm::max(max_corner(c), max));
+
+            float bound = inherited + 2.0f * child_merged_area;
+            if (_instance[c] == invalid_index)
+                bound = std::min(bound, inherited + _child_count[c] * (child_merged_area - child_area) + leaf_area);
+
+            if (bound < best_cost)
+                queue.push(Candidate{ bound, inherited, c });
         }
-        else {
-            new_children[i] = BoundingTree(new_child);
-        }      
     }
 
-    _children = std::move(new_children);
+    return best;
+}
+
+void BoundingTree::swap_nodes(u32 a, u32 b) {
+    // Slots keep their parent, the content and its children are exchanged
+    std::swap(_min_x[a], _min_x[b]);
+    std::swap(_min_y[a], _min_y[b]);
+    std::swap(_min_z[a], _min_z[b]);
+    std::swap(_max_x[a], _max_x[b]);
+    std::swap(_max_y[a], _max_y[b]);
+    std::swap(_max_z[a], _max_z[b]);
+
+    std::swap(_first_child[a], _first_child[b]);
+    std::swap(_child_count[a], _child_count[b]);
+    std::swap(_instance[a], _instance[b]);
+    std::swap(_built_area[a], _built_area[b]);
 
-    for (auto &c : _children) {
-        c.subdivise(subdivisions);
+    for (const u32 node : { a, b }) {
+        for (u32 c = _first_child[node]; c < _first_child[node] + _child_count[node]; c++) {
+            _parent[c] = node;
+        }
+        link_leaf(node);
     }
 }
 
-bool BoundingTree::fit_children() {
-    glm::vec3 current_min = _min_corner;
-    glm::vec3 current_max = _max_corner;
+bool BoundingTree::rotate(u32 node) {
+    const u32 first = _first_child[node];
+    const u32 count = _child_count[node];
+    if (count < 2 || count > max_rotation_fanout)
+        return false;
+
+    // Exchanging a child of node with a grandchild only changes the bounds of the grandchild's parent
+    float best_gain = 0.0f;
+    u32 best_child = invalid_index;
+    u32 best_grandchild = invalid_index;
+
+    std::array<glm::vec3, max_rotation_fanout + 1> prefix_min, prefix_max, suffix_min, suffix_max;
+    for (u32 c = first; c < first + count; c++) {
+        const u32 grand_first = _first_child[c];
+        const u32 grand_count = _child_count[c];
+        if (_instance[c] != invalid_index || grand_count > max_rotation_fanout)
+            continue;
 
-    _min_corner = _children.front()._min_corner;
-    _max_corner = _children.front()._max_corner;
+        // Bounds of the grandchildren before and after each of them
+        prefix_min[0] = suffix_min[grand_count] = glm::vec3(std::numeric_limits<float>::max());
+        prefix_max[0] = suffix_max[grand_count] = glm::vec3(std::numeric_limits<float>::lowest());
+        for (u32 i = 0; i < grand_count; i++) {
+            prefix_min[i + 1] = glm::min(prefix_min[i], min_corner(grand_first + i));
+            prefix_max[i + 1] = glm::max(prefix_max[i], max_corner(grand_first + i));
+        }
+        for (u32 i = grand_count; i-- > 0;) {
+            suffix_min[i] = glm::min(suffix_min[i + 1], min_corner(grand_first + i));
+            suffix_max[i] = glm::max(suffix_max[i + 1], max_corner(grand_first + i));
+        }
 
-    for (size_t i = 1; i < _children.size(); i++) {
-        const glm::vec3 &min = _children[i]._min_corner;
-        const glm::vec3 &max = _children[i]._max_corner;
+        const float area = surface_area(min_corner(c), max_corner(c));
+        for (u32 i = 0; i < grand_count; i++) {
+            const glm::vec3 others_min = glm::min(prefix_min[i], suffix_min[i + 1]);
+            const glm::vec3 others_max = glm::max(prefix_max[i], suffix_max[i + 1]);
 
-        if (_min_corner.x > min.x)
-            _min_corner.x = min.x;
-        if (_min_corner.y > min.y)
-            _min_corner.y = min.y;
-        if (_min_corner.z > min.z)
-            _min_corner.z = min.z;
+            for (u32 s = first; s < first + count; s++) {
+                if (s == c)
+                    continue;
 
-        if (_max_corner.x < max.x)
-            _max_corner.x = max.x;
-        if (_max_corner.y < max.y)
-            _max_corner.y = max.y;
-        if (_max_corner.z < max.z)
-            _max_corner.z = max.z;
+                const float rotated_area = surface_area(glm::min(others_min, min_corner(s)), glm::max(others_max, max_corner(s)));
+                const float gain = grand_count * (area - rotated_area);
+                if (gain > best_gain) {
+                    best_gain = gain;
+                    best_child = s;
+                    best_grandchild = grand_first + i;
+                }
+            }
+        }
     }
 
-    return _min_corner != current_min || _max_corner != current_max;
+    if (best_child == invalid_index)
+        return false;
+
+    const u32 parent = _parent[best_grandchild];
+    swap_nodes(best_child, best_grandchild);
+    fit_children(parent);
+    return true;
 }
 
-void BoundingTree::insert(BoundingTree &obj, size_t subdivision) {
-    // Leaf, so we create a new node with the current object and the new object as children
-    if (_object) {
-        _children.emplace_back(BoundingTree(_object));
-        _children.emplace_back(std::move(obj));
-        _object = nullptr;
-        fit_children();
-        return;
+void BoundingTree::rotate_upward(u32 node, u32 unchanged) {
+    // Rotations can only help where a child or a grandchild changed: up to the parent of the first unchanged node
+    const u32 last = unchanged == invalid_index ? invalid_index : _parent[unchanged];
+    for (; node != invalid_index; node = _parent[node]) {
+        rotate(node);
+        if (node == last)
+            break;
     }
+}
 
-    if (_children.size() < subdivision) {
-        _children.emplace_back(std::move(obj));
-        fit_children();
-        return;
+bool BoundingTree::remove(InstanceHandle handle) {
+    if (handle >= _leaf.size() || _leaf[handle] == invalid_index)
+        return false;
+
+    const u32 instance = handle;
+    const u32 leaf = _leaf[instance];
+    _instances[instance] = nullptr;
+    _leaf[instance] = invalid_index;
+    _free_instances.push_back(instance);
+
+    // The root was the last object, the instance table is kept so that handles stay stable
+    if (leaf == 0) {
+        BoundingTree empty;
+        empty._instances = std::move(_instances);
+        empty._free_instances = std::move(_free_instances);
+        empty._leaf = std::move(_leaf);
+        empty._spheres = std::move(_spheres);
+        empty._subdivisions = _subdivisions;
+        empty._strategy = _strategy;
+        *this = std::move(empty);
+        return true;
     }
 
-    std::vector<glm::vec3> tmp_results;
+    // Fill the hole with the last sibling to keep the range contiguous
+    const u32 parent = _parent[leaf];
+    const u32 last = _first_child[parent] + _child_count[parent] - 1;
+    if (leaf != last)
+        move_node(last, leaf);
 
-    glm::vec3 obj_halfsize = (obj._max_corner - obj._min_corner) * 0.5f;
-    glm::vec3 object_center = (obj._min_corner + obj._max_corner) * 0.5f;
+    _child_count[parent]--;
+    _dead_nodes++;
 
-    // Find a child that encloses the new object
-    for (auto &c : _children) {
-        glm::vec3 child_halfsize = (c._max_corner - c._min_corner) * 0.5f;
-        glm::vec3 child_center = (c._min_corner + c._max_corner) * 0.5f;
+    // One child means this node is useless
+    if (_child_count[parent] == 1) {
+        const u32 grand_parent = _parent[parent];
+        move_node(_first_child[parent], parent);
+        _parent[parent] = grand_parent;
+        _dead_nodes++;
 
-        glm::vec3 offset = child_center - object_center;
+        rotate_upward(grand_parent, refit_upward(grand_parent));
+    }
+    else {
+        rotate_upward(parent, refit_upward(parent));
+    }
 
-        glm::vec3 intersection = object_center + child_center - offset;
+    if (_dead_nodes > node_count())
+        compact();
 
-        // Object is contained within, no resize necessary
-        if (intersection == obj_halfsize * 2.0f) {
-            c.insert(obj, subdivision);
-            return;
+    return true;
+}
+
+void BoundingTree::frustum_cull(std::vector<std::vector<std::shared_ptr<SceneObject>>> &objects, const Frustum &frustum, CullingStats &stats, CullingKernel kernel,
+                                const OcclusionBuffer *occlusion, OcclusionQueries *queries, HlodProxies *proxies) const {
+    if (is_empty())
+        return;
+
+    if (_rejecting_plane.size() != _instance.size())
+        _rejecting_plane.assign(_instance.size(), no_plane);
+
+    PlaneMasks root_masks;
+    stats.checks++;
+    stats.plane_tests += Frustum::plane_count;
+    if (!frustum_cull_boxes(kernel, boxes(0), 1, frustum, all_frustum_planes, root_masks))
+        return;
+
+    auto is_occluded = [&](u32 node) {
+        if (queries) {
+            const bool hidden = queries->is_hidden(node, min_corner(node), max_corner(node), _instance[node] != invalid_index);
+            stats.occluded_nodes += hidden;
+            return hidden;
         }
 
-        tmp_results.emplace_back(intersection);
+        if (!occlusion)
+            return false;
+
+        stats.occlusion_tests++;
+        const bool occluded = occlusion->is_occluded(min_corner(node), max_corner(node));
+        stats.occluded_nodes += occluded;
+        return occluded;
+    };
+
+    if (is_occluded(0))
+        return;
+
+    // Nodes are pushed with the planes they still have to test
+    std::vector<std::pair<u32, u32>> stack;
+    stack.reserve(64);
+    stack.emplace_back(0, all_frustum_planes);
+    for (u32 p = 0; p != Frustum::plane_count; ++p) {
+        if (root_masks.inside[p])
+            stack.back().second &= ~(1u << p);
     }
 
-    float best_value = 0.f;
-    int best_index = -1;
+    while (!stack.empty()) {
+        const auto [node, planes] = stack.back();
+        stack.pop_back();
 
-    // No suitable child has been found, so we find the child that encloses the best the object
-    for (int i = 0; i < (int)tmp_results.size(); i++) {
-        auto &inter = tmp_results[i];
+        if (_instance[node] != invalid_index) {
+            const std::shared_ptr<SceneObject> &object = _instances[_instance[node]];
+            objects[object->id].push_back(object);
+            continue;
+        }
 
-        // No intersection
-        if (inter.x < 0 || inter.y < 0 || inter.z < 0)
+        if (proxies && proxies->select(node, min_corner(node), max_corner(node)))
             continue;
 
-        float volume = inter.x * inter.y * inter.z;
-        if (volume > best_value) {
-            best_value = volume;
-            best_index = i;
+        // Fully inside the frustum: every node below would have been tested against every plane.
+        // Nodes still have to be tested for occlusion or replaced by proxies, their children are then tested against no plane.
+        if (!planes && !occlusion && !queries && !proxies) {
+            stats.saved_plane_tests += collect_subtree(node, objects) * Frustum::plane_count;
+            continue;
         }
-    }
 
-    if (best_index != -1) {
-        _children[best_index].insert(obj, subdivision);
-        fit_children();
-        return;
+        const u32 plane_count = count_set_bits(planes);
+
+        // Children are tested as a batch, by blocks of 32 to fit the visibility mask
+        const u32 first = _first_child[node];
+        const u32 count = _child_count[node];
+        for (u32 base = count; base > 0;) {
+            const u32 block = std::min(base, 32u);
+            base -= block;
+
+            const u32 block_first = first + base;
+            const BoxesSoA block_boxes = boxes(block_first);
+            const u32 block_mask = block == 32 ? ~0u : (1u << block) - 1;
+            size_t plane_tests = 0;
+
+            // Leaves first test their bounding sphere when it is smaller than their box, as for rotated compact objects.
+            // Leaves whose sphere is outside a plane or inside every plane skip the box tests.
+            u32 rejected = 0;
+            u32 accepted = 0;
+            for (u32 i = 0; i != block; ++i) {
+                const u32 instance = _instance[block_first + i];
+                if (instance == invalid_index)
+                    continue;
+
+                const glm::vec4 &sphere = _spheres[instance];
+                if (sphere.w < 0.0f)
+                    continue;
+
+                bool inside = true;
+                for (u32 remaining_planes = planes; remaining_planes; remaining_planes &= remaining_planes - 1) {
+                    const u32 p = count_trailing_zeros(remaining_planes);
+                    stats.sphere_tests++;
+                    const float distance = frustum._plane_x[p] * sphere.x + frustum._plane_y[p] * sphere.y + frustum._plane_z[p] * sphere.z + frustum._plane_w[p];
+                    if (distance < -sphere.w) {
+                        rejected |= 1u << i;
+                        _rejecting_plane[block_first + i] = u8(p);
+                        inside = false;
+                        break;
+                    }
+                    inside &= distance >= sphere.w;
+                }
+                if (inside)
+                    accepted |= 1u << i;
+            }
+            stats.sphere_rejections += count_set_bits(rejected);
+
+            // Try the plane that rejected each child in the previous frames first
+            std::array<u32, Frustum::plane_count> cached = {};
+            for (u32 i = 0; i != block; ++i) {
+                const u8 p = _rejecting_plane[block_first + i];
+                if (p != no_plane && (planes & (1u << p)) && !((rejected | accepted) & (1u << i)))
+                    cached[p] |= 1u << i;
+            }
+
+            for (u32 p = 0; p != Frustum::plane_count; ++p) {
+                if (!cached[p])
+                    continue;
+
+                PlaneMasks masks;
+                frustum_cull_boxes(kernel, block_boxes, block, frustum, 1u << p, masks);
+                rejected |= masks.outside[p] & cached[p];
+                plane_tests += count_set_bits(cached[p]);
+            }
+
+            // Children not rejected by their cached plane are tested against every remaining plane
+            const u32 remaining = block_mask & ~(rejected | accepted);
+            u32 visible = accepted;
+            PlaneMasks masks;
+            if (remaining) {
+                visible |= frustum_cull_boxes(kernel, block_boxes, block, frustum, planes, masks) & remaining;
+                plane_tests += size_t(count_set_bits(remaining)) * plane_count;
+
+                for (u32 newly_rejected = remaining & ~visible; newly_rejected; newly_rejected &= newly_rejected - 1) {
+                    const u32 i = count_trailing_zeros(newly_rejected);
+                    u32 p = 0;
+                    while (!(masks.outside[p] & (1u << i))) {
+                        ++p;
+                    }
+                    _rejecting_plane[block_first + i] = u8(p);
+                }
+            }
+
+            // Children missed by their cached plane test it twice, a block can cost more than the budget
+            const size_t budget = size_t(block) * Frustum::plane_count;
+            stats.checks += block;
+            stats.plane_tests += plane_tests;
+            if (plane_tests < budget)
+                stats.saved_plane_tests += budget - plane_tests;
+
+            // Children are pushed in reverse so that they are visited in memory order
+            while (visible) {
+                const u32 bit = 31 - count_leading_zeros(visible);
+                visible &= ~(1u << bit);
+                _rejecting_plane[block_first + bit] = no_plane;
+
+                if (is_occluded(block_first + bit))
+                    continue;
+
+                u32 child_planes = planes;
+                for (u32 p = 0; p != Frustum::plane_count; ++p) {
+                    if (masks.inside[p] & (1u << bit))
+                        child_planes &= ~(1u << p);
+                }
+                stack.emplace_back(block_first + bit, child_planes);
+            }
+        }
     }
+}
 
-    best_value = std::numeric_limits<float>::max();
-    // Worst case scenario, we just take the closest child
-    for (int i = 0; i < (int)_children.size(); i++) {
-        glm::vec3 child_center = (_children[i]._min_corner + _children[i]._max_corner) * 0.5f;
-        float dist = glm::distance(object_center, child_center);
+size_t BoundingTree::collect_subtree(u32 node, std::vector<std::vector<std::shared_ptr<SceneObject>>> &objects) const {
+    size_t nodes = 0;
+    std::vector<u32> stack = { node };
+    while (!stack.empty()) {
+        const u32 n = stack.back();
+        stack.pop_back();
 
-        if (dist < best_value) {
-            best_value = dist;
-            best_index = i;
+        if (_instance[n] != invalid_index) {
+            const std::shared_ptr<SceneObject> &object = _instances[_instance[n]];
+            objects[object->id].push_back(object);
+            continue;
+        }
+
+        const u32 first = _first_child[n];
+        const u32 count = _child_count[n];
+        nodes += count;
+        for (u32 c = first + count; c-- > first;) {
+            stack.push_back(c);
         }
     }
 
-    _children[best_index].insert(obj, subdivision);
-    fit_children();
+    return nodes;
 }
 
-RemoveResult BoundingTree::remove(const std::shared_ptr<SceneObject> object) {
-    // Leaf, therefore object
-    if (_children.empty()) {
-        if (_object == object) {
-            return Delete;
+void BoundingTree::frustum_cull_views(const std::vector<Frustum> &frustums, std::vector<ViewVisibility> &visible, CullingStats &stats,
+                                      CullingKernel kernel) const {
+    ALWAYS_ASSERT(frustums.size() <= max_views, "Too many views");
+    if (is_empty() || frustums.empty())
+        return;
+
+    // Nodes are pushed with the views they are inside of, and the planes they still have to test in each of them
+    struct Entry {
+        u32 node;
+        u32 views;
+        std::array<u8, max_views> planes;
+    };
+
+    const auto child_planes = [](const PlaneMasks &masks, u32 planes, u32 bit) {
+        for (u32 p = 0; p != Frustum::plane_count; ++p) {
+            if (masks.inside[p] & (1u << bit))
+                planes &= ~(1u << p);
         }
-        return NotFound;
-    }
+        return u8(planes);
+    };
 
-    for (auto it = _children.begin(); it != _children.end(); it++) {
-        const glm::vec3 &min = it->_min_corner;
-        const glm::vec3 &max = it->_max_corner;
+    Entry root = { 0, 0, {} };
+    for (u32 v = 0; v != frustums.size(); ++v) {
+        PlaneMasks masks;
+        stats.checks++;
+        stats.plane_tests += Frustum::plane_count;
+        if (frustum_cull_boxes(kernel, boxes(0), 1, frustums[v], all_frustum_planes, masks)) {
+            root.views |= 1u << v;
+            root.planes[v] = child_planes(masks, all_frustum_planes, 0);
+        }
+    }
+    if (!root.views)
+        return;
 
-        auto aabb = object->get_aabb();
+    std::vector<Entry> stack;
+    stack.reserve(64);
+    stack.push_back(root);
+    while (!stack.empty()) {
+        const Entry entry = stack.back();
+        stack.pop_back();
 
-        // Check if children can contain object
-        if (min.x <= aabb.first.x && min.y <= aabb.first.y && min.z <= aabb.first.z
-            && max.x >= aabb.second.x && max.y >= aabb.second.y && max.z >= aabb.second.z) {
+        if (_instance[entry.node] != invalid_index) {
+            visible.push_back({ _instance[entry.node], entry.views });
+            continue;
+        }
 
-            RemoveResult res = it->remove(object);
-            if (res == Delete) {
-                _children.erase(it);
+        // Fully inside every view
+        bool inside = true;
+        for (u32 views = entry.views; views; views &= views - 1) {
+            inside &= !entry.planes[count_trailing_zeros(views)];
+        }
+        if (inside) {
+            stats.saved_plane_tests += collect_subtree(entry.node, entry.views, visible) * Frustum::plane_count * count_set_bits(entry.views);
+            continue;
+        }
 
-                // One child means this node is useless
-                if (_children.size() == 1) {
+        const u32 first = _first_child[entry.node];
+        const u32 count = _child_count[entry.node];
+        for (u32 base = count; base > 0;) {
+            const u32 block = std::min(base, 32u);
+            base -= block;
 
-                    auto &child = _children.front();
+            const u32 block_first = first + base;
+            const BoxesSoA block_boxes = boxes(block_first);
 
-                    _object = child._object;
-                    _min_corner = child._min_corner;
-                    _max_corner = child._max_corner;
-                    _children = std::vector<BoundingTree>(child._children);
+            // Every view tests the whole block against its own planes
+            std::array<Entry, 32> children;
+            for (u32 i = 0; i != block; ++i) {
+                children[i].node = block_first + i;
+                children[i].views = 0;
+            }
+            size_t plane_tests = 0;
+            for (u32 views = entry.views; views; views &= views - 1) {
+                const u32 v = count_trailing_zeros(views);
+                PlaneMasks masks;
+                u32 inside_view = frustum_cull_boxes(kernel, block_boxes, block, frustums[v], entry.planes[v], masks);
+                plane_tests += size_t(block) * count_set_bits(entry.planes[v]);
+                stats.saved_plane_tests += size_t(block) * (Frustum::plane_count - count_set_bits(entry.planes[v]));
+                stats.checks += block;
 
-                    return Resize;
+                while (inside_view) {
+                    const u32 i = count_trailing_zeros(inside_view);
+                    inside_view &= inside_view - 1;
+                    children[i].views |= 1u << v;
+                    children[i].planes[v] = child_planes(masks, entry.planes[v], i);
                 }
+            }
+
+            // Leaves whose sphere is tighter than their box drop the views it is outside of
+            for (u32 i = 0; i != block; ++i) {
+                const u32 instance = _instance[block_first + i];
+                if (instance == invalid_index || !children[i].views || _spheres[instance].w < 0.0f)
+                    continue;
 
-                if (fit_children()) {
-                    return Resize;
+                const glm::vec4 &sphere = _spheres[instance];
+                for (u32 views = children[i].views; views; views &= views - 1) {
+                    const u32 v = count_trailing_zeros(views);
+                    const Frustum &frustum = frustums[v];
+                    for (u32 planes = children[i].planes[v]; planes; planes &= planes - 1) {
+                        const u32 p = count_trailing_zeros(planes);
+                        stats.sphere_tests++;
+                        if (frustum._plane_x[p] * sphere.x + frustum._plane_y[p] * sphere.y + frustum._plane_z[p] * sphere.z + frustum._plane_w[p] < -sphere.w) {
+                            children[i].views &= ~(1u << v);
+                            break;
+                        }
+                    }
                 }
+                stats.sphere_rejections += !children[i].views;
+            }
+
+            stats.plane_tests += plane_tests;
+
+            // Children are pushed in reverse so that they are visited in memory order
+            for (u32 i = block; i-- > 0;) {
+                if (children[i].views)
+                    stack.push_back(children[i]);
+            }
+        }
+    }
+}
+
+size_t BoundingTree::collect_subtree(u32 node, u32 views, std::vector<ViewVisibility> &visible) const {
+    size_t nodes = 0;
+    std::vector<u32> stack = { node };
+    while (!stack.empty()) {
+        const u32 n = stack.back();
+        stack.pop_back();
+
+        if (_instance[n] != invalid_index) {
+            visible.push_back({ _instance[n], views });
+            continue;
+        }
+
+        const u32 first = _first_child[n];
+        const u32 count = _child_count[n];
+        nodes += count;
+        for (u32 c = first + count; c-- > first;) {
+            stack.push_back(c);
+        }
+    }
+
+    return nodes;
+}
+
+void BoundingTree::draw_recursive(SceneObject &cube, size_t level) const {
+    if (!is_empty())
+        draw_recursive(0, cube, level);
+}
+
+void BoundingTree::draw_recursive(u32 node, SceneObject &cube, size_t level) const {
+    if (level != 0) {
+        const u32 first = _first_child[node];
+        for (u32 c = first; c < first + _child_count[node]; c++) {
+            draw_recursive(c, cube, level - 1);
+        }
+        return;
+    }
+
+    glm::vec3 size = max_corner(node) - min_corner(node);
+    glm::vec3 center = (min_corner(node) + max_corner(node)) * 0.5f;
+    glm::mat4 transform = glm::translate(glm::mat4(1), center) * glm::scale(glm::mat4(1), size);
+
+    cube.get_material()->set_uniform(HASH("middle"), center);
+    cube.render(transform);
+}
+
+std::vector<u32> BoundingTree::flatten(std::vector<shader::BVHNode> &nodes) const {
+    nodes.clear();
+    nodes.reserve(node_count());
+
+    std::vector<u32> depths = { 0 };
+    if (is_empty())
+        return depths;
+
+    // Tree node of every flattened node
+    std::vector<u32> sources = { 0 };
+    nodes.push_back({ min_corner(0), invalid_index, max_corner(0), _instance[0] });
 
-                return NotFound;
+    for (u32 begin = 0; begin < sources.size();) {
+        const u32 end = u32(sources.size());
+        for (u32 i = begin; i < end; i++) {
+            const u32 first = _first_child[sources[i]];
+            for (u32 c = first; c < first + _child_count[sources[i]]; c++) {
+                sources.push_back(c);
+                nodes.push_back({ min_corner(c), i, max_corner(c), _instance[c] });
             }
-            else if (res == Resize) {
-                return fit_children() ? Resize : NotFound;
+        }
+        depths.push_back(end);
+        begin = end;
+    }
+
+    return depths;
+}
+
+bool BoundingTree::raycast(const Ray &ray, RayHit &hit) const {
+    return trace_ray(ray, hit, false);
+}
+
+bool BoundingTree::raycast_any(const Ray &ray) const {
+    RayHit hit;
+    return trace_ray(ray, hit, true);
+}
+
+bool BoundingTree::trace_ray(const Ray &ray, RayHit &hit, bool any_hit) const {
+    if (is_empty())
+        return false;
+
+    const glm::vec3 inv_direction = 1.0f / ray.direction;
+    float distance = ray.max_distance;
+
+    float entry = 0.0f;
+    if (!intersect_ray_box(min_corner(0), max_corner(0), ray.origin, inv_direction, distance, entry))
+        return false;
+
+    bool found = false;
+
+    // Nodes are pushed with the distance at which the ray enters them
+    std::vector<std::pair<u32, float>> stack;
+    stack.reserve(64);
+    stack.emplace_back(0, entry);
+    while (!stack.empty()) {
+        const auto [node, node_entry] = stack.back();
+        stack.pop_back();
+        if (node_entry > distance)
+            continue;
+
+        if (_instance[node] != invalid_index) {
+            const SceneObject &object = *_instances[_instance[node]];
+
+            // Distances do not change in mesh space, since the direction is transformed without being normalized
+            const glm::mat4 to_mesh = glm::affineInverse(object.transform());
+            Ray mesh_ray;
+            mesh_ray.origin = glm::vec3(to_mesh * glm::vec4(ray.origin, 1.0f));
+            mesh_ray.direction = glm::vec3(to_mesh * glm::vec4(ray.direction, 0.0f));
+
+            u32 triangle = 0;
+            if (object.get_mesh()->triangle_tree().intersect(mesh_ray, distance, triangle, any_hit)) {
+                hit = { _instance[node], distance, triangle };
+                found = true;
+                if (any_hit)
+                    return true;
             }
+            continue;
+        }
+
+        const size_t pushed = stack.size();
+        for (u32 c = _first_child[node]; c < _first_child[node] + _child_count[node]; c++) {
+            float child_entry = 0.0f;
+            if (intersect_ray_box(min_corner(c), max_corner(c), ray.origin, inv_direction, distance, child_entry))
+                stack.emplace_back(c, child_entry);
+        }
+
+        // The nearest child is visited first
+        std::sort(stack.begin() + pushed, stack.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+    }
+
+    return found;
+}
+
+void BoundingTree::overlap_box(const glm::vec3 &min, const glm::vec3 &max, std::vector<InstanceHandle> &handles) const {
+    if (is_empty())
+        return;
+
+    std::vector<u32> stack = { 0 };
+    while (!stack.empty()) {
+        const u32 node = stack.back();
+        stack.pop_back();
+
+        if (glm::any(glm::greaterThan(min_corner(node), max)) || glm::any(glm::lessThan(max_corner(node), min)))
+            continue;
+
+        if (_instance[node] != invalid_index) {
+            handles.push_back(_instance[node]);
+            continue;
+        }
+
+        for (u32 c = _first_child[node]; c < _first_child[node] + _child_count[node]; c++) {
+            stack.push_back(c);
         }
     }
+}
 
-    return NotFound;
+// Squared distance from the point to the box, 0 inside
+static float distance2(const glm::vec3 &point, const glm::vec3 &min, const glm::vec3 &max) {
+    const glm::vec3 d = glm::max(glm::max(min - point, point - max), glm::vec3(0.0f));
+    return glm::dot(d, d);
 }
 
-void BoundingTree::frustum_cull(std::vector<std::vector<std::shared_ptr<SceneObject>>> &objects, const Frustum &frustum, size_t &counter) const {
-    counter++;
-    if (frustum_cull_aabb(frustum))
+void BoundingTree::overlap_sphere(const glm::vec3 &center, float radius, std::vector<InstanceHandle> &handles) const {
+    if (is_empty())
         return;
-    
-    if (_children.empty() && _object) {
-        objects[_object->id].push_back(_object);
+
+    const float radius2 = radius * radius;
+    std::vector<u32> stack = { 0 };
+    while (!stack.empty()) {
+        const u32 node = stack.back();
+        stack.pop_back();
+
+        if (distance2(center, min_corner(node), max_corner(node)) > radius2)
+            continue;
+
+        if (_instance[node] != invalid_index) {
+            handles.push_back(_instance[node]);
+            continue;
+        }
+
+        for (u32 c = _first_child[node]; c < _first_child[node] + _child_count[node]; c++) {
+            stack.push_back(c);
+        }
+    }
+}
+
+void BoundingTree::nearest(const glm::vec3 &point, size_t k, std::vector<InstanceHandle> &handles) const {
+    if (is_empty() || !k)
         return;
+
+    // Best-first: a node is never closer than its parent, so leaves come out of the queue in order of distance
+    using Entry = std::pair<float, u32>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+    queue.emplace(distance2(point, min_corner(0), max_corner(0)), 0);
+
+    const size_t end = handles.size() + k;
+    while (!queue.empty() && handles.size() < end) {
+        const u32 node = queue.top().second;
+        queue.pop();
+
+        if (_instance[node] != invalid_index) {
+            handles.push_back(_instance[node]);
+            continue;
+        }
+
+        for (u32 c = _first_child[node]; c < _first_child[node] + _child_count[node]; c++) {
+            queue.emplace(distance2(point, min_corner(c), max_corner(c)), c);
+        }
     }
+}
+
+bool BoundingTree::is_empty() const {
+    return _instance.empty();
+}
 
-    for (auto &c : _children) {
-        c.frustum_cull(objects, frustum, counter);
+float BoundingTree::sah_cost() const {
+    if (is_empty())
+        return 0.0f;
+
+    // Expected number of node tests for a random query: a child is tested when its parent is reached,
+    // which happens with a probability proportional to the parent surface area
+    const float root_area = surface_area(min_corner(0), max_corner(0));
+    if (root_area <= 0.0f)
+        return 1.0f;
+
+    float cost = 1.0f;
+    std::vector<u32> stack = { 0 };
+    while (!stack.empty()) {
+        const u32 node = stack.back();
+        stack.pop_back();
+
+        const u32 first = _first_child[node];
+        const u32 count = _child_count[node];
+        cost += surface_area(min_corner(node), max_corner(node)) / root_area * count;
+
+        for (u32 c = first; c < first + count; c++) {
+            stack.push_back(c);
+        }
     }
+
+    return cost;
 }
 
-bool BoundingTree::frustum_cull_aabb(const Frustum &frustum) const {
+size_t BoundingTree::node_count() const {
+    return _instance.size() - _dead_nodes;
+}
 
-    if (frustum_cull_aabb_plane(frustum._near_normal, frustum._position))
-        return true;
-    if (frustum_cull_aabb_plane(frustum._left_normal, frustum._position))
-        return true;
-    if (frustum_cull_aabb_plane(frustum._right_normal, frustum._position))
-        return true;
-    if (frustum_cull_aabb_plane(frustum._top_normal, frustum._position))
-        return true;
-    if (frustum_cull_aabb_plane(frustum._bottom_normal, frustum._position))
-        return true;
-    return false;
+size_t BoundingTree::slot_count() const {
+    return _instance.size();
 }
 
-bool BoundingTree::frustum_cull_aabb_plane(const glm::vec3 &plane_normal, const glm::vec3 &plane_position) const {
-    glm::vec3 far_vert(
-        plane_normal.x < 0.0f ? _min_corner.x : _max_corner.x,
-        plane_normal.y < 0.0f ? _min_corner.y : _max_corner.y,
-        plane_normal.z < 0.0f ? _min_corner.z : _max_corner.z
-    );
+u32 BoundingTree::parent(u32 node) const {
+    return _parent[node];
+}
 
-    return dot(plane_normal, far_vert - plane_position) <= 0;
+u32 BoundingTree::first_child(u32 node) const {
+    return _first_child[node];
 }
 
-void BoundingTree::draw_recursive(SceneObject &cube, size_t level) {
-    if (level != 0) {
-        for (auto &c : _children) {
-            c.draw_recursive(cube, level - 1);
+u32 BoundingTree::child_count(u32 node) const {
+    return _child_count[node];
+}
+
+size_t BoundingTree::leaf_count(u32 node) const {
+    size_t leaves = 0;
+    std::vector<u32> stack = { node };
+    while (!stack.empty()) {
+        const u32 n = stack.back();
+        stack.pop_back();
+
+        leaves += _instance[n] != invalid_index;
+        for (u32 c = _first_child[n]; c < _first_child[n] + _child_count[n]; c++) {
+            stack.push_back(c);
         }
-        return;
     }
+    return leaves;
+}
 
-    glm::vec3 size = _max_corner - _min_corner;
-    glm::vec3 center = (_min_corner + _max_corner) * 0.5f;
-    glm::mat4 transform = glm::translate(glm::mat4(1), center) * glm::scale(glm::mat4(1), size);
+InstanceHandle BoundingTree::instance(u32 node) const {
+    return _instance[node];
+}
 
-    cube.get_material()->set_uniform(HASH("middle"), center);
-    cube.render(transform);
+const std::shared_ptr<SceneObject> &BoundingTree::object(InstanceHandle handle) const {
+    return _instances[handle];
+}
+
+u32 BoundingTree::leaf(InstanceHandle handle) const {
+    return _leaf[handle];
+}
+
+BoxesSoA BoundingTree::boxes(u32 node) const {
+    return BoxesSoA{ &_min_x[node], &_min_y[node], &_min_z[node], &_max_x[node], &_max_y[node], &_max_z[node] };
+}
+
+glm::vec3 BoundingTree::min_corner(u32 node) const {
+    return glm::vec3(_min_x[node], _min_y[node], _min_z[node]);
+}
+
+glm::vec3 BoundingTree::max_corner(u32 node) const {
+    return glm::vec3(_max_x[node], _max_y[node], _max_z[node]);
 }
 
-}
\ No newline at end of file
+}
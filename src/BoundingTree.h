@@ -2,43 +2,236 @@
 #define BOUNDINGTREE_H
 
 #include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
 #include <vector>
 
 #include "Camera.h"
+#include "FrustumCulling.h"
+#include "HierarchicalLod.h"
+#include "OcclusionCulling.h"
+#include "OcclusionQueries.h"
 #include "SceneObject.h"
+#include "ThreadPool.h"
+#include "TriangleTree.h"
+#include "shader_structs.h"
 
 namespace OM3D {
 
-enum RemoveResult {
-    NotFound,
-    Delete,
-    Resize,
+enum class BuildStrategy {
+    // Equal-count split on the longest axis
+    Median,
+    // Binned surface area heuristic
+    SAH,
+    // Linear build: centroids sorted along a Morton curve, split at the highest differing bit
+    LBVH,
+    // Linear build followed by a treelet restructuring pass
+    LBVHTreelets,
+
+    BuildStrategy_Size,
+};
+
+struct CullingStats {
+    // Node tests
+    size_t checks = 0;
+    size_t plane_tests = 0;
+    // Plane tests avoided by plane masks and by the coherence cache, compared to testing every plane of every reached node
+    size_t saved_plane_tests = 0;
+    // Nodes inside the frustum tested against the occlusion buffer, and the ones found hidden
+    size_t occlusion_tests = 0;
+    size_t occluded_nodes = 0;
+    // Leaves rejected by their bounding sphere before their box is tested, and the sphere plane tests, not in plane_tests
+    size_t sphere_rejections = 0;
+    size_t sphere_tests = 0;
 };
 
+// Stable index of an instance, valid until it is removed or the tree is rebuilt
+using InstanceHandle = u32;
+
+struct RayHit {
+    InstanceHandle handle = InstanceHandle(-1);
+    float distance = 0.0f;
+    // Index of the first vertex of the triangle in the indices of the mesh
+    u32 triangle = 0;
+};
+
+// Result of a traversal against several views
+struct ViewVisibility {
+    InstanceHandle handle;
+    // Bit v is set if the instance is inside the frustum of view v
+    u32 views;
+};
+
+struct RefitStats {
+    size_t moved_objects = 0;
+    size_t refit_nodes = 0;
+    size_t rebuilt_subtrees = 0;
+};
+
+// Flattened bounding volume hierarchy.
+// Nodes are stored contiguously, the children of a node occupy a contiguous range of slots,
+// and sibling ranges are laid out in depth-first order. Bounds are stored as SoA float arrays.
+// Leaves reference a dense instance index instead of owning the object.
 class BoundingTree {
     public:
+        static constexpr u32 invalid_index = u32(-1);
+
         BoundingTree();
-        BoundingTree(std::shared_ptr<SceneObject> object);
-        BoundingTree(std::vector<BoundingTree> &children);
 
-        void subdivise(size_t subdivisions);
-        bool fit_children();
+        // Subtrees are built in parallel when a pool is given, the result does not depend on the number of threads.
+        // The handle of each instance is its index in instances.
+        void build(std::vector<std::shared_ptr<SceneObject>> instances, size_t subdivisions, BuildStrategy strategy = BuildStrategy::Median, ThreadPool *pool = nullptr);
+
+        InstanceHandle insert(std::shared_ptr<SceneObject> object, size_t subdivisions);
+        // The leaf is found through the handle, no search is needed
+        bool remove(InstanceHandle handle);
+
+        // Moved objects are only queued, refit() updates their leaves and propagates the bounds bottom-up once.
+        // Subtrees whose surface area grew too much since they were built are rebuilt.
+        bool mark_moved(InstanceHandle handle);
+        RefitStats refit(ThreadPool *pool = nullptr);
+        bool has_moved_objects() const;
+
+        // Same nodes, over copies of the objects: later changes to the objects do not reach it, so another thread can read it
+        BoundingTree snapshot() const;
+
+        // Children skip the planes their parent is fully inside of, and every node first tests the plane that rejected it last time.
+        // With an occlusion buffer, nodes inside the frustum are also tested against it and hidden subtrees are skipped.
+        // With occlusion queries, subtrees found hidden by previous queries are skipped instead, see OcclusionQueries.
+        // With proxies, the subtrees of the nodes they select are not descended, see HlodProxies.
+        // Not thread safe: the rejecting plane cache is updated during the traversal.
+        void frustum_cull(std::vector<std::vector<std::shared_ptr<SceneObject>>> &objects, const Frustum &frustum, CullingStats &stats,
+                          CullingKernel kernel = best_culling_kernel(), const OcclusionBuffer *occlusion = nullptr,
+                          OcclusionQueries *queries = nullptr, HlodProxies *proxies = nullptr) const;
+
+        // One traversal for several views, each with its own plane masks. A subtree is only skipped once it is outside of every
+        // view. Does not use the rejecting plane cache, so it can run next to other traversals.
+        static constexpr size_t max_views = 16;
+        void frustum_cull_views(const std::vector<Frustum> &frustums, std::vector<ViewVisibility> &visible, CullingStats &stats,
+                                CullingKernel kernel = best_culling_kernel()) const;
+
+        void draw_recursive(SceneObject &cube, size_t level) const;
 
-        void insert(BoundingTree &obj, size_t subdivision);
-        RemoveResult remove(const std::shared_ptr<SceneObject> object);
+        // Breadth-first copy of the live nodes for the GPU, parents come before their children and every depth is contiguous.
+        // Returns the first node of every depth, followed by the node count.
+        std::vector<u32> flatten(std::vector<shader::BVHNode> &nodes) const;
 
-        void frustum_cull(std::vector<std::vector<std::shared_ptr<SceneObject>>> &objects, const Frustum &frustum, size_t &counter) const;
-        bool frustum_cull_aabb(const Frustum &frustum) const;
-        bool frustum_cull_aabb_plane(const glm::vec3 &plane, const glm::vec3 &plane_position) const;
+        // Spatial queries, safe to call from several threads. Rays are tested against the triangles of the meshes, the other
+        // queries against the bounds of the instances. Objects moved since the last refit() are found at their previous bounds.
+        bool raycast(const Ray &ray, RayHit &hit) const;
+        // Stops at the first hit, for visibility tests
+        bool raycast_any(const Ray &ray) const;
+        void overlap_box(const glm::vec3 &min, const glm::vec3 &max, std::vector<InstanceHandle> &handles) const;
+        void overlap_sphere(const glm::vec3 &center, float radius, std::vector<InstanceHandle> &handles) const;
+        // The k instances whose bounds are closest to the point, closest first
+        void nearest(const glm::vec3 &point, size_t k, std::vector<InstanceHandle> &handles) const;
 
-        void draw_recursive(SceneObject &cube, size_t level);
+        bool is_empty() const;
+        size_t node_count() const;
+
+        // Topology, for passes that keep their own per-node state. Node indices are below slot_count(),
+        // they only change when the hierarchy is rebuilt, or when objects are inserted, removed or rotated.
+        size_t slot_count() const;
+        u32 parent(u32 node) const;
+        u32 first_child(u32 node) const;
+        u32 child_count(u32 node) const;
+        size_t leaf_count(u32 node) const;
+        // Instance of a leaf, invalid_index for inner nodes
+        InstanceHandle instance(u32 node) const;
+        const std::shared_ptr<SceneObject> &object(InstanceHandle handle) const;
+        u32 leaf(InstanceHandle handle) const;
+        glm::vec3 min_corner(u32 node) const;
+        glm::vec3 max_corner(u32 node) const;
+        float sah_cost() const;
 
     private:
-        std::shared_ptr<SceneObject> _object;
-        std::vector<BoundingTree> _children;
+        struct BuildContext;
+
+        void reserve_nodes(size_t count);
+        u32 allocate_nodes(u32 count);
+        u32 add_instance(std::shared_ptr<SceneObject> object);
+        void set_sphere(u32 instance);
+        void set_leaf(u32 node, u32 instance, const glm::vec3 &min, const glm::vec3 &max);
+        void link_leaf(u32 node);
+        void move_node(u32 from, u32 to);
+        void compact();
+
+        void build_recursive(BuildContext &ctx, u32 node, u32 begin, u32 end);
+        void append_subtree(const BoundingTree &subtree, u32 node);
+        // Returns the number of leaves of the rebuilt subtree, 0 if it was not worth rebuilding,
+        // or more than max_leaves if it was too large to be rebuilt
+        size_t rebuild_subtree(u32 node, size_t max_leaves, ThreadPool *pool);
+        void partition_median(BuildContext &ctx, u32 begin, u32 end, const glm::vec3 &min, const glm::vec3 &max,
+                              std::vector<std::pair<u32, u32>> &ranges) const;
+        void partition_sah(BuildContext &ctx, u32 begin, u32 end, std::vector<std::pair<u32, u32>> &ranges) const;
+        u32 split_sah(BuildContext &ctx, u32 begin, u32 end) const;
+        void partition_morton(BuildContext &ctx, u32 begin, u32 end, std::vector<std::pair<u32, u32>> &ranges) const;
+
+        // Only valid right after a build, the pass relies on parents being stored before their children
+        void optimize_treelets(ThreadPool *pool);
+        void optimize_treelet(u32 node);
+
+        bool fit_children(u32 node);
+        // Returns the first node that kept its bounds
+        u32 refit_upward(u32 node);
+
+        // Returns the node and whether the new leaf is paired with it under a new node, or added to its children
+        std::pair<u32, bool> find_insert_position(const glm::vec3 &min, const glm::vec3 &max, size_t subdivisions) const;
+        void swap_nodes(u32 a, u32 b);
+        bool rotate(u32 node);
+        // Rotates node and its ancestors, unchanged is the node where refit_upward() stopped
+        void rotate_upward(u32 node, u32 unchanged);
+
+        // Adds every leaf under node without testing, returns the number of nodes below node
+        size_t collect_subtree(u32 node, std::vector<std::vector<std::shared_ptr<SceneObject>>> &objects) const;
+        size_t collect_subtree(u32 node, u32 views, std::vector<ViewVisibility> &visible) const;
+
+        void draw_recursive(u32 node, SceneObject &cube, size_t level) const;
+
+        bool trace_ray(const Ray &ray, RayHit &hit, bool any_hit) const;
+
+        // Bounds of the nodes starting at node
+        BoxesSoA boxes(u32 node) const;
+
+        // Node bounds
+        std::vector<float> _min_x;
+        std::vector<float> _min_y;
+        std::vector<float> _min_z;
+        std::vector<float> _max_x;
+        std::vector<float> _max_y;
+        std::vector<float> _max_z;
+
+        // Node topology, children are stored in [_first_child, _first_child + _child_count)
+        std::vector<u32> _first_child;
+        std::vector<u32> _child_count;
+        std::vector<u32> _parent;
+        // Instance index for leaves, invalid_index for inner nodes
+        std::vector<u32> _instance;
+        // Surface area of inner nodes when they were built, used to detect degraded subtrees
+        std::vector<float> _built_area;
+
+        // Frame coherence cache: last plane that rejected each node, or no_plane. It is only a hint, so it does not follow node moves.
+        static constexpr u8 no_plane = u8(-1);
+        mutable std::vector<u8> _rejecting_plane;
+
+        // Slots left behind when a sibling range is moved, reclaimed by compact()
+        size_t _dead_nodes = 0;
+
+        std::vector<std::shared_ptr<SceneObject>> _instances;
+        std::vector<u32> _free_instances;
+        // Leaf of every instance, only filled in the tree that owns the instances
+        std::vector<u32> _leaf;
+        // World bounding sphere of every instance, center and radius, tested before the box of its leaf. The radius is negative
+        // when the sphere is not smaller than the box.
+        std::vector<glm::vec4> _spheres;
+
+        // Instances waiting for refit()
+        std::vector<u32> _moved;
+        // Leaves refit() can still rebuild
+        size_t _rebuild_budget = 0;
 
-        glm::vec3 _min_corner;
-        glm::vec3 _max_corner;
+        // Parameters of the last build, reused to rebuild subtrees
+        size_t _subdivisions = 4;
+        BuildStrategy _strategy = BuildStrategy::Median;
 };
 
 }
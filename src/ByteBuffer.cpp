@@ -1,17 +1,13 @@
 #include "ByteBuffer.h"
 
+#include <GLState.h>
+
 #include <glad/glad.h>
 
 #include <iostream>
 
 namespace OM3D {
 
-static GLuint create_buffer_handle() {
-    GLuint handle = 0;
-    glCreateBuffers(1, &handle);
-    return handle;
-}
-
 ByteBuffer::ByteBuffer(const void* data, size_t size) : _handle(create_buffer_handle()), _size(size) {
     ALWAYS_ASSERT(_size, "Buffer size can not be 0");
     glNamedBufferData(_handle.get(), size, data, GL_STATIC_DRAW);
@@ -19,17 +15,18 @@ ByteBuffer::ByteBuffer(const void* data, size_t size) : _handle(create_buffer_ha
 
 ByteBuffer::~ByteBuffer() {
     if(auto handle = _handle.get()) {
+        GLState::current().forget_buffer(handle);
         glDeleteBuffers(1, &handle);
     }
 }
 
 void ByteBuffer::bind(BufferUsage usage) const {
-    glBindBuffer(buffer_usage_to_gl(usage), _handle.get());
+    GLState::current().bind_buffer(buffer_usage_to_gl(usage), _handle.get());
 }
 
 void ByteBuffer::bind(BufferUsage usage, u32 index) const {
     ALWAYS_ASSERT(usage == BufferUsage::Uniform || usage == BufferUsage::Storage, "Index bind is only available for uniform and storage buffers");
-    glBindBufferBase(buffer_usage_to_gl(usage), index, _handle.get());
+    GLState::current().bind_buffer_range(buffer_usage_to_gl(usage), index, _handle.get());
 }
 
 size_t ByteBuffer::byte_size() const {
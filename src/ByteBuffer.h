@@ -23,9 +23,10 @@ class ByteBuffer : NonCopyable {
 
         BufferMapping<byte> map_bytes(AccessType access = AccessType::ReadWrite);
 
+        const GLHandle& handle() const;
+
     protected:
         void* map_internal(AccessType access);
-        const GLHandle& handle() const;
 
     private:
         GLHandle _handle;
@@ -79,31 +79,34 @@ void Camera::update() {
 }
 
 Frustum Camera::build_frustum() const {
-    const glm::vec3 camera_forward = forward();
-    const glm::vec3 camera_up = up();
-    const glm::vec3 camera_right = right();
-    
-    Frustum frustum;
-    frustum._near_normal = camera_forward;
-
-    const float half_fov = _fov_y * 0.5f;
-    const float half_fov_v = std::atan(std::tan(half_fov) * _aspect_ratio);
-    {
-        const float c = std::cos(half_fov);
-        const float s = std::sin(half_fov);
-        frustum._bottom_normal = camera_forward * s + camera_up * c;
-        frustum._top_normal = camera_forward * s - camera_up * c;
-    }
-    {
-        const float c = std::cos(half_fov_v);
-        const float s = std::sin(half_fov_v);
-        frustum._left_normal = camera_forward * s + camera_right * c;
-        frustum._right_normal = camera_forward * s - camera_right * c;
-    }
+    return Frustum::from_view_proj(_view_proj);
+}
 
-    frustum._position = position();
+Frustum Frustum::from_view_proj(const glm::mat4 &view_proj) {
+    // Gribb & Hartmann: a clip space point is inside if -w <= x <= w, -w <= y <= w and 0 <= z <= w
+    const glm::mat4 rows = glm::transpose(view_proj);
 
+    Frustum frustum;
+    frustum.set_plane(0, rows[3] + rows[0]); // Left
+    frustum.set_plane(1, rows[3] - rows[0]); // Right
+    frustum.set_plane(2, rows[3] + rows[1]); // Bottom
+    frustum.set_plane(3, rows[3] - rows[1]); // Top
+    frustum.set_plane(4, rows[3] - rows[2]); // Near with reversed-Z
+    frustum.set_plane(5, rows[2]);        // Far, at infinity for the camera projection
     return frustum;
 }
 
+glm::vec4 Frustum::plane(size_t i) const {
+    return glm::vec4(_plane_x[i], _plane_y[i], _plane_z[i], _plane_w[i]);
+}
+
+void Frustum::set_plane(size_t i, const glm::vec4 &plane) {
+    const float length = glm::length(glm::vec3(plane));
+    const glm::vec4 normalized = length > 0.0f ? plane / length : glm::vec4(0.0f, 0.0f, 0.0f, plane.w > 0.0f ? 1.0f : -1.0f);
+    _plane_x[i] = normalized.x;
+    _plane_y[i] = normalized.y;
+    _plane_z[i] = normalized.z;
+    _plane_w[i] = normalized.w;
+}
+
 }
@@ -7,15 +7,24 @@
 
 namespace OM3D {
 
+// Intersection of the half-spaces in front of its planes
 struct Frustum {
-    glm::vec3 _near_normal;
-    // No far plane (zFar is +inf)
-    glm::vec3 _top_normal;
-    glm::vec3 _bottom_normal;
-    glm::vec3 _right_normal;
-    glm::vec3 _left_normal;
-
-    glm::vec3 _position;
+    static constexpr size_t plane_count = 6;
+
+    // Planes of the clip volume of a view-projection matrix, for a [0, 1] depth range, perspective or orthographic.
+    // A plane at infinity, like the far plane of the reversed-Z camera projection, is in front of every point.
+    static Frustum from_view_proj(const glm::mat4 &view_proj);
+
+    // (normal, w), a point p is in front of the plane if dot(p, normal) + w > 0
+    glm::vec4 plane(size_t i) const;
+    // The plane is normalized, so that the distances to it are in world units
+    void set_plane(size_t i, const glm::vec4 &plane);
+
+    // Planes as SoA
+    std::array<float, plane_count> _plane_x;
+    std::array<float, plane_count> _plane_y;
+    std::array<float, plane_count> _plane_z;
+    std::array<float, plane_count> _plane_w;
 };
 
 
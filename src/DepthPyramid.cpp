@@ -0,0 +1,68 @@
+#include "DepthPyramid.h"
+
+#include <glad/glad.h>
+
+namespace OM3D {
+
+// Must match depth_pyramid.comp
+static constexpr u32 workgroup_size = 8;
+
+static glm::uvec2 half_size(const glm::uvec2 &size) {
+    return glm::max(size / 2u, glm::uvec2(1));
+}
+
+DepthPyramid::DepthPyramid(const Texture &depth) :
+    _depth(&depth),
+    _program(Program::from_file("depth_pyramid.comp")),
+    _texture(half_size(depth.size()), ImageFormat::R32_FLOAT, Texture::mip_levels(half_size(depth.size()))) {
+
+    // Same level sizes as glTextureStorage2D
+    _sizes.push_back(half_size(depth.size()));
+    while (_sizes.back() != glm::uvec2(1)) {
+        _sizes.push_back(half_size(_sizes.back()));
+    }
+}
+
+void DepthPyramid::build() {
+    _program->bind();
+    _depth->bind(0);
+
+    for (u32 level = 0; level < level_count(); level++) {
+        _program->set_uniform(HASH("from_depth"), level == 0 ? 1u : 0u);
+        if (level > 0) {
+            _texture.bind_as_image(0, AccessType::ReadOnly, level - 1);
+        }
+        _texture.bind_as_image(1, AccessType::WriteOnly, level);
+
+        glDispatchCompute(align_up_to(_sizes[level].x, workgroup_size) / workgroup_size, align_up_to(_sizes[level].y, workgroup_size) / workgroup_size, 1);
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+}
+
+glm::uvec2 DepthPyramid::read_back(u32 max_width, std::vector<float> &depths) const {
+    u32 level = 0;
+    while (level + 1 < level_count() && _sizes[level].x > max_width) {
+        level++;
+    }
+
+    const glm::uvec2 size = _sizes[level];
+    depths.resize(size_t(size.x) * size.y);
+    _texture.read_level(level, depths.data(), depths.size() * sizeof(float));
+    return size;
+}
+
+const Texture &DepthPyramid::texture() const {
+    return _texture;
+}
+
+u32 DepthPyramid::level_count() const {
+    return u32(_sizes.size());
+}
+
+glm::uvec2 DepthPyramid::level_size(u32 level) const {
+    return _sizes[level];
+}
+
+}
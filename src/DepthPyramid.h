@@ -0,0 +1,39 @@
+#ifndef DEPTHPYRAMID_H
+#define DEPTHPYRAMID_H
+
+#include <Program.h>
+#include <Texture.h>
+
+#include <memory>
+#include <vector>
+
+namespace OM3D {
+
+// Hierarchical-Z pyramid of a depth buffer, reduced by a compute shader.
+// Level 0 is half the resolution of the depth buffer. Every texel keeps the farthest depth it covers,
+// which is the smallest one with the reversed depth set up by init_graphics().
+class DepthPyramid : NonCopyable {
+    public:
+        // The depth buffer must outlive the pyramid
+        DepthPyramid(const Texture &depth);
+
+        void build();
+
+        // Copies the first level at most max_width texels wide, returns its size
+        glm::uvec2 read_back(u32 max_width, std::vector<float> &depths) const;
+
+        const Texture &texture() const;
+        u32 level_count() const;
+        glm::uvec2 level_size(u32 level) const;
+
+    private:
+        const Texture *_depth = nullptr;
+        std::shared_ptr<Program> _program;
+
+        Texture _texture;
+        std::vector<glm::uvec2> _sizes;
+};
+
+}
+
+#endif // DEPTHPYRAMID_H
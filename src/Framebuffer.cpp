@@ -1,5 +1,7 @@
 #include "Framebuffer.h"
 
+#include <GLState.h>
+
 #include <glm/vec4.hpp>
 
 #include <glad/glad.h>
@@ -49,14 +51,15 @@ Framebuffer::Framebuffer(Texture* depth, Texture** colors, size_t count) : _hand
 
 Framebuffer::~Framebuffer() {
     if(u32 handle = _handle.get()) {
+        GLState::current().forget_framebuffer(handle);
         glDeleteFramebuffers(1, &handle);
     }
 }
 
 
 void Framebuffer::bind(bool clear, bool clear_z_buffer) const {
-    glBindFramebuffer(GL_FRAMEBUFFER, _handle.get());
-    glViewport(0, 0, _size.x, _size.y);
+    GLState::current().bind_framebuffer(_handle.get());
+    GLState::current().set_viewport(_size.x, _size.y);
 
     if(clear) {
         glClear(GL_COLOR_BUFFER_BIT | (clear_z_buffer * GL_DEPTH_BUFFER_BIT));
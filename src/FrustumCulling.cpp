@@ -0,0 +1,214 @@
+#include "FrustumCulling.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define OM3D_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define OM3D_TARGET_AVX2
+#else
+#define OM3D_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace OM3D {
+
+// For every plane, the vertex of the box that is the furthest along the normal is selected once for the whole batch:
+// the choice only depends on the sign of the normal, so the inner loops do not branch.
+// The nearest vertex is the opposite one, and is only needed to classify boxes as fully inside.
+struct PlaneVertices {
+    const float *x;
+    const float *y;
+    const float *z;
+};
+
+static PlaneVertices far_vertices(const BoxesSoA &boxes, const Frustum &frustum, size_t p) {
+    return PlaneVertices{
+        frustum._plane_x[p] < 0.0f ? boxes.min_x : boxes.max_x,
+        frustum._plane_y[p] < 0.0f ? boxes.min_y : boxes.max_y,
+        frustum._plane_z[p] < 0.0f ? boxes.min_z : boxes.max_z,
+    };
+}
+
+static PlaneVertices near_vertices(const BoxesSoA &boxes, const Frustum &frustum, size_t p) {
+    return PlaneVertices{
+        frustum._plane_x[p] < 0.0f ? boxes.max_x : boxes.min_x,
+        frustum._plane_y[p] < 0.0f ? boxes.max_y : boxes.min_y,
+        frustum._plane_z[p] < 0.0f ? boxes.max_z : boxes.min_z,
+    };
+}
+
+// Kernels return the mask of the boxes that are not outside of any plane of plane_mask.
+// When classify is set, the outside and inside masks of every tested plane are also accumulated in masks.
+template<bool classify>
+static u32 cull_scalar(const BoxesSoA &boxes, u32 begin, u32 end, const Frustum &frustum, u32 plane_mask, PlaneMasks *masks) {
+    u32 culled = 0;
+    for (u32 planes = plane_mask; planes; planes &= planes - 1) {
+        const u32 p = count_trailing_zeros(planes);
+        const PlaneVertices far = far_vertices(boxes, frustum, p);
+
+        u32 outside = 0;
+        for (u32 i = begin; i < end; i++) {
+            const float dist = far.x[i] * frustum._plane_x[p] + far.y[i] * frustum._plane_y[p] + far.z[i] * frustum._plane_z[p] + frustum._plane_w[p];
+            outside |= u32(dist <= 0.0f) << i;
+        }
+        culled |= outside;
+
+        if constexpr (classify) {
+            const PlaneVertices near = near_vertices(boxes, frustum, p);
+
+            u32 inside = 0;
+            for (u32 i = begin; i < end; i++) {
+                const float dist = near.x[i] * frustum._plane_x[p] + near.y[i] * frustum._plane_y[p] + near.z[i] * frustum._plane_z[p] + frustum._plane_w[p];
+                inside |= u32(dist > 0.0f) << i;
+            }
+
+            masks->outside[p] |= outside;
+            masks->inside[p] |= inside;
+        }
+    }
+
+    const u32 range = (end - begin == 32 ? ~0u : ((1u << (end - begin)) - 1)) << begin;
+    return ~culled & range;
+}
+
+#ifdef OM3D_X86
+static __m128 plane_distance_sse(const PlaneVertices &v, u32 begin, const Frustum &frustum, size_t p) {
+    const __m128 x = _mm_loadu_ps(v.x + begin);
+    const __m128 y = _mm_loadu_ps(v.y + begin);
+    const __m128 z = _mm_loadu_ps(v.z + begin);
+
+    const __m128 dist = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(frustum._plane_x[p])), _mm_mul_ps(y, _mm_set1_ps(frustum._plane_y[p])));
+    return _mm_add_ps(dist, _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(frustum._plane_z[p])), _mm_set1_ps(frustum._plane_w[p])));
+}
+
+template<bool classify>
+static u32 cull_sse(const BoxesSoA &boxes, u32 begin, const Frustum &frustum, u32 plane_mask, PlaneMasks *masks) {
+    __m128 culled = _mm_setzero_ps();
+    for (u32 planes = plane_mask; planes; planes &= planes - 1) {
+        const u32 p = count_trailing_zeros(planes);
+
+        const __m128 outside = _mm_cmple_ps(plane_distance_sse(far_vertices(boxes, frustum, p), begin, frustum, p), _mm_setzero_ps());
+        culled = _mm_or_ps(culled, outside);
+
+        if constexpr (classify) {
+            const __m128 inside = _mm_cmpgt_ps(plane_distance_sse(near_vertices(boxes, frustum, p), begin, frustum, p), _mm_setzero_ps());
+            masks->outside[p] |= u32(_mm_movemask_ps(outside)) << begin;
+            masks->inside[p] |= u32(_mm_movemask_ps(inside)) << begin;
+        }
+    }
+
+    return u32(~_mm_movemask_ps(culled) & 0xF) << begin;
+}
+
+OM3D_TARGET_AVX2
+static __m256 plane_distance_avx2(const PlaneVertices &v, u32 begin, const Frustum &frustum, size_t p) {
+    const __m256 x = _mm256_loadu_ps(v.x + begin);
+    const __m256 y = _mm256_loadu_ps(v.y + begin);
+    const __m256 z = _mm256_loadu_ps(v.z + begin);
+
+    const __m256 dist = _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(frustum._plane_x[p])), _mm256_mul_ps(y, _mm256_set1_ps(frustum._plane_y[p])));
+    return _mm256_add_ps(dist, _mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(frustum._plane_z[p])), _mm256_set1_ps(frustum._plane_w[p])));
+}
+
+template<bool classify>
+OM3D_TARGET_AVX2
+static u32 cull_avx2(const BoxesSoA &boxes, u32 begin, const Frustum &frustum, u32 plane_mask, PlaneMasks *masks) {
+    __m256 culled = _mm256_setzero_ps();
+    for (u32 planes = plane_mask; planes; planes &= planes - 1) {
+        const u32 p = count_trailing_zeros(planes);
+
+        const __m256 outside = _mm256_cmp_ps(plane_distance_avx2(far_vertices(boxes, frustum, p), begin, frustum, p), _mm256_setzero_ps(), _CMP_LE_OQ);
+        culled = _mm256_or_ps(culled, outside);
+
+        if constexpr (classify) {
+            const __m256 inside = _mm256_cmp_ps(plane_distance_avx2(near_vertices(boxes, frustum, p), begin, frustum, p), _mm256_setzero_ps(), _CMP_GT_OQ);
+            masks->outside[p] |= u32(_mm256_movemask_ps(outside)) << begin;
+            masks->inside[p] |= u32(_mm256_movemask_ps(inside)) << begin;
+        }
+    }
+
+    return u32(~_mm256_movemask_ps(culled) & 0xFF) << begin;
+}
+
+static bool cpu_has_avx2() {
+#ifdef _MSC_VER
+    int info[4] = {};
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    // AVX and OS support for the YMM registers
+    __cpuid(info, 1);
+    const bool avx = (info[2] & (1 << 28)) && (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+
+    __cpuidex(info, 7, 0);
+    return avx && (info[1] & (1 << 5));
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+bool is_supported(CullingKernel kernel) {
+    switch (kernel) {
+        case CullingKernel::Scalar:
+            return true;
+#ifdef OM3D_X86
+        case CullingKernel::SSE:
+            return true;
+        case CullingKernel::AVX2: {
+            static const bool avx2 = cpu_has_avx2();
+            return avx2;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+CullingKernel best_culling_kernel() {
+    static const CullingKernel best = is_supported(CullingKernel::AVX2) ? CullingKernel::AVX2
+                                    : is_supported(CullingKernel::SSE) ? CullingKernel::SSE
+                                    : CullingKernel::Scalar;
+    return best;
+}
+
+template<bool classify>
+static u32 cull_batch(CullingKernel kernel, const BoxesSoA &boxes, u32 count, const Frustum &frustum, u32 plane_mask, PlaneMasks *masks) {
+    DEBUG_ASSERT(count <= 32);
+
+    u32 visible = 0;
+    u32 i = 0;
+
+#ifdef OM3D_X86
+    if (kernel == CullingKernel::AVX2) {
+        for (; i + 8 <= count; i += 8) {
+            visible |= cull_avx2<classify>(boxes, i, frustum, plane_mask, masks);
+        }
+    }
+
+    if (kernel != CullingKernel::Scalar) {
+        for (; i + 4 <= count; i += 4) {
+            visible |= cull_sse<classify>(boxes, i, frustum, plane_mask, masks);
+        }
+    }
+#endif
+
+    // Remaining boxes
+    if (i < count)
+        visible |= cull_scalar<classify>(boxes, i, count, frustum, plane_mask, masks);
+
+    return visible;
+}
+
+u32 frustum_cull_boxes(CullingKernel kernel, const BoxesSoA &boxes, u32 count, const Frustum &frustum) {
+    return cull_batch<false>(kernel, boxes, count, frustum, all_frustum_planes, nullptr);
+}
+
+u32 frustum_cull_boxes(CullingKernel kernel, const BoxesSoA &boxes, u32 count, const Frustum &frustum, u32 plane_mask, PlaneMasks &masks) {
+    return cull_batch<true>(kernel, boxes, count, frustum, plane_mask, &masks);
+}
+
+}
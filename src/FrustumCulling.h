@@ -0,0 +1,50 @@
+#ifndef FRUSTUMCULLING_H
+#define FRUSTUMCULLING_H
+
+#include <Camera.h>
+
+#include <array>
+
+namespace OM3D {
+
+enum class CullingKernel {
+    Scalar,
+    SSE,  // 4 boxes per iteration
+    AVX2, // 8 boxes per iteration
+
+    CullingKernel_Size,
+};
+
+// Axis aligned boxes stored as SoA
+struct BoxesSoA {
+    const float *min_x;
+    const float *min_y;
+    const float *min_z;
+    const float *max_x;
+    const float *max_y;
+    const float *max_z;
+};
+
+// Per plane classification of a batch of boxes, bit i refers to box i
+struct PlaneMasks {
+    // Boxes entirely on the outer side of the plane
+    std::array<u32, Frustum::plane_count> outside = {};
+    // Boxes entirely on the inner side of the plane, their children do not need to test it
+    std::array<u32, Frustum::plane_count> inside = {};
+};
+
+static constexpr u32 all_frustum_planes = (1u << Frustum::plane_count) - 1;
+
+bool is_supported(CullingKernel kernel);
+// Fastest kernel supported by the CPU, detected once at runtime
+CullingKernel best_culling_kernel();
+
+// Tests up to 32 boxes against every plane of the frustum.
+// Returns a mask where bit i is set if box i is at least partially inside the frustum.
+u32 frustum_cull_boxes(CullingKernel kernel, const BoxesSoA &boxes, u32 count, const Frustum &frustum);
+// Only tests the planes set in plane_mask, and classifies the boxes against each of them in masks
+u32 frustum_cull_boxes(CullingKernel kernel, const BoxesSoA &boxes, u32 count, const Frustum &frustum, u32 plane_mask, PlaneMasks &masks);
+
+}
+
+#endif // FRUSTUMCULLING_H
@@ -0,0 +1,359 @@
+#include "GLState.h"
+
+#include <glad/glad.h>
+
+#include <iostream>
+
+namespace OM3D {
+
+static u32 buffer_target_index(u32 target) {
+    switch(target) {
+        case GL_ARRAY_BUFFER:
+            return 0;
+        case GL_ELEMENT_ARRAY_BUFFER:
+            return 1;
+        case GL_UNIFORM_BUFFER:
+            return 2;
+        case GL_SHADER_STORAGE_BUFFER:
+            return 3;
+        case GL_DRAW_INDIRECT_BUFFER:
+            return 4;
+    }
+
+    FATAL("Unknown buffer target");
+}
+
+static GLenum buffer_target_binding(u32 target) {
+    switch(target) {
+        case GL_ARRAY_BUFFER:
+            return GL_ARRAY_BUFFER_BINDING;
+        case GL_ELEMENT_ARRAY_BUFFER:
+            return GL_ELEMENT_ARRAY_BUFFER_BINDING;
+        case GL_UNIFORM_BUFFER:
+            return GL_UNIFORM_BUFFER_BINDING;
+        case GL_SHADER_STORAGE_BUFFER:
+            return GL_SHADER_STORAGE_BUFFER_BINDING;
+        case GL_DRAW_INDIRECT_BUFFER:
+            return GL_DRAW_INDIRECT_BUFFER_BINDING;
+    }
+
+    FATAL("Unknown buffer target");
+}
+
+// Capabilities outside of the tracked ones are out of range
+static u32 capability_index(u32 capability) {
+    switch(capability) {
+        case GL_BLEND:
+            return 0;
+        case GL_CULL_FACE:
+            return 1;
+        case GL_DEPTH_TEST:
+            return 2;
+        case GL_SCISSOR_TEST:
+            return 3;
+    }
+    return u32(-1);
+}
+
+static GLint get_integer(GLenum name) {
+    GLint value = 0;
+    glGetIntegerv(name, &value);
+    return value;
+}
+
+static GLint get_integer(GLenum name, u32 index) {
+    GLint value = 0;
+    glGetIntegeri_v(name, index, &value);
+    return value;
+}
+
+static GLint64 get_integer64(GLenum name, u32 index) {
+    GLint64 value = 0;
+    glGetInteger64i_v(name, index, &value);
+    return value;
+}
+
+GLState& GLState::current() {
+    static GLState state;
+    return state;
+}
+
+GLState::GLState() {
+    _textures.fill(unknown);
+    _buffers.fill(unknown);
+    _capabilities.fill(unknown);
+}
+
+template<typename F>
+bool GLState::unchanged(bool same, F&& matches_gl, const char* name) {
+    if(same && _validation && !matches_gl()) {
+        std::cerr << "[GL] State copy out of date: " << name << std::endl;
+        _stats.mismatches++;
+        same = false;
+    }
+
+    (same ? _stats.skipped_calls : _stats.issued_calls)++;
+    return same;
+}
+
+void GLState::use_program(u32 program) {
+    if(unchanged(_program == program, [&] { return u32(get_integer(GL_CURRENT_PROGRAM)) == program; }, "program")) {
+        return;
+    }
+    _program = program;
+    glUseProgram(program);
+}
+
+void GLState::bind_texture(u32 unit, u32 texture) {
+    if(unit >= max_texture_units) {
+        _stats.issued_calls++;
+        glBindTextureUnit(unit, texture);
+        return;
+    }
+
+    const auto matches_gl = [&] {
+        // Texture bindings can only be read from the active unit
+        const GLint active = get_integer(GL_ACTIVE_TEXTURE);
+        glActiveTexture(GL_TEXTURE0 + unit);
+        const u32 bound = u32(get_integer(GL_TEXTURE_BINDING_2D));
+        glActiveTexture(GLenum(active));
+        return bound == texture;
+    };
+    if(unchanged(_textures[unit] == texture, matches_gl, "texture unit")) {
+        return;
+    }
+    _textures[unit] = texture;
+    glBindTextureUnit(unit, texture);
+}
+
+void GLState::bind_image(u32 unit, u32 texture, u32 level, u32 access, u32 format) {
+    if(unit >= max_image_units) {
+        _stats.issued_calls++;
+        glBindImageTexture(unit, texture, level, false, 0, access, format);
+        return;
+    }
+
+    ImageBinding& image = _images[unit];
+    const bool same = image.texture == texture && image.level == level && image.access == access && image.format == format;
+    const auto matches_gl = [&] {
+        return u32(get_integer(GL_IMAGE_BINDING_NAME, unit)) == texture && u32(get_integer(GL_IMAGE_BINDING_LEVEL, unit)) == level
+            && u32(get_integer(GL_IMAGE_BINDING_ACCESS, unit)) == access && u32(get_integer(GL_IMAGE_BINDING_FORMAT, unit)) == format;
+    };
+    if(unchanged(same, matches_gl, "image unit")) {
+        return;
+    }
+    image = { texture, level, access, format };
+    glBindImageTexture(unit, texture, level, false, 0, access, format);
+}
+
+void GLState::bind_buffer(u32 target, u32 buffer) {
+    u32& bound = _buffers[buffer_target_index(target)];
+    if(unchanged(bound == buffer, [&] { return u32(get_integer(buffer_target_binding(target))) == buffer; }, "buffer")) {
+        return;
+    }
+    bound = buffer;
+    glBindBuffer(target, buffer);
+}
+
+void GLState::bind_buffer_range(u32 target, u32 index, u32 buffer, size_t offset, size_t size) {
+    ALWAYS_ASSERT(target == GL_UNIFORM_BUFFER || target == GL_SHADER_STORAGE_BUFFER, "Only uniform and storage buffers have indexed bindings");
+
+    // The generic binding point changes as well
+    _buffers[buffer_target_index(target)] = buffer;
+
+    const bool uniform = target == GL_UNIFORM_BUFFER;
+    if(index >= max_indexed_buffers) {
+        _stats.issued_calls++;
+        size ? glBindBufferRange(target, index, buffer, offset, size) : glBindBufferBase(target, index, buffer);
+        return;
+    }
+
+    BufferRange& range = _indexed_buffers[uniform ? 0 : 1][index];
+    const bool same = range.buffer == buffer && range.offset == offset && range.size == size;
+    const auto matches_gl = [&] {
+        return u32(get_integer(uniform ? GL_UNIFORM_BUFFER_BINDING : GL_SHADER_STORAGE_BUFFER_BINDING, index)) == buffer
+            && size_t(get_integer64(uniform ? GL_UNIFORM_BUFFER_START : GL_SHADER_STORAGE_BUFFER_START, index)) == offset
+            && size_t(get_integer64(uniform ? GL_UNIFORM_BUFFER_SIZE : GL_SHADER_STORAGE_BUFFER_SIZE, index)) == size;
+    };
+    if(unchanged(same, matches_gl, "indexed buffer")) {
+        return;
+    }
+    range = { buffer, offset, size };
+    size ? glBindBufferRange(target, index, buffer, offset, size) : glBindBufferBase(target, index, buffer);
+}
+
+void GLState::bind_framebuffer(u32 framebuffer) {
+    const auto matches_gl = [&] {
+        return u32(get_integer(GL_DRAW_FRAMEBUFFER_BINDING)) == framebuffer && u32(get_integer(GL_READ_FRAMEBUFFER_BINDING)) == framebuffer;
+    };
+    if(unchanged(_framebuffer == framebuffer, matches_gl, "framebuffer")) {
+        return;
+    }
+    _framebuffer = framebuffer;
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+}
+
+void GLState::bind_vertex_array(u32 vertex_array) {
+    if(unchanged(_vertex_array == vertex_array, [&] { return u32(get_integer(GL_VERTEX_ARRAY_BINDING)) == vertex_array; }, "vertex array")) {
+        return;
+    }
+    _vertex_array = vertex_array;
+    forget_binding(GL_ELEMENT_ARRAY_BUFFER);
+    glBindVertexArray(vertex_array);
+}
+
+void GLState::set_viewport(u32 width, u32 height) {
+    const auto matches_gl = [&] {
+        GLint viewport[4] = {};
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        return viewport[0] == 0 && viewport[1] == 0 && u32(viewport[2]) == width && u32(viewport[3]) == height;
+    };
+    if(unchanged(_viewport_width == width && _viewport_height == height, matches_gl, "viewport")) {
+        return;
+    }
+    _viewport_width = width;
+    _viewport_height = height;
+    glViewport(0, 0, GLsizei(width), GLsizei(height));
+}
+
+void GLState::set_capability(u32 capability, bool enabled) {
+    const u32 index = capability_index(capability);
+    if(index == u32(-1)) {
+        _stats.issued_calls++;
+        enabled ? glEnable(capability) : glDisable(capability);
+        return;
+    }
+
+    if(unchanged(_capabilities[index] == u32(enabled), [&] { return bool(glIsEnabled(capability)) == enabled; }, "capability")) {
+        return;
+    }
+    _capabilities[index] = u32(enabled);
+    enabled ? glEnable(capability) : glDisable(capability);
+}
+
+void GLState::set_depth_func(u32 func) {
+    if(unchanged(_depth_func == func, [&] { return u32(get_integer(GL_DEPTH_FUNC)) == func; }, "depth function")) {
+        return;
+    }
+    _depth_func = func;
+    glDepthFunc(func);
+}
+
+void GLState::set_depth_mask(bool write) {
+    if(unchanged(_depth_mask == u32(write), [&] { return bool(get_integer(GL_DEPTH_WRITEMASK)) == write; }, "depth mask")) {
+        return;
+    }
+    _depth_mask = u32(write);
+    glDepthMask(write);
+}
+
+void GLState::set_color_mask(bool write) {
+    const auto matches_gl = [&] {
+        GLint mask[4] = {};
+        glGetIntegerv(GL_COLOR_WRITEMASK, mask);
+        return bool(mask[0]) == write && bool(mask[1]) == write && bool(mask[2]) == write && bool(mask[3]) == write;
+    };
+    if(unchanged(_color_mask == u32(write), matches_gl, "color mask")) {
+        return;
+    }
+    _color_mask = u32(write);
+    glColorMask(write, write, write, write);
+}
+
+void GLState::set_blend_func(u32 source, u32 destination) {
+    const auto matches_gl = [&] {
+        return u32(get_integer(GL_BLEND_SRC_RGB)) == source && u32(get_integer(GL_BLEND_SRC_ALPHA)) == source
+            && u32(get_integer(GL_BLEND_DST_RGB)) == destination && u32(get_integer(GL_BLEND_DST_ALPHA)) == destination;
+    };
+    if(unchanged(_blend_source == source && _blend_destination == destination, matches_gl, "blend function")) {
+        return;
+    }
+    _blend_source = source;
+    _blend_destination = destination;
+    glBlendFunc(source, destination);
+}
+
+void GLState::set_cull_face(u32 face) {
+    if(unchanged(_cull_face == face, [&] { return u32(get_integer(GL_CULL_FACE_MODE)) == face; }, "cull face")) {
+        return;
+    }
+    _cull_face = face;
+    glCullFace(face);
+}
+
+void GLState::set_front_face(u32 orientation) {
+    if(unchanged(_front_face == orientation, [&] { return u32(get_integer(GL_FRONT_FACE)) == orientation; }, "front face")) {
+        return;
+    }
+    _front_face = orientation;
+    glFrontFace(orientation);
+}
+
+void GLState::forget_program(u32 program) {
+    if(_program == program) {
+        _program = unknown;
+    }
+}
+
+void GLState::forget_texture(u32 texture) {
+    for(u32& bound : _textures) {
+        if(bound == texture) {
+            bound = unknown;
+        }
+    }
+    for(ImageBinding& image : _images) {
+        if(image.texture == texture) {
+            image.texture = unknown;
+        }
+    }
+}
+
+void GLState::forget_buffer(u32 buffer) {
+    for(u32& bound : _buffers) {
+        if(bound == buffer) {
+            bound = unknown;
+        }
+    }
+    for(auto& ranges : _indexed_buffers) {
+        for(BufferRange& range : ranges) {
+            if(range.buffer == buffer) {
+                range.buffer = unknown;
+            }
+        }
+    }
+}
+
+void GLState::forget_framebuffer(u32 framebuffer) {
+    if(_framebuffer == framebuffer) {
+        _framebuffer = unknown;
+    }
+}
+
+void GLState::forget_vertex_array(u32 vertex_array) {
+    if(_vertex_array == vertex_array) {
+        _vertex_array = unknown;
+        forget_binding(GL_ELEMENT_ARRAY_BUFFER);
+    }
+}
+
+void GLState::forget_binding(u32 target) {
+    _buffers[buffer_target_index(target)] = unknown;
+}
+
+void GLState::set_validation(bool enabled) {
+    _validation = enabled;
+}
+
+bool GLState::validation() const {
+    return _validation;
+}
+
+const GLStateStats& GLState::stats() const {
+    return _stats;
+}
+
+void GLState::reset_stats() {
+    _stats = {};
+}
+
+}
@@ -0,0 +1,114 @@
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include <graphics.h>
+
+#include <array>
+
+namespace OM3D {
+
+struct GLStateStats {
+    size_t issued_calls = 0;
+    // Calls that would have set what was already there
+    size_t skipped_calls = 0;
+    // Found by validation, the copy did not match what glGet* returned
+    size_t mismatches = 0;
+};
+
+// CPU copy of the state bound through the wrappers, calls that would not change it are not sent to GL.
+// Every wrapper binds through it, state set directly with GL must be set through it as well or the copy goes out of date.
+// Handles must be forgotten before their object is deleted, GL may give their name to the next object.
+class GLState : NonCopyable {
+    public:
+        static constexpr u32 max_texture_units = 32;
+        static constexpr u32 max_image_units = 8;
+        static constexpr u32 max_indexed_buffers = 32;
+
+        // The only context of the program
+        static GLState& current();
+
+        void use_program(u32 program);
+        void bind_texture(u32 unit, u32 texture);
+        void bind_image(u32 unit, u32 texture, u32 level, u32 access, u32 format);
+        void bind_buffer(u32 target, u32 buffer);
+        // Uniform and storage targets, a size of 0 binds the whole buffer
+        void bind_buffer_range(u32 target, u32 index, u32 buffer, size_t offset = 0, size_t size = 0);
+        void bind_framebuffer(u32 framebuffer);
+        // The index buffer binding belongs to the vertex array, it is bound again after a change
+        void bind_vertex_array(u32 vertex_array);
+        void set_viewport(u32 width, u32 height);
+
+        // Blending, face culling, depth and scissor tests are tracked, other capabilities are always set
+        void set_capability(u32 capability, bool enabled);
+        void set_depth_func(u32 func);
+        void set_depth_mask(bool write);
+        void set_color_mask(bool write);
+        void set_blend_func(u32 source, u32 destination);
+        void set_cull_face(u32 face);
+        void set_front_face(u32 orientation);
+
+        void forget_program(u32 program);
+        void forget_texture(u32 texture);
+        void forget_buffer(u32 buffer);
+        void forget_framebuffer(u32 framebuffer);
+        void forget_vertex_array(u32 vertex_array);
+        // Its binding was changed without going through the cache
+        void forget_binding(u32 target);
+
+        // Every skipped call is first checked against glGet*, a mismatch is reported and the call is sent anyway
+        void set_validation(bool enabled);
+        bool validation() const;
+
+        const GLStateStats& stats() const;
+        void reset_stats();
+
+    private:
+        GLState();
+
+        template<typename F>
+        bool unchanged(bool same, F&& matches_gl, const char* name);
+
+        static constexpr u32 unknown = u32(-1);
+        static constexpr u32 buffer_target_count = 5;
+        static constexpr u32 capability_count = 4;
+
+        struct BufferRange {
+            u32 buffer = unknown;
+            size_t offset = 0;
+            size_t size = 0;
+        };
+
+        struct ImageBinding {
+            u32 texture = unknown;
+            u32 level = 0;
+            u32 access = 0;
+            u32 format = 0;
+        };
+
+        u32 _program = unknown;
+        std::array<u32, max_texture_units> _textures;
+        std::array<ImageBinding, max_image_units> _images;
+        std::array<u32, buffer_target_count> _buffers;
+        // Uniform then storage
+        std::array<std::array<BufferRange, max_indexed_buffers>, 2> _indexed_buffers;
+        u32 _framebuffer = unknown;
+        u32 _vertex_array = unknown;
+        u32 _viewport_width = unknown;
+        u32 _viewport_height = unknown;
+
+        std::array<u32, capability_count> _capabilities;
+        u32 _depth_func = unknown;
+        u32 _depth_mask = unknown;
+        u32 _color_mask = unknown;
+        u32 _blend_source = unknown;
+        u32 _blend_destination = unknown;
+        u32 _cull_face = unknown;
+        u32 _front_face = unknown;
+
+        bool _validation = false;
+        GLStateStats _stats;
+};
+
+}
+
+#endif // GLSTATE_H
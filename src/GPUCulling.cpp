@@ -0,0 +1,154 @@
+#include "GPUCulling.h"
+
+#include <glad/glad.h>
+
+#include <algorithm>
+
+namespace OM3D {
+
+// Must match cull.comp
+static constexpr u32 workgroup_size = 64;
+
+// Buffers only grow, smaller uploads reuse the beginning of the buffer
+template<typename T>
+static void upload_buffer(TypedBuffer<T> &buffer, const std::vector<T> &data) {
+    if (buffer.element_count() < std::max(data.size(), size_t(1))) {
+        buffer = TypedBuffer<T>(data.data(), std::max(data.size(), size_t(1)));
+        return;
+    }
+
+    if (!data.empty()) {
+        auto mapping = buffer.map(AccessType::WriteOnly);
+        std::copy(data.begin(), data.end(), mapping.data());
+    }
+}
+
+void GPUCulling::upload(const BoundingTree &tree, const std::vector<std::vector<std::shared_ptr<SceneObject>>> &objects) {
+    if (!_program) {
+        _program = Program::from_file("cull.comp");
+        _planes = TypedBuffer<glm::vec4>(nullptr, Frustum::plane_count);
+    }
+
+    _depths = tree.flatten(_flat_nodes);
+    upload_buffer(_nodes, _flat_nodes);
+    if (_node_planes.element_count() < std::max(_flat_nodes.size(), size_t(1))) {
+        _node_planes = TypedBuffer<u32>(nullptr, std::max(_flat_nodes.size(), size_t(1)));
+    }
+
+    size_t handle_count = 0;
+    for (const auto &group : objects) {
+        for (const std::shared_ptr<SceneObject> &object : group) {
+            if (object->handle != BoundingTree::invalid_index)
+                handle_count = std::max(handle_count, size_t(object->handle) + 1);
+        }
+    }
+
+    // Every group owns a range of the visible instances as large as the group, starting at the base instance of its command
+    std::vector<u32> instance_groups(handle_count, 0);
+    std::vector<shader::mat4> models(handle_count, shader::mat4(1.0f));
+    _empty_commands.clear();
+    _group_meshes.clear();
+    u32 base_instance = 0;
+    for (u32 g = 0; g < objects.size(); g++) {
+        const auto &group = objects[g];
+        for (const std::shared_ptr<SceneObject> &object : group) {
+            if (object->handle == BoundingTree::invalid_index)
+                continue;
+            instance_groups[object->handle] = g;
+            models[object->handle] = object->transform();
+        }
+
+        _group_meshes.push_back(group.empty() ? nullptr : group.front()->get_mesh().get());
+        _empty_commands.push_back({ 0, 0, 0, 0, base_instance });
+        base_instance += u32(group.size());
+    }
+
+    upload_buffer(_instance_groups, instance_groups);
+    upload_buffer(_models, models);
+    if (_visible_instances.element_count() < std::max(size_t(base_instance), size_t(1))) {
+        _visible_instances = TypedBuffer<u32>(nullptr, std::max(size_t(base_instance), size_t(1)));
+    }
+}
+
+void GPUCulling::cull(const Frustum &frustum) {
+    if (!_program)
+        return;
+
+    for (size_t g = 0; g < _group_meshes.size(); g++) {
+        if (_group_meshes[g]) {
+            _empty_commands[g] = _group_meshes[g]->draw_command(0, _empty_commands[g].base_instance);
+            _empty_commands[g].instance_count = 0;
+        }
+    }
+    upload_buffer(_commands, _empty_commands);
+    {
+        auto mapping = _planes.map(AccessType::WriteOnly);
+        for (size_t p = 0; p != Frustum::plane_count; ++p) {
+            mapping[p] = frustum.plane(p);
+        }
+    }
+
+    _program->bind();
+    _planes.bind(BufferUsage::Uniform, 1);
+    _nodes.bind(BufferUsage::Storage, 3);
+    _node_planes.bind(BufferUsage::Storage, 4);
+    _instance_groups.bind(BufferUsage::Storage, 5);
+    _commands.bind(BufferUsage::Storage, 6);
+    _visible_instances.bind(BufferUsage::Storage, 7);
+
+    // Threads of culled subtrees exit right after reading the planes left to their parent
+    for (size_t d = 0; d < dispatch_count(); d++) {
+        _program->set_uniform(HASH("level_begin"), _depths[d]);
+        _program->set_uniform(HASH("level_end"), _depths[d + 1]);
+        glDispatchCompute(align_up_to(_depths[d + 1] - _depths[d], workgroup_size) / workgroup_size, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
+
+void GPUCulling::draw(const std::vector<std::vector<std::shared_ptr<SceneObject>>> &objects) {
+    if (_empty_commands.empty())
+        return;
+
+    _models.bind(BufferUsage::Storage, 2);
+    _commands.bind(BufferUsage::Indirect);
+
+    // gl_BaseInstance needs GLSL 4.60, the base instance of a command only offsets instanced attributes.
+    // The visible handles are thus read as an instanced attribute, starting at the range of the group.
+    GeometryPool &pool = GeometryPool::current();
+    pool.set_instance_buffer(_visible_instances.handle().get());
+
+    // Groups have their own materials, so each of them is a separate indirect draw
+    const size_t group_count = std::min(objects.size(), _empty_commands.size());
+    for (size_t g = 0; g < group_count; g++) {
+        if (!objects[g].empty())
+            objects[g].front()->render_indirect(g * sizeof(shader::DrawElementsIndirectCommand));
+    }
+
+    pool.set_instance_buffer(0);
+}
+
+std::vector<std::vector<u32>> GPUCulling::read_visible_instances() {
+    std::vector<std::vector<u32>> visible(_empty_commands.size());
+    if (!_program)
+        return visible;
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    auto commands = _commands.map(AccessType::ReadOnly);
+    auto instances = _visible_instances.map(AccessType::ReadOnly);
+    for (size_t g = 0; g < visible.size(); g++) {
+        const u32 first = commands[g].base_instance;
+        const u32 count = std::min(commands[g].instance_count, u32(instances.element_count() - first));
+        visible[g].assign(instances.data() + first, instances.data() + first + count);
+    }
+
+    return visible;
+}
+
+size_t GPUCulling::dispatch_count() const {
+    return _depths.empty() ? 0 : _depths.size() - 1;
+}
+
+}
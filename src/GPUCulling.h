@@ -0,0 +1,55 @@
+#ifndef GPUCULLING_H
+#define GPUCULLING_H
+
+#include <BoundingTree.h>
+#include <Program.h>
+#include <TypedBuffer.h>
+#include <shader_structs.h>
+
+#include <memory>
+#include <vector>
+
+namespace OM3D {
+
+// Frustum culling of the hierarchy in a compute shader, one dispatch per depth.
+// Visible instances are compacted into the range of their group and every group is drawn with one indirect command,
+// so the CPU neither reads the result back nor issues a draw per object.
+class GPUCulling : NonCopyable {
+    public:
+        // Instances are identified by their handle, objects[i] is the group drawn by the i-th command
+        void upload(const BoundingTree &tree, const std::vector<std::vector<std::shared_ptr<SceneObject>>> &objects);
+
+        void cull(const Frustum &frustum);
+        void draw(const std::vector<std::vector<std::shared_ptr<SceneObject>>> &objects);
+
+        // Stalls until the last cull() is done, returns the visible handles of every group
+        std::vector<std::vector<u32>> read_visible_instances();
+
+        // Dispatches of the last cull()
+        size_t dispatch_count() const;
+
+    private:
+        std::shared_ptr<Program> _program;
+
+        TypedBuffer<shader::BVHNode> _nodes;
+        TypedBuffer<u32> _node_planes;
+        TypedBuffer<u32> _instance_groups;
+        TypedBuffer<shader::mat4> _models;
+        TypedBuffer<shader::DrawElementsIndirectCommand> _commands;
+        TypedBuffer<u32> _visible_instances;
+        TypedBuffer<glm::vec4> _planes;
+
+        // Commands with no instance, copied at the beginning of every cull()
+        std::vector<shader::DrawElementsIndirectCommand> _empty_commands;
+        // Meshes move in the geometry pool, their ranges are read again by every cull()
+        std::vector<const StaticMesh *> _group_meshes;
+        // First node of every depth, followed by the node count
+        std::vector<u32> _depths;
+
+        // Kept to avoid reallocations
+        std::vector<shader::BVHNode> _flat_nodes;
+};
+
+}
+
+#endif // GPUCULLING_H
@@ -0,0 +1,309 @@
+#include "GeometryPool.h"
+
+#include <glad/glad.h>
+
+#include <algorithm>
+
+namespace OM3D {
+
+// Grown by doubling from there, about 4MB of vertices and 1MB of indices
+static constexpr u32 initial_vertex_capacity = 1 << 16;
+static constexpr u32 initial_index_capacity = 1 << 18;
+// Fraction of the free space outside of the largest block above which compact_if_fragmented() compacts
+static constexpr float max_fragmentation = 0.5f;
+
+static constexpr u32 vertex_binding = 0;
+static constexpr u32 instance_binding = 1;
+static constexpr u32 instance_attribute = 5;
+
+static constexpr VertexAttribute vertex_attributes[] = {
+    // Vertex position
+    { 0, vertex_binding, 3, GL_FLOAT, 0 },
+    // Vertex normal
+    { 1, vertex_binding, 3, GL_FLOAT, 3 * sizeof(float) },
+    // Vertex uv
+    { 2, vertex_binding, 2, GL_FLOAT, 6 * sizeof(float) },
+    // Tangent / bitangent sign
+    { 3, vertex_binding, 4, GL_FLOAT, 8 * sizeof(float) },
+    // Vertex color
+    { 4, vertex_binding, 3, GL_FLOAT, 12 * sizeof(float) },
+    // Instance handle of indirect draws, disabled until set_instance_buffer()
+    { instance_attribute, instance_binding, 1, GL_UNSIGNED_INT, 0, false, true },
+};
+
+float GeometryBufferStats::fragmentation() const {
+    const u32 free = capacity - used;
+    return free ? 1.0f - float(largest_free_block) / float(free) : 0.0f;
+}
+
+GeometryAllocation::GeometryAllocation(Span<const Vertex> vertices, Span<const u32> indices) : _id(GeometryPool::current().allocate(vertices, indices)) {
+}
+
+GeometryAllocation::~GeometryAllocation() {
+    if(_id != invalid_id) {
+        GeometryPool::current().release(_id);
+    }
+}
+
+GeometryRange GeometryAllocation::range() const {
+    DEBUG_ASSERT(_id != invalid_id);
+    return GeometryPool::current()._slots[_id].range;
+}
+
+GeometryPool& GeometryPool::current() {
+    static GeometryPool* pool = new GeometryPool();
+    return *pool;
+}
+
+GeometryPool::GeometryPool() : _vertex_array(vertex_attributes) {
+    _vertices.element_size = sizeof(Vertex);
+    _vertices.first = &GeometryRange::first_vertex;
+    _vertices.count = &GeometryRange::vertex_count;
+    _indices.element_size = sizeof(u32);
+    _indices.first = &GeometryRange::first_index;
+    _indices.count = &GeometryRange::index_count;
+    _vertex_array.set_attribute_enabled(instance_attribute, false);
+}
+
+void GeometryPool::bind() const {
+    _vertex_array.bind();
+}
+
+void GeometryPool::set_instance_buffer(u32 buffer, size_t offset) const {
+    if(buffer) {
+        _vertex_array.set_vertex_buffer(instance_binding, buffer, offset, sizeof(u32), 1);
+    }
+    _vertex_array.set_attribute_enabled(instance_attribute, buffer);
+}
+
+void GeometryPool::multi_draw_indirect(size_t command_offset, u32 command_count) const {
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, reinterpret_cast<void*>(command_offset), int(command_count), 0);
+}
+
+u32 GeometryPool::allocate(Span<const Vertex> vertices, Span<const u32> indices) {
+    u32 id = u32(_slots.size());
+    if(_free_slots.empty()) {
+        _slots.emplace_back();
+    } else {
+        id = _free_slots.back();
+        _free_slots.pop_back();
+    }
+
+    GeometryRange range;
+    range.vertex_count = u32(vertices.size());
+    range.index_count = u32(indices.size());
+    range.first_vertex = allocate_range(_vertices, range.vertex_count);
+    range.first_index = allocate_range(_indices, range.index_count);
+    _slots[id] = { range, true };
+    _meshes++;
+
+    if(range.vertex_count) {
+        glNamedBufferSubData(_vertices.buffer.handle().get(), range.first_vertex * sizeof(Vertex), vertices.size() * sizeof(Vertex), vertices.data());
+    }
+    if(range.index_count) {
+        glNamedBufferSubData(_indices.buffer.handle().get(), range.first_index * sizeof(u32), indices.size() * sizeof(u32), indices.data());
+    }
+
+    return id;
+}
+
+void GeometryPool::release(u32 id) {
+    Slot& slot = _slots[id];
+    DEBUG_ASSERT(slot.live);
+    free_range(_vertices, slot.range.first_vertex, slot.range.vertex_count);
+    free_range(_indices, slot.range.first_index, slot.range.index_count);
+    slot = {};
+    _free_slots.push_back(id);
+    _meshes--;
+}
+
+// Best fit, what is left of the block stays free
+u32 GeometryPool::allocate_range(Pool& pool, u32 count) {
+    if(!count) {
+        return 0;
+    }
+
+    auto best = pool.free_sizes.lower_bound(count);
+    if(best == pool.free_sizes.end()) {
+        // Closing the holes is cheaper than doubling the buffer when they hold enough space
+        if(pool.capacity - pool.used >= count) {
+            compact(pool);
+        } else {
+            grow(pool, count);
+        }
+        best = pool.free_sizes.lower_bound(count);
+        DEBUG_ASSERT(best != pool.free_sizes.end());
+    }
+
+    const u32 first = best->second;
+    const u32 left = best->first - count;
+    pool.free_sizes.erase(best);
+    pool.free_blocks.erase(first);
+    if(left) {
+        add_free_block(pool, first + count, left);
+    }
+    pool.used += count;
+    return first;
+}
+
+// Merged with the free blocks on either side
+void GeometryPool::free_range(Pool& pool, u32 first, u32 count) {
+    if(!count) {
+        return;
+    }
+
+    pool.used -= count;
+    auto next = pool.free_blocks.lower_bound(first);
+    if(next != pool.free_blocks.end() && next->first == first + count) {
+        count += next->second;
+        next = erase_free_block(pool, next);
+    }
+    if(next != pool.free_blocks.begin()) {
+        const auto prev = std::prev(next);
+        if(prev->first + prev->second == first) {
+            first = prev->first;
+            count += prev->second;
+            erase_free_block(pool, prev);
+        }
+    }
+    add_free_block(pool, first, count);
+}
+
+void GeometryPool::add_free_block(Pool& pool, u32 first, u32 count) {
+    pool.free_blocks[first] = count;
+    pool.free_sizes.emplace(count, first);
+}
+
+std::map<u32, u32>::iterator GeometryPool::erase_free_block(Pool& pool, std::map<u32, u32>::iterator block) {
+    const auto [begin, end] = pool.free_sizes.equal_range(block->second);
+    const auto size = std::find_if(begin, end, [&](const auto& entry) { return entry.second == block->first; });
+    DEBUG_ASSERT(size != end);
+    pool.free_sizes.erase(size);
+    return pool.free_blocks.erase(block);
+}
+
+// Offsets do not change, the new space is added to the free block at the end
+void GeometryPool::grow(Pool& pool, u32 count) {
+    const u32 initial = &pool == &_vertices ? initial_vertex_capacity : initial_index_capacity;
+    u32 capacity = std::max(pool.capacity * 2, initial);
+    while(capacity - pool.capacity < count) {
+        capacity *= 2;
+    }
+
+    ByteBuffer buffer(nullptr, size_t(capacity) * pool.element_size);
+    if(pool.capacity) {
+        glCopyNamedBufferSubData(pool.buffer.handle().get(), buffer.handle().get(), 0, 0, size_t(pool.capacity) * pool.element_size);
+    }
+
+    u32 first = pool.capacity;
+    if(!pool.free_blocks.empty()) {
+        const auto last = std::prev(pool.free_blocks.end());
+        if(last->first + last->second == pool.capacity) {
+            first = last->first;
+            erase_free_block(pool, last);
+        }
+    }
+    add_free_block(pool, first, capacity - first);
+
+    pool.buffer = std::move(buffer);
+    pool.capacity = capacity;
+    _growth_count++;
+    update_vertex_array();
+}
+
+void GeometryPool::compact() {
+    compact(_vertices);
+    compact(_indices);
+}
+
+// Meshes are copied in order into a new buffer, so that no copy overlaps the ranges it reads.
+// Only meshes whose allocation is complete are moved, the one being allocated has no range in the pool yet.
+void GeometryPool::compact(Pool& pool) {
+    const bool compacted = pool.free_blocks.empty() || (pool.free_blocks.size() == 1 && pool.free_blocks.begin()->first == pool.used);
+    if(compacted) {
+        return;
+    }
+
+    const auto first = pool.first;
+    const auto count = pool.count;
+    std::vector<Slot*> live;
+    for(Slot& slot : _slots) {
+        if(slot.live && slot.range.*count) {
+            live.push_back(&slot);
+        }
+    }
+    std::sort(live.begin(), live.end(), [&](const Slot* a, const Slot* b) { return a->range.*first < b->range.*first; });
+
+    ByteBuffer buffer(nullptr, size_t(pool.capacity) * pool.element_size);
+    const auto copy = [&](u32 read, u32 write, u32 size) {
+        if(size) {
+            glCopyNamedBufferSubData(pool.buffer.handle().get(), buffer.handle().get(), size_t(read) * pool.element_size, size_t(write) * pool.element_size, size_t(size) * pool.element_size);
+            _compacted_bytes += size_t(size) * pool.element_size;
+        }
+    };
+
+    // Meshes that were already next to each other are copied together
+    u32 write = 0;
+    u32 run_read = 0;
+    u32 run_write = 0;
+    u32 run_size = 0;
+    for(Slot* slot : live) {
+        const u32 read = slot->range.*first;
+        if(read != run_read + run_size) {
+            copy(run_read, run_write, run_size);
+            run_read = read;
+            run_write = write;
+            run_size = 0;
+        }
+        run_size += slot->range.*count;
+        slot->range.*first = write;
+        write += slot->range.*count;
+    }
+    copy(run_read, run_write, run_size);
+
+    pool.buffer = std::move(buffer);
+    pool.free_blocks.clear();
+    pool.free_sizes.clear();
+    add_free_block(pool, pool.used, pool.capacity - pool.used);
+    _compaction_count++;
+    update_vertex_array();
+}
+
+void GeometryPool::compact_if_fragmented() {
+    if(pool_stats(_vertices).fragmentation() > max_fragmentation || pool_stats(_indices).fragmentation() > max_fragmentation) {
+        compact();
+    }
+}
+
+void GeometryPool::update_vertex_array() {
+    if(_vertices.capacity) {
+        _vertex_array.set_vertex_buffer(vertex_binding, _vertices.buffer.handle().get(), 0, sizeof(Vertex));
+    }
+    if(_indices.capacity) {
+        _vertex_array.set_index_buffer(_indices.buffer.handle().get());
+    }
+}
+
+GeometryBufferStats GeometryPool::pool_stats(const Pool& pool) {
+    GeometryBufferStats stats;
+    stats.capacity = pool.capacity;
+    stats.used = pool.used;
+    stats.free_blocks = u32(pool.free_blocks.size());
+    if(!pool.free_sizes.empty()) {
+        stats.largest_free_block = std::prev(pool.free_sizes.end())->first;
+    }
+    return stats;
+}
+
+GeometryPoolStats GeometryPool::stats() const {
+    GeometryPoolStats stats;
+    stats.meshes = _meshes;
+    stats.vertices = pool_stats(_vertices);
+    stats.indices = pool_stats(_indices);
+    stats.growth_count = _growth_count;
+    stats.compaction_count = _compaction_count;
+    stats.compacted_bytes = _compacted_bytes;
+    return stats;
+}
+
+}
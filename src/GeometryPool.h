@@ -0,0 +1,148 @@
+#ifndef GEOMETRYPOOL_H
+#define GEOMETRYPOOL_H
+
+#include <ByteBuffer.h>
+#include <VertexArray.h>
+#include <Vertex.h>
+
+#include <map>
+#include <vector>
+
+namespace OM3D {
+
+// Of one mesh, in elements of the pool buffers
+struct GeometryRange {
+    u32 first_vertex = 0;
+    u32 vertex_count = 0;
+    u32 first_index = 0;
+    u32 index_count = 0;
+};
+
+struct GeometryBufferStats {
+    // In elements
+    u32 capacity = 0;
+    u32 used = 0;
+    u32 free_blocks = 0;
+    u32 largest_free_block = 0;
+
+    // 0 when the free space is a single block, towards 1 as it splits into small ones
+    float fragmentation() const;
+};
+
+struct GeometryPoolStats {
+    u32 meshes = 0;
+    GeometryBufferStats vertices;
+    GeometryBufferStats indices;
+    // Since the start of the program
+    u32 growth_count = 0;
+    // Of either buffer
+    u32 compaction_count = 0;
+    size_t compacted_bytes = 0;
+};
+
+// Geometry of one mesh in the pool, given back on destruction
+class GeometryAllocation : NonCopyable {
+    public:
+        GeometryAllocation() = default;
+
+        GeometryAllocation(Span<const Vertex> vertices, Span<const u32> indices);
+        ~GeometryAllocation();
+
+        GeometryAllocation(GeometryAllocation&& other) {
+            swap(other);
+        }
+
+        GeometryAllocation& operator=(GeometryAllocation&& other) {
+            swap(other);
+            return *this;
+        }
+
+        void swap(GeometryAllocation& other) {
+            std::swap(_id, other._id);
+        }
+
+        // Changed by compaction, read it again before every draw
+        GeometryRange range() const;
+
+    private:
+        static constexpr u32 invalid_id = u32(-1);
+
+        u32 _id = invalid_id;
+};
+
+// Vertices and indices of every mesh, suballocated from one vertex buffer and one index buffer so that every mesh shares
+// the same vertex array and can be drawn by the same multi-draw. Indices are relative to the first vertex of their mesh,
+// draws give it as their base vertex.
+// Released ranges go back to a free list, compaction moves the meshes to close the holes it leaves.
+class GeometryPool : NonCopyable {
+    public:
+        // Never destroyed, its buffers go away with the context
+        static GeometryPool& current();
+
+        void bind() const;
+        // Feeds the instance attribute of basic.vert from a buffer of u32, one per instance, or stops when buffer is 0
+        void set_instance_buffer(u32 buffer, size_t offset = 0) const;
+
+        // Draws command_count commands from the bound indirect buffer, the pool must be bound
+        void multi_draw_indirect(size_t command_offset, u32 command_count) const;
+
+        // Moves every mesh to the start of the buffers, leaving a single free block at their end
+        void compact();
+        // Once per frame, compacts when the free space of a buffer is split too much
+        void compact_if_fragmented();
+
+        GeometryPoolStats stats() const;
+
+    private:
+        friend class GeometryAllocation;
+
+        // One buffer and its free blocks, by first element and by size
+        struct Pool {
+            ByteBuffer buffer;
+            u32 element_size = 0;
+            // Range of a mesh in this buffer
+            u32 GeometryRange::* first = nullptr;
+            u32 GeometryRange::* count = nullptr;
+            u32 capacity = 0;
+            u32 used = 0;
+            std::map<u32, u32> free_blocks;
+            // Same blocks, first element by count, for best fit
+            std::multimap<u32, u32> free_sizes;
+        };
+
+        struct Slot {
+            GeometryRange range;
+            bool live = false;
+        };
+
+        GeometryPool();
+
+        u32 allocate(Span<const Vertex> vertices, Span<const u32> indices);
+        void release(u32 id);
+
+        u32 allocate_range(Pool& pool, u32 count);
+        void free_range(Pool& pool, u32 first, u32 count);
+        static void add_free_block(Pool& pool, u32 first, u32 count);
+        static std::map<u32, u32>::iterator erase_free_block(Pool& pool, std::map<u32, u32>::iterator block);
+        void grow(Pool& pool, u32 count);
+        void compact(Pool& pool);
+        void update_vertex_array();
+
+        static GeometryBufferStats pool_stats(const Pool& pool);
+
+        Pool _vertices;
+        Pool _indices;
+        VertexArray _vertex_array;
+
+        std::vector<Slot> _slots;
+        std::vector<u32> _free_slots;
+        u32 _meshes = 0;
+
+        u32 _growth_count = 0;
+        u32 _compaction_count = 0;
+        size_t _compacted_bytes = 0;
+};
+
+}
+
+#endif // GEOMETRYPOOL_H
@@ -0,0 +1,510 @@
+#include "HierarchicalLod.h"
+
+#include <BoundingTree.h>
+#include <MeshSimplification.h>
+
+#include <glm/geometric.hpp>
+#include <glm/gtc/matrix_inverse.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <tuple>
+
+namespace OM3D {
+
+// Inner nodes covering fewer instances are always drawn through their subtree
+static constexpr size_t min_proxy_instances = 64;
+// Nodes whose instances use more materials get no proxy, it would not save enough draws
+static constexpr size_t max_proxy_materials = 8;
+// Error allowed in a proxy, relative to the diagonal of its node. At the screen size at which Scene switches to proxies, it
+// stays around two pixels. Instances with a smaller bounding diameter are left out of the proxy.
+static constexpr float proxy_error = 0.02f;
+// Must change with the file format or with the way proxies are built, so that old cache files are never loaded
+static constexpr u32 cache_version = 2;
+static constexpr u32 cache_magic = 0x444F4C48;
+
+namespace {
+
+// Geometry merged into a part of a proxy, either a part of the proxy of a child or an instance
+struct Piece {
+    u32 part;
+    u64 key;
+    const MeshData *proxy_part;
+    const SceneObject *object;
+};
+
+}
+
+struct HlodProxies::BuildContext {
+    struct NodeProxy {
+        bool built = false;
+        // Hash of everything the proxy is built from, names its cache file
+        u64 key = 0;
+        std::vector<std::shared_ptr<Material>> materials;
+        // Indexed like materials
+        std::vector<MeshData> parts;
+        size_t replaced_triangles = 0;
+    };
+
+    // Snapshot, the scene keeps changing during the build
+    BoundingTree tree;
+    std::filesystem::path directory;
+    std::vector<NodeProxy> nodes;
+    std::atomic<size_t> cache_hits = 0;
+};
+
+struct HlodProxies::PendingBuild {
+    BuildContext ctx;
+    ThreadPool *pool = nullptr;
+    ThreadPool::TaskGroup group;
+    double time = 0.0; // ms, written by the task
+    // Proxies of these nodes are dropped when the build is swapped in
+    std::vector<bool> invalidated;
+    // The nodes changed, the result is thrown away
+    bool discarded = false;
+};
+
+static bool load_proxy(const std::filesystem::path &path, size_t part_count, std::vector<MeshData> &parts) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+
+    u32 header[3] = {};
+    file.read(reinterpret_cast<char *>(header), sizeof(header));
+    if (!file || header[0] != cache_magic || header[1] != cache_version || header[2] != part_count)
+        return false;
+
+    parts.resize(part_count);
+    for (MeshData &part : parts) {
+        u32 counts[2] = {};
+        file.read(reinterpret_cast<char *>(counts), sizeof(counts));
+        if (!file)
+            return false;
+
+        part.vertices.resize(counts[0]);
+        part.indices.resize(counts[1]);
+        file.read(reinterpret_cast<char *>(part.vertices.data()), std::streamsize(counts[0] * sizeof(Vertex)));
+        file.read(reinterpret_cast<char *>(part.indices.data()), std::streamsize(counts[1] * sizeof(u32)));
+        if (!file)
+            return false;
+
+        for (const u32 index : part.indices) {
+            if (index >= counts[0])
+                return false;
+        }
+    }
+    return true;
+}
+
+static void store_proxy(const std::filesystem::path &path, const std::vector<MeshData> &parts, u32 node) {
+    // Written next to its final name then renamed, identical proxies may be stored from several threads
+    std::filesystem::path temporary = path;
+    temporary += ".tmp" + std::to_string(node);
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        const u32 header[3] = { cache_magic, cache_version, u32(parts.size()) };
+        file.write(reinterpret_cast<const char *>(header), sizeof(header));
+        for (const MeshData &part : parts) {
+            const u32 counts[2] = { u32(part.vertices.size()), u32(part.indices.size()) };
+            file.write(reinterpret_cast<const char *>(counts), sizeof(counts));
+            file.write(reinterpret_cast<const char *>(part.vertices.data()), std::streamsize(part.vertices.size() * sizeof(Vertex)));
+            file.write(reinterpret_cast<const char *>(part.indices.data()), std::streamsize(part.indices.size() * sizeof(u32)));
+        }
+        if (!file)
+            return;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error)
+        std::filesystem::remove(temporary, error);
+}
+
+// Appends the geometry of an instance, in world space
+static void append_object(MeshData &part, const SceneObject &object) {
+    const StaticMesh &mesh = *object.get_mesh();
+    const glm::mat4 &transform = object.transform();
+    const glm::mat3 normal_matrix = glm::inverseTranspose(glm::mat3(transform));
+
+    // The coarsest level has at most the error of the proxy relative to the mesh instead of the node, which is larger
+    const std::vector<u32> &indices = mesh.get_lod_indices(mesh.lod_count() - 1);
+    const u32 offset = u32(part.vertices.size());
+    for (const Vertex &v : mesh.get_vertices()) {
+        Vertex world = v;
+        world.position = glm::vec3(transform * glm::vec4(v.position, 1.0f));
+        world.normal = glm::normalize(normal_matrix * v.normal);
+        const glm::vec3 tangent = glm::mat3(transform) * glm::vec3(v.tangent_bitangent_sign);
+        if (tangent != glm::vec3(0.0f))
+            world.tangent_bitangent_sign = glm::vec4(glm::normalize(tangent), v.tangent_bitangent_sign.w);
+        part.vertices.push_back(world);
+    }
+    for (const u32 index : indices) {
+        part.indices.push_back(offset + index);
+    }
+}
+
+static void append_part(MeshData &part, const MeshData &other) {
+    const u32 offset = u32(part.vertices.size());
+    part.vertices.insert(part.vertices.end(), other.vertices.begin(), other.vertices.end());
+    for (const u32 index : other.indices) {
+        part.indices.push_back(offset + index);
+    }
+}
+
+// Vertices at the same position are merged, the first one keeps its attributes. Instances become closed and get connected to
+// their neighbours, so that simplification collapses them instead of removing their faces one by one.
+static void weld(MeshData &part) {
+    std::vector<u32> order(part.vertices.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](u32 a, u32 b) {
+        const glm::vec3 &p = part.vertices[a].position;
+        const glm::vec3 &q = part.vertices[b].position;
+        return std::tie(p.x, p.y, p.z, a) < std::tie(q.x, q.y, q.z, b);
+    });
+
+    std::vector<u32> remap(part.vertices.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        const bool same = i && part.vertices[order[i]].position == part.vertices[order[i - 1]].position;
+        remap[order[i]] = same ? remap[order[i - 1]] : order[i];
+    }
+    for (u32 &index : part.indices) {
+        index = remap[index];
+    }
+}
+
+// Keeps the vertices still referenced by the simplified indices
+static MeshData compact(const MeshData &part, const std::vector<u32> &indices) {
+    MeshData compacted;
+    std::vector<u32> remap(part.vertices.size(), u32(-1));
+    compacted.indices.reserve(indices.size());
+    for (const u32 index : indices) {
+        if (remap[index] == u32(-1)) {
+            remap[index] = u32(compacted.vertices.size());
+            compacted.vertices.push_back(part.vertices[index]);
+        }
+        compacted.indices.push_back(remap[index]);
+    }
+    return compacted;
+}
+
+HlodProxies::HlodProxies() {}
+
+HlodProxies::~HlodProxies() {
+    // The task reads the build
+    if (_pending)
+        _pending->pool->wait(_pending->group);
+}
+
+void HlodProxies::start_build(const BoundingTree &tree, const std::string &cache_directory, ThreadPool &pool) {
+    // One build at a time, a discarded one is still running
+    if (_pending) {
+        _pending->pool->wait(_pending->group);
+        _pending.reset();
+    }
+
+    _pending = std::make_unique<PendingBuild>();
+    _pending->ctx.tree = tree.snapshot();
+    _pending->ctx.directory = cache_directory;
+    _pending->ctx.nodes.resize(tree.slot_count());
+    _pending->pool = &pool;
+    _pending->invalidated.resize(tree.slot_count(), false);
+
+    PendingBuild *build = _pending.get();
+    pool.run(build->group, [build] {
+        const double start = program_time();
+        HlodProxies::build(build->ctx, *build->pool);
+        build->time = (program_time() - start) * 1000.0;
+    });
+    // Without workers, the task would only run once this thread waits on the pool
+    if (pool.thread_count() == 1)
+        pool.wait(build->group);
+}
+
+bool HlodProxies::is_building() const {
+    return _pending != nullptr;
+}
+
+bool HlodProxies::finish_build() {
+    if (!_pending || !_pending->group.is_done())
+        return false;
+
+    const std::unique_ptr<PendingBuild> build = std::move(_pending);
+    if (build->discarded)
+        return false;
+
+    clear();
+
+    // Buffers are created on this thread
+    const BuildContext &ctx = build->ctx;
+    _proxies.resize(ctx.nodes.size());
+    for (u32 node = 0; node < ctx.nodes.size(); node++) {
+        const BuildContext::NodeProxy &data = ctx.nodes[node];
+        if (!data.built || build->invalidated[node])
+            continue;
+
+        auto proxy = std::make_unique<Proxy>();
+        proxy->replaced_triangles = data.replaced_triangles;
+        for (size_t i = 0; i < data.parts.size(); i++) {
+            if (data.parts[i].indices.empty())
+                continue;
+
+            proxy->triangles += data.parts[i].indices.size() / 3;
+            proxy->parts.emplace_back(std::make_shared<StaticMesh>(data.parts[i]), data.materials[i]);
+        }
+        _total_triangles += proxy->triangles;
+        _proxies[node] = std::move(proxy);
+        _proxy_count++;
+    }
+
+    _cache_hits = ctx.cache_hits;
+    _build_time = build->time;
+    return true;
+}
+
+void HlodProxies::build(BuildContext &ctx, ThreadPool &pool) {
+    const BoundingTree &tree = ctx.tree;
+    if (tree.is_empty())
+        return;
+
+    if (!ctx.directory.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(ctx.directory, error);
+        if (error)
+            ctx.directory.clear();
+    }
+
+    // Candidates by depth, from the root
+    std::vector<std::vector<u32>> depths;
+    std::vector<size_t> leaf_counts(tree.slot_count(), 0);
+    std::vector<u32> order;
+    std::vector<std::pair<u32, u32>> stack = { { 0, 0 } };
+    std::vector<u32> node_depths(tree.slot_count(), 0);
+    while (!stack.empty()) {
+        const auto [node, depth] = stack.back();
+        stack.pop_back();
+
+        order.push_back(node);
+        node_depths[node] = depth;
+        const u32 first = tree.first_child(node);
+        for (u32 c = first; c < first + tree.child_count(node); c++) {
+            stack.emplace_back(c, depth + 1);
+        }
+    }
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        const u32 node = *it;
+        if (tree.instance(node) != BoundingTree::invalid_index) {
+            leaf_counts[node] = 1;
+            continue;
+        }
+
+        const u32 first = tree.first_child(node);
+        for (u32 c = first; c < first + tree.child_count(node); c++) {
+            leaf_counts[node] += leaf_counts[c];
+        }
+        if (leaf_counts[node] >= min_proxy_instances) {
+            depths.resize(std::max(depths.size(), size_t(node_depths[node]) + 1));
+            depths[node_depths[node]].push_back(node);
+        }
+    }
+
+    // Children are built before their parents
+    for (size_t depth = depths.size(); depth-- > 0;) {
+        const std::vector<u32> &nodes = depths[depth];
+        pool.parallel_for(0, nodes.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                build_proxy(ctx, nodes[i]);
+            }
+        });
+    }
+}
+
+void HlodProxies::build_proxy(BuildContext &ctx, u32 node) {
+    BuildContext::NodeProxy &proxy = ctx.nodes[node];
+    const glm::vec3 min = ctx.tree.min_corner(node);
+    const glm::vec3 max = ctx.tree.max_corner(node);
+    const float error = proxy_error * glm::length(max - min);
+
+    const auto part_of = [&](const std::shared_ptr<Material> &material) {
+        const auto it = std::find(proxy.materials.begin(), proxy.materials.end(), material);
+        if (it != proxy.materials.end())
+            return u32(it - proxy.materials.begin());
+        proxy.materials.push_back(material);
+        return u32(proxy.materials.size() - 1);
+    };
+
+    // Children with a proxy are not descended, the order only depends on the tree
+    std::vector<Piece> pieces;
+    std::vector<u32> stack;
+    const u32 first = ctx.tree.first_child(node);
+    for (u32 c = first + ctx.tree.child_count(node); c-- > first;) {
+        stack.push_back(c);
+    }
+    while (!stack.empty()) {
+        const u32 n = stack.back();
+        stack.pop_back();
+
+        const BuildContext::NodeProxy &child = ctx.nodes[n];
+        if (child.built) {
+            for (size_t i = 0; i < child.parts.size(); i++) {
+                pieces.push_back({ part_of(child.materials[i]), content_hash(&i, sizeof(i), child.key), &child.parts[i], nullptr });
+            }
+            proxy.replaced_triangles += child.replaced_triangles;
+            continue;
+        }
+
+        const InstanceHandle instance = ctx.tree.instance(n);
+        if (instance == BoundingTree::invalid_index) {
+            const u32 first_child = ctx.tree.first_child(n);
+            for (u32 c = first_child + ctx.tree.child_count(n); c-- > first_child;) {
+                stack.push_back(c);
+            }
+            continue;
+        }
+
+        const SceneObject &object = *ctx.tree.object(instance);
+        if (!object.get_mesh() || !object.get_material())
+            continue;
+
+        proxy.replaced_triangles += object.get_mesh()->lod_triangle_count(0);
+        if (2.0f * object.get_bounding_sphere().radius < error)
+            continue;
+
+        const u64 key = content_hash(&object.transform(), sizeof(glm::mat4), object.get_mesh()->content_hash());
+        pieces.push_back({ part_of(object.get_material()), key, nullptr, &object });
+    }
+
+    if (proxy.materials.size() > max_proxy_materials) {
+        proxy = BuildContext::NodeProxy();
+        return;
+    }
+
+    proxy.key = content_hash(&error, sizeof(error), cache_version);
+    for (const Piece &piece : pieces) {
+        const u64 inputs[2] = { piece.part, piece.key };
+        proxy.key = content_hash(inputs, sizeof(inputs), proxy.key);
+    }
+    proxy.built = true;
+
+    std::filesystem::path path;
+    if (!ctx.directory.empty()) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.hlod", static_cast<unsigned long long>(proxy.key));
+        path = ctx.directory / name;
+        if (load_proxy(path, proxy.materials.size(), proxy.parts)) {
+            ctx.cache_hits++;
+            return;
+        }
+    }
+
+    std::vector<MeshData> merged(proxy.materials.size());
+    for (const Piece &piece : pieces) {
+        if (piece.proxy_part)
+            append_part(merged[piece.part], *piece.proxy_part);
+        else
+            append_object(merged[piece.part], *piece.object);
+    }
+
+    proxy.parts.resize(merged.size());
+    for (size_t i = 0; i < merged.size(); i++) {
+        weld(merged[i]);
+
+        std::vector<glm::vec3> positions;
+        positions.reserve(merged[i].vertices.size());
+        for (const Vertex &v : merged[i].vertices) {
+            positions.push_back(v.position);
+        }
+        proxy.parts[i] = compact(merged[i], simplify_mesh(positions, merged[i].indices, 0, error));
+    }
+
+    if (!path.empty())
+        store_proxy(path, proxy.parts, node);
+}
+
+void HlodProxies::clear() {
+    if (_pending)
+        _pending->discarded = true;
+    _proxies.clear();
+    _selected.clear();
+    _proxy_count = 0;
+    _total_triangles = 0;
+    _cache_hits = 0;
+}
+
+void HlodProxies::invalidate(const BoundingTree &tree, u32 node) {
+    for (u32 n = node; n != BoundingTree::invalid_index; n = tree.parent(n)) {
+        drop(n);
+        if (_pending && !_pending->discarded)
+            _pending->invalidated[n] = true;
+    }
+}
+
+void HlodProxies::drop(u32 node) {
+    if (node >= _proxies.size() || !_proxies[node])
+        return;
+
+    _total_triangles -= _proxies[node]->triangles;
+    _proxy_count--;
+    _proxies[node].reset();
+}
+
+bool HlodProxies::is_empty() const {
+    return !_proxy_count;
+}
+
+void HlodProxies::begin_frame(const glm::vec3 &eye, float scale, float screen_size) {
+    _eye = eye;
+    _scale = scale;
+    _screen_size = screen_size;
+    _selected.clear();
+}
+
+bool HlodProxies::select(u32 node, const glm::vec3 &min, const glm::vec3 &max) {
+    if (node >= _proxies.size() || !_proxies[node])
+        return false;
+
+    const float radius = glm::length(max - min) * 0.5f;
+    const float distance = glm::length((min + max) * 0.5f - _eye);
+    if (distance <= radius || radius * _scale / distance >= _screen_size)
+        return false;
+
+    _selected.push_back(node);
+    return true;
+}
+
+const std::vector<u32> &HlodProxies::selected_nodes() const {
+    return _selected;
+}
+
+const std::vector<SceneObject> &HlodProxies::parts(u32 node) const {
+    return _proxies[node]->parts;
+}
+
+size_t HlodProxies::triangle_count(u32 node) const {
+    return _proxies[node]->triangles;
+}
+
+size_t HlodProxies::replaced_triangles(u32 node) const {
+    return _proxies[node]->replaced_triangles;
+}
+
+size_t HlodProxies::proxy_count() const {
+    return _proxy_count;
+}
+
+size_t HlodProxies::total_triangles() const {
+    return _total_triangles;
+}
+
+size_t HlodProxies::cache_hits() const {
+    return _cache_hits;
+}
+
+double HlodProxies::build_time() const {
+    return _build_time;
+}
+
+}
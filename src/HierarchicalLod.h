@@ -0,0 +1,91 @@
+#ifndef HIERARCHICALLOD_H
+#define HIERARCHICALLOD_H
+
+#include <SceneObject.h>
+#include <ThreadPool.h>
+
+#include <glm/vec3.hpp>
+
+#include <string>
+#include <vector>
+
+namespace OM3D {
+
+class BoundingTree;
+
+// Hierarchical levels of detail: inner nodes of a BoundingTree covering enough instances get a proxy, their instances merged
+// in world space by material and simplified. Nodes small enough on screen are drawn with their proxy instead of their subtree.
+// Proxies are built bottom-up, each one from the proxies of its children, and cached on disk under the hash of their inputs.
+class HlodProxies : NonCopyable {
+    public:
+        HlodProxies();
+        ~HlodProxies();
+
+        // Every proxy is built again or loaded from cache_directory, which is created if needed, on the pool and from a snapshot
+        // of the tree. The current proxies stay in use until finish_build() replaces them. An empty directory disables the cache.
+        void start_build(const BoundingTree &tree, const std::string &cache_directory, ThreadPool &pool);
+        bool is_building() const;
+        // On the GL thread, creates the buffers of a finished build and swaps them in. Returns true if the proxies were replaced.
+        bool finish_build();
+
+        // Proxies are only valid as long as the nodes of the tree do not change. Drops them, the build in progress is discarded.
+        void clear();
+        // Instances below node moved: drops the proxies of node and of its ancestors, now and in the build in progress
+        void invalidate(const BoundingTree &tree, u32 node);
+        bool is_empty() const;
+
+        // Size on screen is the bounding diameter over the screen height, scale is the [1][1] term of the projection
+        void begin_frame(const glm::vec3 &eye, float scale, float screen_size);
+
+        // Called by the traversal on every inner node inside the frustum, returns true if its proxy replaces its subtree
+        bool select(u32 node, const glm::vec3 &min, const glm::vec3 &max);
+
+        // Nodes whose proxy was selected by the last traversal
+        const std::vector<u32> &selected_nodes() const;
+
+        // One object per material, the geometry is in world space
+        const std::vector<SceneObject> &parts(u32 node) const;
+        size_t triangle_count(u32 node) const;
+        // Full detail triangles of the instances below the node
+        size_t replaced_triangles(u32 node) const;
+
+        size_t proxy_count() const;
+        size_t total_triangles() const;
+        size_t cache_hits() const;
+        double build_time() const; // ms
+
+    private:
+        struct Proxy {
+            std::vector<SceneObject> parts;
+            size_t triangles = 0;
+            size_t replaced_triangles = 0;
+        };
+
+        struct BuildContext;
+        struct PendingBuild;
+
+        // Runs on the pool, fills ctx.nodes
+        static void build(BuildContext &ctx, ThreadPool &pool);
+        // Children first, their proxies are merged instead of their instances
+        static void build_proxy(BuildContext &ctx, u32 node);
+
+        void drop(u32 node);
+
+        // Also holds references to the meshes, so it is only destroyed on this thread
+        std::unique_ptr<PendingBuild> _pending;
+
+        std::vector<std::unique_ptr<Proxy>> _proxies;
+        size_t _proxy_count = 0;
+        size_t _total_triangles = 0;
+        size_t _cache_hits = 0;
+        double _build_time = 0.0;
+
+        std::vector<u32> _selected;
+        glm::vec3 _eye = {};
+        float _scale = 1.0f;
+        float _screen_size = 0.0f;
+};
+
+}
+
+#endif // HIERARCHICALLOD_H
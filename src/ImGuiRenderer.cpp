@@ -1,6 +1,6 @@
 #include "ImGuiRenderer.h"
 
-#include <TypedBuffer.h>
+#include <GLState.h>
 
 #include <glm/vec2.hpp>
 
@@ -15,6 +15,13 @@
 
 namespace OM3D {
 
+// Colors are read as bytes, imgui.vert normalizes them
+static constexpr VertexAttribute vertex_attributes[] = {
+    { 0, 0, 2, GL_FLOAT, offsetof(ImDrawVert, pos) },
+    { 1, 0, 2, GL_FLOAT, offsetof(ImDrawVert, uv) },
+    { 2, 0, 4, GL_UNSIGNED_BYTE, offsetof(ImDrawVert, col) },
+};
+
 static ImGuiMouseButton button_to_imgui(int button) {
     switch(button) {
         case GLFW_MOUSE_BUTTON_LEFT: return ImGuiMouseButton_Left;
@@ -182,7 +189,7 @@ static void mouse_button_callback(GLFWwindow*, int button, int action, int) {
     ImGui::GetIO().AddMouseButtonEvent(button_to_imgui(button), action == GLFW_PRESS);
 }
 
-ImGuiRenderer::ImGuiRenderer(GLFWwindow* window) : _window(window) {
+ImGuiRenderer::ImGuiRenderer(GLFWwindow* window) : _window(window), _vertex_array(vertex_attributes) {
     IMGUI_CHECKVERSION();
     ImGui::CreateContext();
 
@@ -241,15 +248,16 @@ void ImGuiRenderer::render(const ImDrawData* draw_data) {
     _material.set_uniform(HASH("viewport_size"), glm::vec2(draw_data->DisplaySize.x, draw_data->DisplaySize.y));
     _material.bind();
 
-    glEnable(GL_SCISSOR_TEST);
-    DEFER(glDisable(GL_SCISSOR_TEST));
+    GLState::current().set_capability(GL_SCISSOR_TEST, true);
+    DEFER(GLState::current().set_capability(GL_SCISSOR_TEST, false));
 
-    TypedBuffer<ImDrawIdx> index_buffer(nullptr, draw_data->TotalIdxCount);
-    TypedBuffer<ImDrawVert> vertex_buffer(nullptr, draw_data->TotalVtxCount);
+    _stream.begin_frame();
+    const StreamAllocation index_buffer = _stream.allocate(draw_data->TotalIdxCount * sizeof(ImDrawIdx));
+    const StreamAllocation vertex_buffer = _stream.allocate(draw_data->TotalVtxCount * sizeof(ImDrawVert));
 
     {
-        auto indices = index_buffer.map(AccessType::WriteOnly);
-        auto vertices = vertex_buffer.map(AccessType::WriteOnly);
+        ImDrawIdx* indices = index_buffer.as<ImDrawIdx>();
+        ImDrawVert* vertices = vertex_buffer.as<ImDrawVert>();
 
         size_t index_offset = 0;
         size_t vertex_offset = 0;
@@ -262,11 +270,13 @@ void ImGuiRenderer::render(const ImDrawData* draw_data) {
         }
     }
 
-    index_buffer.bind(BufferUsage::Index);
-    vertex_buffer.bind(BufferUsage::Attribute);
+    // The stream may have grown between both allocations, each one is read from its own buffer
+    _vertex_array.set_vertex_buffer(0, vertex_buffer.buffer, vertex_buffer.offset, sizeof(ImDrawVert));
+    _vertex_array.set_index_buffer(index_buffer.buffer);
+    _vertex_array.bind();
 
-    byte* vertex_offset = nullptr;
-    byte* index_offset = nullptr;
+    int vertex_offset = 0;
+    byte* index_offset = reinterpret_cast<byte*>(index_buffer.offset);
     for(int c = 0; c != draw_data->CmdListsCount; ++c) {
         const ImDrawList* cmd_list = draw_data->CmdLists[c];
 
@@ -288,18 +298,11 @@ void ImGuiRenderer::render(const ImDrawData* draw_data) {
                 tex->bind(0);
             }
 
-            glVertexAttribPointer(0, 2, GL_FLOAT, false, sizeof(ImDrawVert), vertex_offset);
-            glVertexAttribPointer(1, 2, GL_FLOAT, false, sizeof(ImDrawVert), vertex_offset + (2 * sizeof(float)));
-            glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, false, sizeof(ImDrawVert), vertex_offset + (4 * sizeof(float)));
-            glEnableVertexAttribArray(0);
-            glEnableVertexAttribArray(1);
-            glEnableVertexAttribArray(2);
-
-            glDrawElements(GL_TRIANGLES, cmd.ElemCount, sizeof(ImDrawIdx) == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT, reinterpret_cast<void*>(drawn_index_offset));
+            glDrawElementsBaseVertex(GL_TRIANGLES, cmd.ElemCount, sizeof(ImDrawIdx) == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT, reinterpret_cast<void*>(drawn_index_offset), vertex_offset);
             drawn_index_offset += cmd.ElemCount * sizeof(ImDrawIdx);
         }
 
-        vertex_offset += cmd_list->VtxBuffer.Size * sizeof(ImDrawVert);
+        vertex_offset += cmd_list->VtxBuffer.Size;
         index_offset += cmd_list->IdxBuffer.Size * sizeof(ImDrawIdx);
     }
 }
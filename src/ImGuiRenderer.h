@@ -2,6 +2,8 @@
 #define IMGUIRENDERER_H
 
 #include <Material.h>
+#include <StreamBuffer.h>
+#include <VertexArray.h>
 
 #include <chrono>
 
@@ -17,6 +19,7 @@ enum DebugView {
     Depth,
     AABB,
     Tiles,
+    HiZ,
 
     DebugView_Size,
 };
@@ -30,10 +33,31 @@ class ImGuiRenderer : NonMovable {
 
         void display_debug_mode();
 
-        const char *debug_views[6] = { "No debug", "Albedo", "Normals", "Depth", "BVH Hierarchy", "Tiles" };
+        const char *debug_views[7] = { "No debug", "Albedo", "Normals", "Depth", "BVH Hierarchy", "Tiles", "Hi-Z pyramid" };
         uint32_t debug_mode = 0;
+        const char *bvh_strategies[4] = { "Median", "SAH", "LBVH", "LBVH + treelets" };
+        int bvh_strategy = 0;
         int bvh_subdivisions = 4;
+        const char *culling_kernels[3] = { "Scalar", "SSE", "AVX2" };
+        int culling_kernel = 0;
+        const char *occlusion_modes[4] = { "Disabled", "CPU occluders", "Two-phase Hi-Z", "Occlusion queries (CHC++)" };
+        int occlusion_mode = 0;
+        float min_screen_size = 0.0f;
+        float hlod_screen_size = 0.0f;
+        bool meshlet_culling = true;
+        int hiz_level = 0;
+        bool gpu_culling = false;
         int aabb_render_level = 0;
+        int synthetic_instances = 10000;
+        int synthetic_vehicles = 2000;
+        bool animate_vehicles = true;
+        const char *hierarchy_updates[2] = { "Refit", "Remove + insert" };
+        int hierarchy_update = 0;
+        int soak_operations = 100000;
+        int benchmark_rays = 1000000;
+        int benchmark_load_objects = 100000;
+        int shadow_cascades = 4;
+        bool validate_gl_state = false;
 
     private:
         void render(const ImDrawData* draw_data);
@@ -43,6 +67,8 @@ class ImGuiRenderer : NonMovable {
 
         Material _material;
         std::unique_ptr<Texture> _font;
+        StreamBuffer _stream;
+        VertexArray _vertex_array;
         std::chrono::time_point<std::chrono::high_resolution_clock> _last;
 };
 
@@ -1,5 +1,7 @@
 #include "Material.h"
 
+#include <GLState.h>
+
 #include <glad/glad.h>
 
 #include <algorithm>
@@ -26,6 +28,21 @@ namespace OM3D
         _depth_test_mode = depth;
     }
 
+    bool Material::culls_back_faces() const
+    {
+        return _blend_mode == BlendMode::None && _depth_test_mode != DepthTestMode::ReversedFrontCull;
+    }
+
+    bool Material::is_transparent() const
+    {
+        return _blend_mode == BlendMode::Alpha || _blend_mode == BlendMode::Additive;
+    }
+
+    const std::shared_ptr<Program> &Material::get_program() const
+    {
+        return _program;
+    }
+
     void Material::set_texture(u32 slot, std::shared_ptr<Texture> tex)
     {
         if (const auto it = std::find_if(_textures.begin(), _textures.end(), [&](const auto &t)
@@ -47,69 +64,76 @@ namespace OM3D
 
     void Material::bind() const
     {
-        glDepthMask(write_z_buffer);
+        bind_state();
+        _program->bind();
+    }
+
+    void Material::bind_state() const
+    {
+        GLState &state = GLState::current();
+        state.set_depth_mask(write_z_buffer);
 
         switch (_blend_mode)
         {
         case BlendMode::NoBlendNoCulling:
-            glDisable(GL_BLEND);
-            glDisable(GL_CULL_FACE);
+            state.set_capability(GL_BLEND, false);
+            state.set_capability(GL_CULL_FACE, false);
             break;
         case BlendMode::None:
-            glDisable(GL_BLEND);
-            glEnable(GL_CULL_FACE);
-            glCullFace(GL_BACK);
-            glFrontFace(GL_CCW);
+            state.set_capability(GL_BLEND, false);
+            state.set_capability(GL_CULL_FACE, true);
+            state.set_cull_face(GL_BACK);
+            state.set_front_face(GL_CCW);
             break;
 
         case BlendMode::Alpha:
-            glEnable(GL_BLEND);
-            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-            glDisable(GL_CULL_FACE);
+            state.set_capability(GL_BLEND, true);
+            state.set_blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            state.set_capability(GL_CULL_FACE, false);
             break;
 
         case BlendMode::Additive:
-            glEnable(GL_BLEND);
-            glBlendFunc(GL_ONE, GL_ONE);
+            state.set_capability(GL_BLEND, true);
+            state.set_blend_func(GL_ONE, GL_ONE);
             break;
         }
 
         switch (_depth_test_mode)
         {
         case DepthTestMode::None:
-            glDisable(GL_DEPTH_TEST);
+            state.set_capability(GL_DEPTH_TEST, false);
             break;
 
         case DepthTestMode::Equal:
-            glEnable(GL_DEPTH_TEST);
-            glDepthFunc(GL_EQUAL);
+            state.set_capability(GL_DEPTH_TEST, true);
+            state.set_depth_func(GL_EQUAL);
             break;
 
         case DepthTestMode::Standard:
-            glEnable(GL_DEPTH_TEST);
+            state.set_capability(GL_DEPTH_TEST, true);
             // We are using reverse-Z
-            glDepthFunc(GL_GEQUAL);
+            state.set_depth_func(GL_GEQUAL);
             break;
 
         case DepthTestMode::Reversed:
-            glEnable(GL_DEPTH_TEST);
+            state.set_capability(GL_DEPTH_TEST, true);
             // We are using reverse-Z
-            glDepthFunc(GL_LEQUAL);
+            state.set_depth_func(GL_LEQUAL);
             break;
 
         case DepthTestMode::Xor:
-            glEnable(GL_DEPTH_TEST);
+            state.set_capability(GL_DEPTH_TEST, true);
             // We are using reverse-Z
-            glDepthFunc(GL_NOTEQUAL);
+            state.set_depth_func(GL_NOTEQUAL);
             break;
 
         case DepthTestMode::ReversedFrontCull:
-            glEnable(GL_DEPTH_TEST);
+            state.set_capability(GL_DEPTH_TEST, true);
             // We are using reverse-Z
-            glDepthFunc(GL_LEQUAL);
-            glEnable(GL_CULL_FACE);
-            glCullFace(GL_FRONT);
-            glFrontFace(GL_CCW);
+            state.set_depth_func(GL_LEQUAL);
+            state.set_capability(GL_CULL_FACE, true);
+            state.set_cull_face(GL_FRONT);
+            state.set_front_face(GL_CCW);
             break;
         }
 
@@ -117,7 +141,6 @@ namespace OM3D
         {
             texture.second->bind(texture.first);
         }
-        _program->bind();
     }
 
     std::shared_ptr<Material> Material::empty_material()
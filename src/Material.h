@@ -42,6 +42,15 @@ class Material {
         }
 
         void bind() const;
+        // Everything but the program: depth, blending, culling and textures
+        void bind_state() const;
+
+        const std::shared_ptr<Program> &get_program() const;
+
+        // Back faces are discarded by the rasterizer, so geometry facing away from the camera can be skipped before drawing
+        bool culls_back_faces() const;
+        // Blended over what is behind it, so drawn back to front after the opaque geometry
+        bool is_transparent() const;
 
         static std::shared_ptr<Material> empty_material();
         static Material textured_material();
@@ -0,0 +1,277 @@
+#include "MeshSimplification.h"
+
+#include <glm/geometric.hpp>
+
+#include <algorithm>
+#include <queue>
+#include <unordered_set>
+
+namespace OM3D {
+
+// Meshes with fewer triangles are drawn at full detail at any size
+static constexpr size_t min_lod_triangles = 64;
+static constexpr size_t max_lod_levels = 6;
+// Error allowed in the first level, relative to the diagonal of the mesh bounds. With the screen sizes at which Scene
+// switches levels, it stays around a pixel on screen.
+static constexpr float first_lod_error = 0.002f;
+// A level that keeps more than this fraction of the triangles of the previous one ends the chain
+static constexpr float max_lod_triangle_ratio = 0.8f;
+// Collapses that turn a face by more than this, as the cosine of the angle between the normals (about 45 degrees), are rejected
+static constexpr float min_normal_cosine = 0.7f;
+
+namespace {
+
+// Weighted sum of squared distances to a set of planes, as the symmetric matrix of (a, b, c, d)
+struct Quadric {
+    double a2 = 0.0, ab = 0.0, ac = 0.0, ad = 0.0;
+    double b2 = 0.0, bc = 0.0, bd = 0.0;
+    double c2 = 0.0, cd = 0.0;
+    double d2 = 0.0;
+    double weight = 0.0;
+
+    void add_plane(const glm::dvec3 &n, double d, double w) {
+        a2 += w * n.x * n.x; ab += w * n.x * n.y; ac += w * n.x * n.z; ad += w * n.x * d;
+        b2 += w * n.y * n.y; bc += w * n.y * n.z; bd += w * n.y * d;
+        c2 += w * n.z * n.z; cd += w * n.z * d;
+        d2 += w * d * d;
+        weight += w;
+    }
+
+    Quadric &operator+=(const Quadric &other) {
+        a2 += other.a2; ab += other.ab; ac += other.ac; ad += other.ad;
+        b2 += other.b2; bc += other.bc; bd += other.bd;
+        c2 += other.c2; cd += other.cd;
+        d2 += other.d2;
+        weight += other.weight;
+        return *this;
+    }
+
+    double sum(const glm::vec3 &p) const {
+        const double x = p.x, y = p.y, z = p.z;
+        return std::max(a2 * x * x + 2.0 * ab * x * y + 2.0 * ac * x * z + 2.0 * ad * x
+                        + b2 * y * y + 2.0 * bc * y * z + 2.0 * bd * y
+                        + c2 * z * z + 2.0 * cd * z
+                        + d2, 0.0);
+    }
+
+    double mean(const glm::vec3 &p) const {
+        return weight > 0.0 ? sum(p) / weight : 0.0;
+    }
+};
+
+// from is merged into to, versions tell whether the quadrics changed since the cost was computed
+struct Collapse {
+    double cost;
+    u32 from;
+    u32 to;
+    u32 from_version;
+    u32 to_version;
+
+    bool operator<(const Collapse &other) const {
+        return cost > other.cost;
+    }
+};
+
+}
+
+std::vector<u32> simplify_mesh(const std::vector<glm::vec3> &positions, const std::vector<u32> &indices, size_t target_triangles, float max_error) {
+    std::vector<u32> triangles = indices;
+    const u32 triangle_count = u32(triangles.size() / 3);
+    if (triangle_count <= target_triangles)
+        return triangles;
+
+    // The error of a collapse is the mean distance to the faces, weighted by their area, plus the distance to every border.
+    // Borders are kept in place by planes orthogonal to their face, their distances are not averaged so that they do not
+    // move more than the error even next to large faces, this is what keeps holes from opening.
+    const u32 vertex_count = u32(positions.size());
+    std::vector<Quadric> quadrics(vertex_count);
+    std::vector<Quadric> borders(vertex_count);
+    std::vector<std::vector<u32>> vertex_triangles(vertex_count);
+    std::vector<glm::vec3> normals(triangle_count);
+    std::vector<glm::vec3> original_normals;
+
+    // Faces weighted by their area
+    for (u32 t = 0; t < triangle_count; t++) {
+        const u32 *v = &triangles[3 * t];
+        const glm::dvec3 a = positions[v[0]];
+        const glm::dvec3 cross = glm::cross(glm::dvec3(positions[v[1]]) - a, glm::dvec3(positions[v[2]]) - a);
+        const double length = glm::length(cross);
+        normals[t] = length > 0.0 ? glm::vec3(cross / length) : glm::vec3(0.0f);
+        for (u32 i = 0; i < 3; i++) {
+            vertex_triangles[v[i]].push_back(t);
+            if (length > 0.0)
+                quadrics[v[i]].add_plane(cross / length, -glm::dot(cross / length, a), length * 0.5);
+        }
+    }
+
+    original_normals = normals;
+
+    // Directed edges without their opposite are borders
+    std::unordered_set<u64> edges;
+    edges.reserve(triangles.size());
+    for (u32 i = 0; i < 3 * triangle_count; i++) {
+        const u32 next = i % 3 == 2 ? i - 2 : i + 1;
+        edges.insert(u64(triangles[i]) << 32 | triangles[next]);
+    }
+    for (u32 i = 0; i < 3 * triangle_count; i++) {
+        const u32 a = triangles[i];
+        const u32 b = triangles[i % 3 == 2 ? i - 2 : i + 1];
+        if (edges.count(u64(b) << 32 | a))
+            continue;
+
+        const glm::dvec3 edge = glm::dvec3(positions[b]) - glm::dvec3(positions[a]);
+        const glm::dvec3 n = glm::cross(edge, glm::dvec3(normals[i / 3]));
+        const double length = glm::length(n);
+        if (length <= 0.0)
+            continue;
+
+        const glm::dvec3 plane = n / length;
+        const double d = -glm::dot(plane, glm::dvec3(positions[a]));
+        borders[a].add_plane(plane, d, 1.0);
+        borders[b].add_plane(plane, d, 1.0);
+    }
+
+    std::vector<u32> versions(vertex_count, 0);
+    std::vector<u8> removed_vertices(vertex_count, 0);
+    std::vector<u8> removed_triangles(triangle_count, 0);
+
+    // Collapses over the error are never taken, they are not queued
+    const double max_cost = double(max_error) * double(max_error);
+    std::priority_queue<Collapse> collapses;
+    const auto push = [&](u32 from, u32 to) {
+        Quadric q = quadrics[from];
+        q += quadrics[to];
+        Quadric border = borders[from];
+        border += borders[to];
+        const double cost = q.mean(positions[to]) + border.sum(positions[to]);
+        if (cost <= max_cost)
+            collapses.push({ cost, from, to, versions[from], versions[to] });
+    };
+    // Both directions of every edge, shared edges are pushed from one of their faces
+    for (u32 i = 0; i < 3 * triangle_count; i++) {
+        const u32 a = triangles[i];
+        const u32 b = triangles[i % 3 == 2 ? i - 2 : i + 1];
+        if (a > b && edges.count(u64(b) << 32 | a))
+            continue;
+        push(a, b);
+        push(b, a);
+    }
+
+    size_t remaining = triangle_count;
+    std::vector<u32> neighbours;
+    while (remaining > target_triangles && !collapses.empty()) {
+        const Collapse c = collapses.top();
+        collapses.pop();
+        if (removed_vertices[c.from] || removed_vertices[c.to] || versions[c.from] != c.from_version || versions[c.to] != c.to_version)
+            continue;
+
+        // The edge must still exist, and no face around it may flip, or drift away from the face it comes from
+        bool connected = false;
+        bool flips = false;
+        for (const u32 t : vertex_triangles[c.from]) {
+            if (removed_triangles[t])
+                continue;
+
+            const u32 *v = &triangles[3 * t];
+            if (v[0] == c.to || v[1] == c.to || v[2] == c.to) {
+                connected = true;
+                continue;
+            }
+
+            glm::vec3 p[3];
+            for (u32 i = 0; i < 3; i++)
+                p[i] = positions[v[i] == c.from ? c.to : v[i]];
+            const glm::vec3 cross = glm::cross(p[1] - p[0], p[2] - p[0]);
+            const float length = glm::length(cross);
+            if (length <= 0.0f || glm::dot(cross, normals[t]) < min_normal_cosine * length * glm::length(normals[t])
+                || glm::dot(cross, original_normals[t]) < min_normal_cosine * length * glm::length(original_normals[t])) {
+                flips = true;
+                break;
+            }
+        }
+        if (!connected || flips)
+            continue;
+
+        quadrics[c.to] += quadrics[c.from];
+        borders[c.to] += borders[c.from];
+        removed_vertices[c.from] = 1;
+        versions[c.to]++;
+
+        std::vector<u32> &to_triangles = vertex_triangles[c.to];
+        for (const u32 t : vertex_triangles[c.from]) {
+            if (removed_triangles[t])
+                continue;
+
+            u32 *v = &triangles[3 * t];
+            if (v[0] == c.to || v[1] == c.to || v[2] == c.to) {
+                removed_triangles[t] = 1;
+                remaining--;
+                continue;
+            }
+
+            for (u32 i = 0; i < 3; i++) {
+                if (v[i] == c.from)
+                    v[i] = c.to;
+            }
+            const glm::vec3 cross = glm::cross(positions[v[1]] - positions[v[0]], positions[v[2]] - positions[v[0]]);
+            normals[t] = glm::normalize(cross);
+            to_triangles.push_back(t);
+        }
+        vertex_triangles[c.from].clear();
+        to_triangles.erase(std::remove_if(to_triangles.begin(), to_triangles.end(), [&](u32 t) { return removed_triangles[t]; }), to_triangles.end());
+
+        neighbours.clear();
+        for (const u32 t : to_triangles) {
+            for (u32 i = 0; i < 3; i++) {
+                if (triangles[3 * t + i] != c.to)
+                    neighbours.push_back(triangles[3 * t + i]);
+            }
+        }
+        std::sort(neighbours.begin(), neighbours.end());
+        neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+        for (const u32 w : neighbours) {
+            push(c.to, w);
+            push(w, c.to);
+        }
+    }
+
+    std::vector<u32> simplified;
+    simplified.reserve(3 * remaining);
+    for (u32 t = 0; t < triangle_count; t++) {
+        if (!removed_triangles[t])
+            simplified.insert(simplified.end(), triangles.begin() + 3 * t, triangles.begin() + 3 * t + 3);
+    }
+    return simplified;
+}
+
+void build_lods(MeshData &data) {
+    data.lods.clear();
+    if (data.indices.size() < 3 * min_lod_triangles)
+        return;
+
+    std::vector<glm::vec3> positions;
+    positions.reserve(data.vertices.size());
+    glm::vec3 min = data.vertices[0].position;
+    glm::vec3 max = min;
+    for (const Vertex &v : data.vertices) {
+        positions.push_back(v.position);
+        min = glm::min(min, v.position);
+        max = glm::max(max, v.position);
+    }
+
+    data.lods.reserve(max_lod_levels - 1);
+    float max_error = first_lod_error * glm::length(max - min);
+    const std::vector<u32> *previous = &data.indices;
+    while (data.lods.size() + 1 < max_lod_levels && previous->size() >= 3 * min_lod_triangles) {
+        const size_t previous_triangles = previous->size() / 3;
+        std::vector<u32> lod = simplify_mesh(positions, *previous, previous_triangles / 2, max_error);
+        if (lod.size() / 3 > max_lod_triangle_ratio * previous_triangles)
+            break;
+
+        data.lods.push_back(std::move(lod));
+        previous = &data.lods.back();
+        max_error *= 2.0f;
+    }
+}
+
+}
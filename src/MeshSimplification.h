@@ -0,0 +1,19 @@
+#ifndef MESHSIMPLIFICATION_H
+#define MESHSIMPLIFICATION_H
+
+#include <StaticMesh.h>
+
+namespace OM3D {
+
+// Quadric error simplification by half-edge collapses: vertices are only removed, the result indexes the same vertices
+// and keeps their attributes. Collapses stop at target_triangles, or once the error would exceed max_error (in mesh units).
+// Edges used by a single triangle, including the ones along attribute seams, are kept in place.
+std::vector<u32> simplify_mesh(const std::vector<glm::vec3> &positions, const std::vector<u32> &indices, size_t target_triangles, float max_error);
+
+// Fills data.lods, every level has about half the triangles of the previous one and twice its error.
+// The chain ends when simplification stops paying off.
+void build_lods(MeshData &data);
+
+}
+
+#endif // MESHSIMPLIFICATION_H
@@ -0,0 +1,253 @@
+#include "Meshlets.h"
+
+#include <glad/glad.h>
+#include <glm/geometric.hpp>
+#include <glm/gtx/norm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace OM3D {
+
+static constexpr u32 max_meshlet_vertices = 64;
+static constexpr u32 max_meshlet_triangles = 124;
+// Smaller meshes are drawn whole, culling a few meshlets would not pay for the dispatch
+static constexpr size_t min_meshlet_mesh_triangles = 4096;
+// Below this cosine between the axis and the most divergent normal, the cone is too narrow to ever cull the meshlet
+static constexpr float min_cone_cosine = 0.1f;
+// Must match meshlet_cull.comp
+static constexpr u32 workgroup_size = 64;
+static constexpr u32 invalid_index = u32(-1);
+
+static shader::Meshlet compute_bounds(const std::vector<Vertex> &vertices, const std::vector<u32> &indices, u32 first_index, u32 index_count) {
+    shader::Meshlet meshlet = {};
+    meshlet.first_index = first_index;
+    meshlet.index_count = index_count;
+
+    glm::vec3 min = vertices[indices[first_index]].position;
+    glm::vec3 max = min;
+    for (u32 i = first_index; i < first_index + index_count; i++) {
+        min = glm::min(min, vertices[indices[i]].position);
+        max = glm::max(max, vertices[indices[i]].position);
+    }
+    meshlet.center = (min + max) * 0.5f;
+    for (u32 i = first_index; i < first_index + index_count; i++) {
+        meshlet.radius = std::max(meshlet.radius, glm::distance(meshlet.center, vertices[indices[i]].position));
+    }
+
+    // The axis is the mean normal, the apex is behind the plane of every triangle
+    std::vector<glm::vec3> normals;
+    normals.reserve(index_count / 3);
+    glm::vec3 axis(0.0f);
+    for (u32 i = first_index; i < first_index + index_count; i += 3) {
+        const glm::vec3 &a = vertices[indices[i]].position;
+        const glm::vec3 cross = glm::cross(vertices[indices[i + 1]].position - a, vertices[indices[i + 2]].position - a);
+        const float length = glm::length(cross);
+        normals.push_back(length > 0.0f ? cross / length : glm::vec3(0.0f));
+        axis += normals.back();
+    }
+
+    meshlet.cone_cutoff = 2.0f;
+    if (glm::length2(axis) <= 0.0f)
+        return meshlet;
+    axis = glm::normalize(axis);
+
+    float min_cosine = 1.0f;
+    for (const glm::vec3 &n : normals) {
+        if (n != glm::vec3(0.0f))
+            min_cosine = std::min(min_cosine, glm::dot(n, axis));
+    }
+    if (min_cosine <= min_cone_cosine)
+        return meshlet;
+
+    float apex_distance = 0.0f;
+    for (u32 i = first_index, t = 0; i < first_index + index_count; i += 3, t++) {
+        if (normals[t] != glm::vec3(0.0f))
+            apex_distance = std::max(apex_distance, glm::dot(meshlet.center - vertices[indices[i]].position, normals[t]) / glm::dot(axis, normals[t]));
+    }
+
+    meshlet.cone_apex = meshlet.center - axis * apex_distance;
+    meshlet.cone_axis = axis;
+    meshlet.cone_cutoff = std::sqrt(1.0f - min_cosine * min_cosine);
+    return meshlet;
+}
+
+void build_meshlets(MeshData &data) {
+    data.meshlets.clear();
+    const u32 triangle_count = u32(data.indices.size() / 3);
+    if (triangle_count < min_meshlet_mesh_triangles)
+        return;
+
+    // Triangles around every vertex, as ranges of one array
+    const u32 vertex_count = u32(data.vertices.size());
+    std::vector<u32> offsets(vertex_count + 1, 0);
+    for (const u32 index : data.indices) {
+        offsets[index + 1]++;
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    std::vector<u32> vertex_triangles(3 * size_t(triangle_count));
+    {
+        std::vector<u32> next(offsets.begin(), offsets.end() - 1);
+        for (u32 i = 0; i < 3 * triangle_count; i++) {
+            vertex_triangles[next[data.indices[i]]++] = i / 3;
+        }
+    }
+
+    std::vector<u8> assigned(triangle_count, 0);
+    // Last meshlet each vertex was added to
+    std::vector<u32> vertex_meshlets(vertex_count, invalid_index);
+    // Unassigned triangles sharing a vertex with the current meshlet, assigned ones are dropped lazily
+    std::vector<u32> candidates;
+    std::vector<u32> reordered;
+    reordered.reserve(data.indices.size());
+    u32 next_seed = 0;
+
+    while (reordered.size() < data.indices.size()) {
+        const u32 meshlet = u32(data.meshlets.size());
+        const u32 first_index = u32(reordered.size());
+        u32 meshlet_vertices = 0;
+        u32 meshlet_triangles = 0;
+
+        const auto new_vertices = [&](u32 t) {
+            u32 count = 0;
+            for (u32 i = 0; i < 3; i++) {
+                count += vertex_meshlets[data.indices[3 * t + i]] != meshlet;
+            }
+            return count;
+        };
+        const auto add = [&](u32 t) {
+            assigned[t] = 1;
+            meshlet_triangles++;
+            for (u32 i = 0; i < 3; i++) {
+                const u32 v = data.indices[3 * t + i];
+                reordered.push_back(v);
+                if (vertex_meshlets[v] == meshlet)
+                    continue;
+
+                vertex_meshlets[v] = meshlet;
+                meshlet_vertices++;
+                for (u32 j = offsets[v]; j < offsets[v + 1]; j++) {
+                    if (!assigned[vertex_triangles[j]])
+                        candidates.push_back(vertex_triangles[j]);
+                }
+            }
+        };
+
+        // Next to the previous meshlet if it left any neighbour, so that consecutive meshlets stay close
+        u32 seed = invalid_index;
+        for (const u32 t : candidates) {
+            if (!assigned[t]) {
+                seed = t;
+                break;
+            }
+        }
+        if (seed == invalid_index) {
+            while (assigned[next_seed])
+                next_seed++;
+            seed = next_seed;
+        }
+        candidates.clear();
+        add(seed);
+
+        // The neighbour adding the fewest vertices, which keeps meshlets compact
+        while (meshlet_triangles < max_meshlet_triangles) {
+            u32 best = invalid_index;
+            u32 best_new_vertices = 4;
+            for (size_t i = 0; i < candidates.size();) {
+                const u32 t = candidates[i];
+                if (assigned[t]) {
+                    candidates[i] = candidates.back();
+                    candidates.pop_back();
+                    continue;
+                }
+
+                const u32 count = new_vertices(t);
+                if (count < best_new_vertices && meshlet_vertices + count <= max_meshlet_vertices) {
+                    best = t;
+                    best_new_vertices = count;
+                    if (!count)
+                        break;
+                }
+                i++;
+            }
+            if (best == invalid_index)
+                break;
+            add(best);
+        }
+
+        data.meshlets.push_back(compute_bounds(data.vertices, reordered, first_index, u32(reordered.size()) - first_index));
+    }
+
+    data.indices = std::move(reordered);
+}
+
+// Rotations and uniform scales keep the angle of the cones, and the side the faces face
+static bool preserves_angles(const glm::mat3 &m) {
+    const float x = glm::length2(m[0]);
+    const float y = glm::length2(m[1]);
+    const float z = glm::length2(m[2]);
+    const float tolerance = 1e-4f * (x + y + z);
+    const float shear = std::abs(glm::dot(m[0], m[1])) + std::abs(glm::dot(m[1], m[2])) + std::abs(glm::dot(m[2], m[0]));
+    return std::abs(x - y) <= tolerance && std::abs(y - z) <= tolerance && shear <= tolerance && glm::determinant(m) > 0.0f;
+}
+
+void MeshletCulling::begin_frame(const Frustum &frustum, const glm::vec3 &eye) {
+    if (!_program) {
+        _program = Program::from_file("meshlet_cull.comp");
+        _planes = TypedBuffer<glm::vec4>(nullptr, Frustum::plane_count);
+        _counters = TypedBuffer<u32>(nullptr, 2);
+    }
+
+    {
+        auto mapping = _planes.map(AccessType::WriteOnly);
+        for (size_t p = 0; p != Frustum::plane_count; ++p) {
+            mapping[p] = frustum.plane(p);
+        }
+    }
+    {
+        auto mapping = _counters.map(AccessType::WriteOnly);
+        mapping[0] = 0;
+        mapping[1] = 0;
+    }
+    _eye = eye;
+}
+
+void MeshletCulling::cull(const SceneObject &object) {
+    const StaticMesh &mesh = *object.get_mesh();
+    if (!_program || !mesh.meshlet_count())
+        return;
+
+    const float mesh_radius = mesh.get_bounding_sphere().radius;
+    const float radius_scale = mesh_radius > 0.0f ? object.get_bounding_sphere().radius / mesh_radius : 1.0f;
+    const bool cone_culling = object.get_material() && object.get_material()->culls_back_faces() && preserves_angles(glm::mat3(object.transform()));
+
+    _program->bind();
+    _program->set_uniform(HASH("model"), object.transform());
+    _program->set_uniform(HASH("radius_scale"), radius_scale);
+    _program->set_uniform(HASH("cone_culling"), u32(cone_culling));
+    _program->set_uniform(HASH("eye"), _eye);
+    _program->set_uniform(HASH("meshlet_count"), mesh.meshlet_count());
+    const shader::DrawElementsIndirectCommand full_detail = mesh.draw_command(0, 0);
+    _program->set_uniform(HASH("first_index"), full_detail.first_index);
+    _program->set_uniform(HASH("base_vertex"), u32(full_detail.base_vertex));
+    _planes.bind(BufferUsage::Uniform, 1);
+    mesh.meshlet_buffer().bind(BufferUsage::Storage, 3);
+    mesh.meshlet_commands().bind(BufferUsage::Storage, 4);
+    _counters.bind(BufferUsage::Storage, 5);
+
+    glDispatchCompute(align_up_to(mesh.meshlet_count(), workgroup_size) / workgroup_size, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+}
+
+MeshletStats MeshletCulling::read_stats() {
+    if (!_program)
+        return {};
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    auto mapping = _counters.map(AccessType::ReadOnly);
+    return { mapping[0], mapping[1] };
+}
+
+}
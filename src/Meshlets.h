@@ -0,0 +1,42 @@
+#ifndef MESHLETS_H
+#define MESHLETS_H
+
+#include <SceneObject.h>
+#include <Camera.h>
+#include <Program.h>
+#include <TypedBuffer.h>
+
+#include <memory>
+
+namespace OM3D {
+
+// Splits the full detail level of large meshes into meshlets of at most 64 vertices and 124 triangles, grown across shared
+// vertices. data.indices is reordered so that every meshlet is a range of it, the levels of detail are left as they are.
+void build_meshlets(MeshData &data);
+
+struct MeshletStats {
+    u32 visible_meshlets = 0;
+    u32 visible_triangles = 0;
+};
+
+// Culls the meshlets of a mesh in a compute shader before each draw of it, against the frustum and against the cone of their
+// normals. The draw is then a single multi-draw indirect with one command per meshlet, nothing comes back to the CPU.
+class MeshletCulling : NonCopyable {
+    public:
+        void begin_frame(const Frustum &frustum, const glm::vec3 &eye);
+        // Writes the commands drawn by the next object.render_meshlets()
+        void cull(const SceneObject &object);
+
+        // Stalls until every cull() since begin_frame() is done
+        MeshletStats read_stats();
+
+    private:
+        std::shared_ptr<Program> _program;
+        TypedBuffer<glm::vec4> _planes;
+        TypedBuffer<u32> _counters;
+        glm::vec3 _eye = {};
+};
+
+}
+
+#endif // MESHLETS_H
@@ -0,0 +1,296 @@
+#include "OcclusionCulling.h"
+
+#include <glm/common.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define OM3D_X86
+#include <immintrin.h>
+#endif
+
+namespace OM3D {
+
+OcclusionBuffer::OcclusionBuffer(u32 width, u32 height) {
+    resize(width, height);
+}
+
+void OcclusionBuffer::resize(u32 width, u32 height) {
+    _levels.clear();
+    for (;;) {
+        _levels.push_back(Level{ width, height, std::vector<float>(size_t(width) * height, 0.0f) });
+        if (width == 1 && height == 1)
+            break;
+
+        width = std::max(1u, (width + 1) / 2);
+        height = std::max(1u, (height + 1) / 2);
+    }
+}
+
+void OcclusionBuffer::clear(const glm::mat4 &view_proj) {
+    _view_proj = view_proj;
+    _rasterized_triangles = 0;
+    std::fill(_levels[0].depths.begin(), _levels[0].depths.end(), 0.0f);
+}
+
+void OcclusionBuffer::rasterize(const glm::mat4 &transform, const std::vector<Vertex> &vertices, const std::vector<u32> &indices) {
+    const glm::mat4 to_clip = _view_proj * transform;
+
+    _clip_vertices.resize(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+        _clip_vertices[i] = to_clip * glm::vec4(vertices[i].position, 1.0f);
+    }
+
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        const glm::vec4 &a = _clip_vertices[indices[i]];
+        const glm::vec4 &b = _clip_vertices[indices[i + 1]];
+        const glm::vec4 &c = _clip_vertices[indices[i + 2]];
+
+        // Entirely outside of a side plane
+        if ((a.x > a.w && b.x > b.w && c.x > c.w) || (a.x < -a.w && b.x < -b.w && c.x < -c.w)
+         || (a.y > a.w && b.y > b.w && c.y > c.w) || (a.y < -a.w && b.y < -b.w && c.y < -c.w))
+            continue;
+
+        clip_triangle(a, b, c);
+    }
+}
+
+void OcclusionBuffer::clip_triangle(const glm::vec4 &a, const glm::vec4 &b, const glm::vec4 &c) {
+    // Signed distances to the near plane, positive in front of it
+    const glm::vec4 vertices[3] = { a, b, c };
+    float dist[3];
+    u32 inside = 0;
+    for (u32 i = 0; i < 3; i++) {
+        dist[i] = vertices[i].w - vertices[i].z;
+        inside += dist[i] > 0.0f;
+    }
+
+    if (inside == 3) {
+        rasterize_triangle(a, b, c);
+        return;
+    }
+    if (inside == 0)
+        return;
+
+    // Sutherland-Hodgman against a single plane gives at most 4 vertices
+    glm::vec4 polygon[4];
+    u32 count = 0;
+    for (u32 i = 0; i < 3; i++) {
+        const u32 next = (i + 1) % 3;
+        if (dist[i] > 0.0f)
+            polygon[count++] = vertices[i];
+        if ((dist[i] > 0.0f) != (dist[next] > 0.0f))
+            polygon[count++] = glm::mix(vertices[i], vertices[next], dist[i] / (dist[i] - dist[next]));
+    }
+
+    for (u32 i = 2; i < count; i++) {
+        rasterize_triangle(polygon[0], polygon[i - 1], polygon[i]);
+    }
+}
+
+void OcclusionBuffer::rasterize_triangle(const glm::vec4 &a, const glm::vec4 &b, const glm::vec4 &c) {
+    Level &buffer = _levels[0];
+    const float width = float(buffer.width);
+    const float height = float(buffer.height);
+
+    // Screen position and depth, 1/w is affine in screen space
+    auto to_screen = [&](const glm::vec4 &v) {
+        const float inv_w = 1.0f / v.w;
+        return glm::vec3((v.x * inv_w * 0.5f + 0.5f) * width, (v.y * inv_w * 0.5f + 0.5f) * height, inv_w);
+    };
+
+    const glm::vec3 p0 = to_screen(a);
+    glm::vec3 p1 = to_screen(b);
+    glm::vec3 p2 = to_screen(c);
+
+    float area = (p1.x - p0.x) * (p2.y - p0.y) - (p1.y - p0.y) * (p2.x - p0.x);
+    if (area == 0.0f)
+        return;
+    if (area < 0.0f) {
+        std::swap(p1, p2);
+        area = -area;
+    }
+
+    // Pixel centers covered by the bounding rectangle, clamped before the conversion to avoid overflows
+    const int min_x = int(std::ceil(std::clamp(std::min({ p0.x, p1.x, p2.x }) - 0.5f, 0.0f, width)));
+    const int max_x = int(std::floor(std::clamp(std::max({ p0.x, p1.x, p2.x }) - 0.5f, -1.0f, width - 1.0f)));
+    const int min_y = int(std::ceil(std::clamp(std::min({ p0.y, p1.y, p2.y }) - 0.5f, 0.0f, height)));
+    const int max_y = int(std::floor(std::clamp(std::max({ p0.y, p1.y, p2.y }) - 0.5f, -1.0f, height - 1.0f)));
+    if (min_x > max_x || min_y > max_y)
+        return;
+
+    _rasterized_triangles++;
+
+    // Edge functions, positive inside of the counter-clockwise triangle.
+    // Edge i is opposite to vertex i, so edge / area is the barycentric coordinate of that vertex.
+    struct Edge {
+        float dx;
+        float dy;
+        float at_origin;
+    };
+    auto make_edge = [](const glm::vec3 &from, const glm::vec3 &to) {
+        return Edge{ -(to.y - from.y), to.x - from.x, (to.y - from.y) * from.x - (to.x - from.x) * from.y };
+    };
+    const Edge e0 = make_edge(p1, p2);
+    const Edge e1 = make_edge(p2, p0);
+    const Edge e2 = make_edge(p0, p1);
+
+    const float inv_area = 1.0f / area;
+    const float z_dx = (e0.dx * p0.z + e1.dx * p1.z + e2.dx * p2.z) * inv_area;
+    const float z_dy = (e0.dy * p0.z + e1.dy * p1.z + e2.dy * p2.z) * inv_area;
+    const float z_origin = (e0.at_origin * p0.z + e1.at_origin * p1.z + e2.at_origin * p2.z) * inv_area;
+
+    for (int y = min_y; y <= max_y; y++) {
+        const float py = float(y) + 0.5f;
+        const float px = float(min_x) + 0.5f;
+
+        float w0 = e0.at_origin + e0.dx * px + e0.dy * py;
+        float w1 = e1.at_origin + e1.dx * px + e1.dy * py;
+        float w2 = e2.at_origin + e2.dx * px + e2.dy * py;
+        float z = z_origin + z_dx * px + z_dy * py;
+
+        float *row = buffer.depths.data() + size_t(y) * buffer.width;
+        int x = min_x;
+
+#ifdef OM3D_X86
+        // 4 pixels per iteration, pixels outside of the triangle keep their depth since depths are never negative
+        const __m128 steps = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+        __m128 w0_4 = _mm_add_ps(_mm_set1_ps(w0), _mm_mul_ps(steps, _mm_set1_ps(e0.dx)));
+        __m128 w1_4 = _mm_add_ps(_mm_set1_ps(w1), _mm_mul_ps(steps, _mm_set1_ps(e1.dx)));
+        __m128 w2_4 = _mm_add_ps(_mm_set1_ps(w2), _mm_mul_ps(steps, _mm_set1_ps(e2.dx)));
+        __m128 z_4 = _mm_add_ps(_mm_set1_ps(z), _mm_mul_ps(steps, _mm_set1_ps(z_dx)));
+
+        for (; x + 4 <= max_x + 1; x += 4) {
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 covered = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(w0_4, zero), _mm_cmpge_ps(w1_4, zero)), _mm_cmpge_ps(w2_4, zero));
+            _mm_storeu_ps(row + x, _mm_max_ps(_mm_loadu_ps(row + x), _mm_and_ps(covered, z_4)));
+
+            w0_4 = _mm_add_ps(w0_4, _mm_set1_ps(4.0f * e0.dx));
+            w1_4 = _mm_add_ps(w1_4, _mm_set1_ps(4.0f * e1.dx));
+            w2_4 = _mm_add_ps(w2_4, _mm_set1_ps(4.0f * e2.dx));
+            z_4 = _mm_add_ps(z_4, _mm_set1_ps(4.0f * z_dx));
+        }
+
+        const float skipped = float(x - min_x);
+        w0 += e0.dx * skipped;
+        w1 += e1.dx * skipped;
+        w2 += e2.dx * skipped;
+        z += z_dx * skipped;
+#endif
+
+        // Remaining pixels
+        for (; x <= max_x; x++) {
+            if (w0 >= 0.0f && w1 >= 0.0f && w2 >= 0.0f)
+                row[x] = std::max(row[x], z);
+
+            w0 += e0.dx;
+            w1 += e1.dx;
+            w2 += e2.dx;
+            z += z_dx;
+        }
+    }
+}
+
+void OcclusionBuffer::build_pyramid() {
+    for (size_t l = 1; l < _levels.size(); l++) {
+        const Level &src = _levels[l - 1];
+        Level &dst = _levels[l];
+
+        for (u32 y = 0; y < dst.height; y++) {
+            const float *row0 = src.depths.data() + size_t(std::min(2 * y, src.height - 1)) * src.width;
+            const float *row1 = src.depths.data() + size_t(std::min(2 * y + 1, src.height - 1)) * src.width;
+            for (u32 x = 0; x < dst.width; x++) {
+                const u32 x0 = std::min(2 * x, src.width - 1);
+                const u32 x1 = std::min(2 * x + 1, src.width - 1);
+                dst.depths[size_t(y) * dst.width + x] = std::min(std::min(row0[x0], row0[x1]), std::min(row1[x0], row1[x1]));
+            }
+        }
+    }
+}
+
+void OcclusionBuffer::load(const glm::mat4 &view_proj, u32 width, u32 height, const float *depths, float scale) {
+    if (width != _levels[0].width || height != _levels[0].height)
+        resize(width, height);
+
+    _view_proj = view_proj;
+    _rasterized_triangles = 0;
+    std::transform(depths, depths + size_t(width) * height, _levels[0].depths.begin(), [=](float depth) { return depth * scale; });
+    build_pyramid();
+}
+
+bool OcclusionBuffer::is_occluded(const glm::vec3 &min, const glm::vec3 &max) const {
+    const Level &buffer = _levels[0];
+    const float width = float(buffer.width);
+    const float height = float(buffer.height);
+
+    glm::vec2 screen_min(std::numeric_limits<float>::max());
+    glm::vec2 screen_max(std::numeric_limits<float>::lowest());
+    float nearest = 0.0f;
+
+    // Corners are the transformed min corner plus transformed edges
+    const glm::vec4 origin = _view_proj * glm::vec4(min, 1.0f);
+    const glm::vec4 edge_x = _view_proj[0] * (max.x - min.x);
+    const glm::vec4 edge_y = _view_proj[1] * (max.y - min.y);
+    const glm::vec4 edge_z = _view_proj[2] * (max.z - min.z);
+
+    for (u32 i = 0; i < 8; i++) {
+        glm::vec4 v = origin;
+        if (i & 1)
+            v += edge_x;
+        if (i & 2)
+            v += edge_y;
+        if (i & 4)
+            v += edge_z;
+
+        // Boxes crossing the near plane cover too much of the screen to be worth testing
+        if (v.w - v.z <= 0.0f)
+            return false;
+
+        const float inv_w = 1.0f / v.w;
+        const glm::vec2 screen((v.x * inv_w * 0.5f + 0.5f) * width, (v.y * inv_w * 0.5f + 0.5f) * height);
+        screen_min = glm::min(screen_min, screen);
+        screen_max = glm::max(screen_max, screen);
+        nearest = std::max(nearest, inv_w);
+    }
+
+    if (screen_max.x < 0.0f || screen_max.y < 0.0f || screen_min.x >= width || screen_min.y >= height)
+        return false;
+
+    // Pixels overlapped by the rectangle
+    const u32 x0 = u32(std::max(screen_min.x, 0.0f));
+    const u32 y0 = u32(std::max(screen_min.y, 0.0f));
+    const u32 x1 = u32(std::min(screen_max.x, width - 1.0f));
+    const u32 y1 = u32(std::min(screen_max.y, height - 1.0f));
+
+    // Coarsest level where the rectangle covers at most 2x2 texels
+    size_t level = 0;
+    while (level + 1 < _levels.size() && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1)) {
+        level++;
+    }
+
+    const Level &pyramid = _levels[level];
+    float farthest = std::numeric_limits<float>::max();
+    for (u32 y = y0 >> level; y <= y1 >> level; y++) {
+        for (u32 x = x0 >> level; x <= x1 >> level; x++) {
+            farthest = std::min(farthest, pyramid.depths[size_t(y) * pyramid.width + x]);
+        }
+    }
+
+    return nearest < farthest;
+}
+
+u32 OcclusionBuffer::width() const {
+    return _levels[0].width;
+}
+
+u32 OcclusionBuffer::height() const {
+    return _levels[0].height;
+}
+
+size_t OcclusionBuffer::rasterized_triangles() const {
+    return _rasterized_triangles;
+}
+
+}
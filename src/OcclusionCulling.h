@@ -0,0 +1,67 @@
+#ifndef OCCLUSIONCULLING_H
+#define OCCLUSIONCULLING_H
+
+#include <glm/mat4x4.hpp>
+
+#include <utils.h>
+#include <Vertex.h>
+
+#include <vector>
+
+namespace OM3D {
+
+// Low resolution depth buffer rasterized on the CPU from a few occluders, with a hierarchical-Z pyramid to test boxes.
+// Depths are stored as 1/w: larger is nearer and 0 is an empty pixel. The projection must be perspective with a reversed
+// depth, as built by Camera, so that the near plane is z = w in clip space.
+class OcclusionBuffer {
+    public:
+        static constexpr u32 default_width = 256;
+        static constexpr u32 default_height = 128;
+
+        OcclusionBuffer(u32 width = default_width, u32 height = default_height);
+
+        void clear(const glm::mat4 &view_proj);
+
+        // Indexed triangles in object space, both windings are rasterized
+        void rasterize(const glm::mat4 &transform, const std::vector<Vertex> &vertices, const std::vector<u32> &indices);
+
+        // Must be called after the last occluder, before testing boxes
+        void build_pyramid();
+
+        // Replaces the buffer with depths read back from the GPU, which are converted to 1/w by scale. The pyramid is built.
+        void load(const glm::mat4 &view_proj, u32 width, u32 height, const float *depths, float scale);
+
+        // True if the box is entirely behind the rasterized occluders
+        bool is_occluded(const glm::vec3 &min, const glm::vec3 &max) const;
+
+        u32 width() const;
+        u32 height() const;
+        size_t rasterized_triangles() const;
+
+    private:
+        void resize(u32 width, u32 height);
+
+        struct Level {
+            u32 width;
+            u32 height;
+            std::vector<float> depths;
+        };
+
+        // Clips the triangle against the near plane
+        void clip_triangle(const glm::vec4 &a, const glm::vec4 &b, const glm::vec4 &c);
+        void rasterize_triangle(const glm::vec4 &a, const glm::vec4 &b, const glm::vec4 &c);
+
+        glm::mat4 _view_proj = glm::mat4(1.0f);
+
+        // Level 0 is the rasterized buffer, every other level keeps the farthest depth of 2x2 texels of the previous one
+        std::vector<Level> _levels;
+
+        // Clip space vertices of the current occluder, kept to avoid reallocations
+        std::vector<glm::vec4> _clip_vertices;
+
+        size_t _rasterized_triangles = 0;
+};
+
+}
+
+#endif // OCCLUSIONCULLING_H
@@ -0,0 +1,208 @@
+#include "OcclusionQueries.h"
+
+#include <BoundingTree.h>
+#include <GLState.h>
+
+#include <glad/glad.h>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+
+namespace OM3D {
+
+// Visible leaves are queried again every interval frames, at an offset that depends on the node to spread the queries
+static constexpr u32 visible_query_interval = 8;
+// Hidden results in a row after which a node is likely to stay hidden and joins multi-queries
+static constexpr u16 batch_hidden_results = 3;
+static constexpr size_t max_batch_nodes = 16;
+// Boxes around the eye would be clipped by the near plane, they are never queried
+static constexpr float near_margin = 0.01f;
+
+OcclusionQueries::~OcclusionQueries() {
+    for (const Query &query : _pending) {
+        _free_handles.push_back(query.handle);
+    }
+    if (!_free_handles.empty()) {
+        glDeleteQueries(GLsizei(_free_handles.size()), _free_handles.data());
+    }
+}
+
+void OcclusionQueries::reset(const BoundingTree &tree) {
+    _tree = &tree;
+    _states.assign(tree.slot_count(), NodeState{});
+    _single_queue.clear();
+    _batch_queue.clear();
+    _hidden.clear();
+
+    // Pending queries refer to the old nodes, their results are dropped
+    _generation++;
+}
+
+void OcclusionQueries::update() {
+    size_t kept = 0;
+    for (size_t i = 0; i < _pending.size(); i++) {
+        GLuint available = 0;
+        glGetQueryObjectuiv(_pending[i].handle, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            std::swap(_pending[kept++], _pending[i]);
+            continue;
+        }
+
+        GLuint passed = 0;
+        glGetQueryObjectuiv(_pending[i].handle, GL_QUERY_RESULT, &passed);
+        _free_handles.push_back(_pending[i].handle);
+        if (_pending[i].generation != _generation)
+            continue;
+
+        // A passing multi-query does not tell which node is visible, all of them are drawn again
+        for (const u32 node : _pending[i].nodes) {
+            _states[node].pending = false;
+            if (passed)
+                set_visible(node);
+            else
+                set_hidden(node);
+        }
+    }
+    _pending.resize(kept);
+}
+
+void OcclusionQueries::begin_frame(const glm::vec3 &eye) {
+    _frame++;
+    _eye = eye;
+    _hidden.clear();
+    _issued_queries = 0;
+    _queried_boxes = 0;
+}
+
+bool OcclusionQueries::is_hidden(u32 node, const glm::vec3 &min, const glm::vec3 &max, bool leaf) {
+    // Nodes below a termination node are not visited but what is known about them still holds
+    const u32 parent = _tree->parent(node);
+    if (std::max(node, parent == BoundingTree::invalid_index ? 0 : parent) >= _states.size())
+        _states.resize(std::max(node, parent == BoundingTree::invalid_index ? 0 : parent) + 1);
+    const bool parent_hidden = parent != BoundingTree::invalid_index && _states[parent].last_hidden + 1 == _frame;
+
+    NodeState &state = _states[node];
+    const bool visited_last_frame = state.last_visited + 1 == _frame || parent_hidden;
+    state.last_visited = _frame;
+
+    if (glm::all(glm::greaterThanEqual(_eye, min - near_margin)) && glm::all(glm::lessThanEqual(_eye, max + near_margin))) {
+        state.visible = true;
+        return false;
+    }
+
+    // Termination node of a hidden region: its subtree is skipped and only its box is queried
+    if (!state.visible && visited_last_frame) {
+        state.last_hidden = _frame;
+        _hidden.push_back(node);
+        if (!state.pending)
+            queue(node, min, max, state.hidden_results >= batch_hidden_results ? _batch_queue : _single_queue);
+        return true;
+    }
+
+    // What was known about nodes that left the frustum is out of date, they are assumed visible
+    if (!visited_last_frame)
+        state.visible = true;
+
+    // Visible leaves are queried to find when they get hidden, the ones that were not visited last frame right away
+    const bool query_due = (_frame + node * 2654435761u) % visible_query_interval == 0;
+    if (leaf && !state.pending && (!visited_last_frame || query_due))
+        queue(node, min, max, _single_queue);
+
+    return false;
+}
+
+void OcclusionQueries::issue(SceneObject &cube) {
+    if (_single_queue.empty() && _batch_queue.empty())
+        return;
+
+    // Only the depth test matters
+    GLState::current().set_color_mask(false);
+
+    for (auto it = _single_queue.cbegin(); it != _single_queue.cend(); ++it) {
+        issue(it, it + 1, cube);
+    }
+    for (size_t i = 0; i < _batch_queue.size(); i += max_batch_nodes) {
+        issue(_batch_queue.cbegin() + i, _batch_queue.cbegin() + std::min(i + max_batch_nodes, _batch_queue.size()), cube);
+    }
+
+    GLState::current().set_color_mask(true);
+
+    _single_queue.clear();
+    _batch_queue.clear();
+}
+
+void OcclusionQueries::issue(std::vector<QueuedNode>::const_iterator begin, std::vector<QueuedNode>::const_iterator end, SceneObject &cube) {
+    Query query = { 0, _generation, {} };
+    if (_free_handles.empty()) {
+        glCreateQueries(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, 1, &query.handle);
+    } else {
+        query.handle = _free_handles.back();
+        _free_handles.pop_back();
+    }
+
+    glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, query.handle);
+    for (auto it = begin; it != end; ++it) {
+        const glm::vec3 center = (it->min + it->max) * 0.5f;
+        cube.render(glm::scale(glm::translate(glm::mat4(1.0f), center), it->max - it->min));
+        query.nodes.push_back(it->node);
+    }
+    glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
+
+    _queried_boxes += query.nodes.size();
+    _issued_queries++;
+    _pending.push_back(std::move(query));
+}
+
+void OcclusionQueries::queue(u32 node, const glm::vec3 &min, const glm::vec3 &max, std::vector<QueuedNode> &queue) {
+    _states[node].pending = true;
+    queue.push_back({ node, min, max });
+}
+
+void OcclusionQueries::set_visible(u32 node) {
+    _states[node].visible = true;
+    _states[node].hidden_results = 0;
+
+    // Ancestors are visible as well
+    for (u32 p = _tree->parent(node); p != BoundingTree::invalid_index && !_states[p].visible; p = _tree->parent(p)) {
+        _states[p].visible = true;
+        _states[p].hidden_results = 0;
+    }
+}
+
+void OcclusionQueries::set_hidden(u32 node) {
+    NodeState &state = _states[node];
+    state.visible = false;
+    state.hidden_results = u16(std::min(state.hidden_results + 1, 0xFFFF));
+
+    // Parents whose children are all hidden become the termination node, and are queried instead of them
+    for (u32 p = _tree->parent(node); p != BoundingTree::invalid_index; p = _tree->parent(p)) {
+        u16 hidden_results = 0xFFFF;
+        const u32 first = _tree->first_child(p);
+        for (u32 c = first; c < first + _tree->child_count(p); c++) {
+            if (c >= _states.size() || _states[c].visible)
+                return;
+            hidden_results = std::min(hidden_results, _states[c].hidden_results);
+        }
+
+        _states[p].visible = false;
+        _states[p].hidden_results = hidden_results;
+    }
+}
+
+const std::vector<u32> &OcclusionQueries::hidden_nodes() const {
+    return _hidden;
+}
+
+size_t OcclusionQueries::issued_queries() const {
+    return _issued_queries;
+}
+
+size_t OcclusionQueries::queried_boxes() const {
+    return _queried_boxes;
+}
+
+size_t OcclusionQueries::pending_queries() const {
+    return _pending.size();
+}
+
+}
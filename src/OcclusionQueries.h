@@ -0,0 +1,93 @@
+#ifndef OCCLUSIONQUERIES_H
+#define OCCLUSIONQUERIES_H
+
+#include <glm/vec3.hpp>
+
+#include <utils.h>
+
+#include <vector>
+
+namespace OM3D {
+
+class BoundingTree;
+class SceneObject;
+
+// Coherent hierarchical culling (CHC++) with hardware occlusion queries over the nodes of a BoundingTree.
+// Results are only read once available, one or more frames later, so the CPU never waits for the GPU:
+// nodes found hidden are skipped until a query of their box passes again, and the objects they reveal appear late.
+class OcclusionQueries : NonCopyable {
+    public:
+        ~OcclusionQueries();
+
+        // Drops every node state and the pending results, needed whenever node indices change.
+        // The tree must outlive the next reset.
+        void reset(const BoundingTree &tree);
+
+        // Applies the results that are available, never waits
+        void update();
+        void begin_frame(const glm::vec3 &eye);
+
+        // Called by the traversal on every node inside the frustum, returns true if its subtree is skipped
+        bool is_hidden(u32 node, const glm::vec3 &min, const glm::vec3 &max, bool leaf);
+
+        // Draws the box of every queued node inside its query, once the visible objects are drawn.
+        // The cube must be a unit cube with a depth tested material that does not write depth.
+        void issue(SceneObject &cube);
+
+        // Nodes skipped by the last traversal
+        const std::vector<u32> &hidden_nodes() const;
+
+        size_t issued_queries() const;
+        size_t queried_boxes() const;
+        size_t pending_queries() const;
+
+    private:
+        struct NodeState {
+            u32 last_visited = 0;
+            // Last frame the node was a termination node, its subtree keeps its state while it is skipped
+            u32 last_hidden = 0;
+            // Consecutive queries that found the node hidden
+            u16 hidden_results = 0;
+            bool visible = true;
+            bool pending = false;
+        };
+
+        struct QueuedNode {
+            u32 node;
+            glm::vec3 min;
+            glm::vec3 max;
+        };
+
+        struct Query {
+            u32 handle;
+            u32 generation;
+            std::vector<u32> nodes;
+        };
+
+        void queue(u32 node, const glm::vec3 &min, const glm::vec3 &max, std::vector<QueuedNode> &queue);
+        void issue(std::vector<QueuedNode>::const_iterator begin, std::vector<QueuedNode>::const_iterator end, SceneObject &cube);
+        void set_visible(u32 node);
+        void set_hidden(u32 node);
+
+        const BoundingTree *_tree = nullptr;
+        std::vector<NodeState> _states;
+        // New nodes are last visited and hidden at frame 0, which is never the previous frame
+        u32 _frame = 1;
+        u32 _generation = 0;
+        glm::vec3 _eye = {};
+
+        // Nodes that stayed hidden long enough are batched into multi-queries, the others are queried alone
+        std::vector<QueuedNode> _single_queue;
+        std::vector<QueuedNode> _batch_queue;
+
+        std::vector<Query> _pending;
+        std::vector<u32> _free_handles;
+        std::vector<u32> _hidden;
+
+        size_t _issued_queries = 0;
+        size_t _queried_boxes = 0;
+};
+
+}
+
+#endif // OCCLUSIONQUERIES_H
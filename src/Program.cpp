@@ -1,5 +1,7 @@
 #include "Program.h"
 
+#include <GLState.h>
+
 #include <glad/glad.h>
 
 #include <algorithm>
@@ -171,12 +173,13 @@ void Program::fetch_uniform_locations() {
 
 Program::~Program() {
     if(_handle.is_valid()) {
+        GLState::current().forget_program(_handle.get());
         glDeleteProgram(_handle.get());
     }
 }
 
 void Program::bind() const {
-    glUseProgram(_handle.get());
+    GLState::current().use_program(_handle.get());
 }
 
 bool Program::is_compute() const {
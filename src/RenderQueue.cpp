@@ -0,0 +1,257 @@
+#include "RenderQueue.h"
+
+#include <glm/geometric.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <limits>
+#include <numeric>
+
+namespace OM3D {
+
+// Bits of the sort key, from the most significant. Ids past their range share the last value, which only costs state changes.
+static constexpr u32 pass_bits = 2;
+static constexpr u32 program_bits = 10;
+static constexpr u32 material_bits = 14;
+static constexpr u32 mesh_bits = 18;
+static constexpr u32 depth_bits = 20;
+static_assert(pass_bits + program_bits + material_bits + mesh_bits + depth_bits == 64);
+
+// Shorter runs are drawn one by one, the commands are not worth writing
+static constexpr size_t min_multi_draw = 2;
+
+static u64 field(u64 value, u32 bits, u32 shift) {
+    return std::min(value, (u64(1) << bits) - 1) << shift;
+}
+
+// Positive floats order like their bits, the sign bit is always clear so the top bits after it are kept
+static u64 quantize_distance(float distance) {
+    u32 bits = 0;
+    distance = std::max(distance, 0.0f);
+    std::memcpy(&bits, &distance, sizeof(bits));
+    return bits >> (31 - depth_bits);
+}
+
+static u32 dense_id(std::unordered_map<const void *, u32> &ids, const void *ptr) {
+    return ids.emplace(ptr, u32(ids.size())).first->second;
+}
+
+// Least significant digit first, digits shared by every key are skipped
+template<typename T>
+static void radix_sort(std::vector<T> &entries, std::vector<T> &buffer) {
+    static constexpr u32 digit_count = 8;
+    std::array<std::array<u32, 256>, digit_count> histograms = {};
+    for (const T &entry : entries) {
+        for (u32 d = 0; d < digit_count; d++) {
+            histograms[d][(entry.key >> (8 * d)) & 0xFF]++;
+        }
+    }
+
+    buffer.resize(entries.size());
+    for (u32 d = 0; d < digit_count; d++) {
+        std::array<u32, 256> &histogram = histograms[d];
+        if (histogram[(entries.front().key >> (8 * d)) & 0xFF] == entries.size())
+            continue;
+
+        u32 offset = 0;
+        for (u32 &count : histogram) {
+            const u32 next = offset + count;
+            count = offset;
+            offset = next;
+        }
+        for (const T &entry : entries) {
+            buffer[histogram[(entry.key >> (8 * d)) & 0xFF]++] = entry;
+        }
+        entries.swap(buffer);
+    }
+}
+
+void RenderQueue::begin_frame(const glm::vec3 &eye) {
+    _eye = eye;
+    _stats = {};
+    _program_ids.clear();
+    _material_ids.clear();
+    _mesh_ids.clear();
+}
+
+void RenderQueue::push(const SceneObject &object) {
+    const BoundingSphere &sphere = object.get_bounding_sphere();
+    push(object, DrawType::Single, 1, {}, glm::length(sphere.origin - _eye) - sphere.radius);
+}
+
+void RenderQueue::push_meshlets(const SceneObject &object) {
+    const BoundingSphere &sphere = object.get_bounding_sphere();
+    push(object, DrawType::Meshlets, 1, {}, glm::length(sphere.origin - _eye) - sphere.radius);
+}
+
+void RenderQueue::push_instances(const std::vector<const SceneObject *> &objects, const StreamAllocation &transforms) {
+    float distance = std::numeric_limits<float>::max();
+    for (const SceneObject *object : objects) {
+        const BoundingSphere &sphere = object->get_bounding_sphere();
+        distance = std::min(distance, glm::length(sphere.origin - _eye) - sphere.radius);
+    }
+    push(*objects.front(), DrawType::Instances, u32(objects.size()), transforms, distance);
+}
+
+void RenderQueue::push(const SceneObject &object, DrawType type, u32 instance_count, const StreamAllocation &transforms, float distance) {
+    if (!object.get_material() || !object.get_mesh())
+        return;
+
+    _entries.push_back({ sort_key(object, distance), u32(_draws.size()) });
+    _draws.push_back({ &object, type, instance_count, transforms });
+}
+
+u64 RenderQueue::sort_key(const SceneObject &object, float distance) {
+    const Material &material = *object.get_material();
+    const u64 program = dense_id(_program_ids, material.get_program().get());
+    const u64 id = dense_id(_material_ids, &material);
+    const u64 mesh = dense_id(_mesh_ids, object.get_mesh().get());
+    const u64 depth = quantize_distance(distance);
+
+    if (!material.is_transparent()) {
+        return field(0, pass_bits, 64 - pass_bits)
+             | field(program, program_bits, mesh_bits + material_bits + depth_bits)
+             | field(id, material_bits, mesh_bits + depth_bits)
+             | field(mesh, mesh_bits, depth_bits)
+             | depth;
+    }
+
+    // Back to front comes before any state
+    const u64 max_depth = (u64(1) << depth_bits) - 1;
+    return field(1, pass_bits, 64 - pass_bits)
+         | field(max_depth - depth, depth_bits, program_bits + material_bits + mesh_bits)
+         | field(program, program_bits, material_bits + mesh_bits)
+         | field(id, material_bits, mesh_bits)
+         | field(mesh, mesh_bits, 0);
+}
+
+void RenderQueue::submit(MeshletCulling &meshlet_culling, StreamBuffer &stream) {
+    if (_entries.empty())
+        return;
+
+    const double start = program_time();
+    radix_sort(_entries, _sort_buffer);
+    _stats.sort_time += (program_time() - start) * 1000.0;
+
+    const Program *last_program = nullptr;
+    const Material *last_material = nullptr;
+    const StaticMesh *last_mesh = nullptr;
+    for (size_t i = 0; i < _entries.size(); i++) {
+        const SortEntry &entry = _entries[i];
+        const Draw &draw = _draws[entry.draw];
+        const SceneObject &object = *draw.object;
+        Material &material = *object.get_material();
+        const StaticMesh &mesh = *object.get_mesh();
+
+        if (draw.type == DrawType::Meshlets) {
+            meshlet_culling.cull(object);
+            // The culling pass left its own program bound
+            last_program = nullptr;
+        }
+
+        if (material.get_program().get() != last_program) {
+            last_program = material.get_program().get();
+            last_program->bind();
+            _stats.program_binds++;
+        } else {
+            _stats.skipped_program_binds++;
+        }
+
+        if (&material != last_material) {
+            last_material = &material;
+            material.bind_state();
+            _stats.material_binds++;
+        } else {
+            _stats.skipped_material_binds++;
+        }
+
+        if (&mesh != last_mesh) {
+            last_mesh = &mesh;
+            mesh.bind();
+            _stats.mesh_binds++;
+        } else {
+            _stats.skipped_mesh_binds++;
+        }
+
+        // Meshes of the same material are sorted together, up to the next material
+        size_t run_end = i + 1;
+        if (draw.type == DrawType::Single) {
+            while (run_end < _entries.size()) {
+                const Draw &next = _draws[_entries[run_end].draw];
+                if (next.type != DrawType::Single || next.object->get_material().get() != &material)
+                    break;
+                run_end++;
+            }
+        }
+        if (run_end - i >= min_multi_draw) {
+            multi_draw(material, &_entries[i], _entries.data() + run_end, stream);
+            _stats.skipped_mesh_binds += run_end - i - 1;
+            _stats.skipped_material_binds += run_end - i - 1;
+            _stats.skipped_program_binds += run_end - i - 1;
+            i = run_end - 1;
+            continue;
+        }
+
+        material.set_uniform(HASH("instanced"), u32(draw.type == DrawType::Instances));
+        material.set_uniform(HASH("indirect"), 0u);
+        switch (draw.type) {
+            case DrawType::Single:
+                material.set_uniform(HASH("model"), object.transform());
+                mesh.draw(object.lod);
+                break;
+
+            case DrawType::Meshlets:
+                material.set_uniform(HASH("model"), object.transform());
+                mesh.draw_meshlets();
+                break;
+
+            case DrawType::Instances:
+                draw.transforms.bind(BufferUsage::Storage, 2);
+                mesh.draw(int(draw.instance_count), object.lod);
+                break;
+        }
+    }
+
+    _stats.draws += _entries.size();
+    _draws.clear();
+    _entries.clear();
+}
+
+void RenderQueue::multi_draw(Material &material, const SortEntry *begin, const SortEntry *end, StreamBuffer &stream) {
+    const u32 count = u32(end - begin);
+    if (_draw_ids.element_count() < count) {
+        std::vector<u32> ids(std::max(size_t(count), _draw_ids.element_count() * 2));
+        std::iota(ids.begin(), ids.end(), 0u);
+        _draw_ids = TypedBuffer<u32>(ids);
+    }
+
+    const StreamAllocation commands = stream.allocate(count * sizeof(shader::DrawElementsIndirectCommand));
+    const StreamAllocation models = stream.allocate(count * sizeof(shader::mat4));
+    shader::DrawElementsIndirectCommand *command = commands.as<shader::DrawElementsIndirectCommand>();
+    shader::mat4 *model = models.as<shader::mat4>();
+    for (u32 d = 0; d < count; d++) {
+        const SceneObject &object = *_draws[begin[d].draw].object;
+        command[d] = object.get_mesh()->draw_command(object.lod, d);
+        model[d] = object.transform();
+    }
+
+    material.set_uniform(HASH("instanced"), 0u);
+    material.set_uniform(HASH("indirect"), 1u);
+    models.bind(BufferUsage::Storage, 2);
+    commands.bind(BufferUsage::Indirect);
+
+    GeometryPool &pool = GeometryPool::current();
+    pool.set_instance_buffer(_draw_ids.handle().get());
+    pool.multi_draw_indirect(commands.offset, count);
+    pool.set_instance_buffer(0);
+
+    _stats.multi_draws++;
+    _stats.multi_drawn_objects += count;
+}
+
+const RenderQueueStats &RenderQueue::stats() const {
+    return _stats;
+}
+
+}
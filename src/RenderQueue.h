@@ -0,0 +1,92 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <SceneObject.h>
+#include <StreamBuffer.h>
+#include <Meshlets.h>
+
+#include <glm/vec3.hpp>
+
+#include <unordered_map>
+#include <vector>
+
+namespace OM3D {
+
+// Since the last begin_frame()
+struct RenderQueueStats {
+    size_t draws = 0;
+    size_t program_binds = 0;
+    size_t material_binds = 0;
+    size_t mesh_binds = 0;
+    // Binds the previous draw made unnecessary
+    size_t skipped_program_binds = 0;
+    size_t skipped_material_binds = 0;
+    size_t skipped_mesh_binds = 0;
+    // Runs of single draws of one material, drawn by one multi-draw each
+    size_t multi_draws = 0;
+    size_t multi_drawn_objects = 0;
+    double sort_time = 0.0; // ms
+};
+
+// Draws of a frame, submitted in the order of a 64-bit key: pass, program, material, mesh, then distance to the eye.
+// Opaque draws come first, front to back for early depth rejection, then transparent ones back to front.
+// State already bound by the previous draw is not bound again, the queue assumes nothing else binds state until submit() returns.
+// Consecutive single draws of the same material are one multi-draw, every mesh being in the geometry pool.
+class RenderQueue : NonCopyable {
+    public:
+        void begin_frame(const glm::vec3 &eye);
+
+        // Drawn at object.lod
+        void push(const SceneObject &object);
+        // Full detail, culled by meshlets right before the draw
+        void push_meshlets(const SceneObject &object);
+        // One draw of every object, their transforms must already be written in transforms
+        void push_instances(const std::vector<const SceneObject *> &objects, const StreamAllocation &transforms);
+
+        // Draws everything queued since the last submit, the commands and transforms of multi-draws are written to stream
+        void submit(MeshletCulling &meshlet_culling, StreamBuffer &stream);
+
+        const RenderQueueStats &stats() const;
+
+    private:
+        enum class DrawType : u8 {
+            Single,
+            Meshlets,
+            Instances,
+        };
+
+        struct Draw {
+            const SceneObject *object;
+            DrawType type;
+            u32 instance_count;
+            StreamAllocation transforms;
+        };
+
+        struct SortEntry {
+            u64 key;
+            u32 draw;
+        };
+
+        void push(const SceneObject &object, DrawType type, u32 instance_count, const StreamAllocation &transforms, float distance);
+        u64 sort_key(const SceneObject &object, float distance);
+        // Draws of [begin, end), all single draws of the bound material
+        void multi_draw(Material &material, const SortEntry *begin, const SortEntry *end, StreamBuffer &stream);
+
+        glm::vec3 _eye = {};
+        std::vector<Draw> _draws;
+        std::vector<SortEntry> _entries;
+        std::vector<SortEntry> _sort_buffer;
+        // 0, 1, 2... read as the instance attribute, the base instance of every command selects its transform
+        TypedBuffer<u32> _draw_ids;
+
+        // Dense ids, in order of first appearance, so that they fit their bits of the key
+        std::unordered_map<const void *, u32> _program_ids;
+        std::unordered_map<const void *, u32> _material_ids;
+        std::unordered_map<const void *, u32> _mesh_ids;
+
+        RenderQueueStats _stats;
+};
+
+}
+
+#endif // RENDERQUEUE_H
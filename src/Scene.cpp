@@ -4,17 +4,33 @@
 
 #include <TypedBuffer.h>
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <random>
 
 namespace OM3D
 {
-    Scene::Scene()
+    // Occluders rasterized per frame, and the largest mesh that can be one
+    static constexpr size_t max_occluders = 32;
+    static constexpr size_t max_occluder_triangles = 1024;
+    // Bounding radius over distance below which an object is too small on screen to be an occluder
+    static constexpr float min_occluder_size = 0.05f;
+    // Relative depth by which a box must be behind the Hi-Z pyramid, so that faces drawn in the first phase do not hide their own box
+    static constexpr float hiz_depth_tolerance = 1e-3f;
+    // Rays per task of the batched queries
+    static constexpr size_t ray_batch_grain = 256;
+    // Size on screen, as the bounding diameter over the screen height, above which objects are drawn at full detail.
+    // Every level of detail halves it, see build_lods().
+    static constexpr float full_detail_screen_size = 0.5f;
+    // Depth covered by the first shadow cascade, every next one covers this ratio more
+    static constexpr float first_cascade_depth = 10.0f;
+    static constexpr float cascade_depth_ratio = 4.0f;
+
+    static MeshData cube_mesh_data()
     {
-        auto mapping = _buffer.map(AccessType::WriteOnly);
-        mapping[0].sun_color = glm::vec3(1.0f, 1.0f, 1.0f);
-        mapping[0].point_light_count = (glm::uint)_point_lights.size();
-        mapping[0].sun_dir = glm::normalize(_sun_direction);
-
         std::vector<Vertex> cube_vertices = {
             {{-0.5, -0.5, 0.5}},
             {{0.5, -0.5, 0.5}},
@@ -39,27 +55,131 @@ namespace OM3D
             4, 6, 7,
             4, 7, 5};
 
-        _cube = SceneObject(std::make_shared<StaticMesh>(MeshData{cube_vertices, cube_indices}),
-                            std::make_shared<Material>(Material::aabb_material()));
+        // Smooth normals so the cube can also be shaded
+        for (Vertex &v : cube_vertices)
+            v.normal = glm::normalize(v.position);
+
+        MeshData data;
+        data.vertices = std::move(cube_vertices);
+        data.indices = std::move(cube_indices);
+        return data;
+    }
+
+    // Vehicles turn back at the end of their street
+    static glm::mat4 vehicle_transform(glm::vec3 position, float street_length)
+    {
+        position.x = std::fmod(position.x, 2.0f * street_length);
+        if (position.x < 0.0f)
+            position.x += 2.0f * street_length;
+        if (position.x > street_length)
+            position.x = 2.0f * street_length - position.x;
+
+        return glm::translate(glm::mat4(1.0f), position) * glm::scale(glm::mat4(1.0f), glm::vec3(3.0f, 1.5f, 1.6f));
+    }
+
+    Scene::Scene()
+    {
+        auto mapping = _buffer.map(AccessType::WriteOnly);
+        mapping[0].sun_color = glm::vec3(1.0f, 1.0f, 1.0f);
+        mapping[0].point_light_count = (glm::uint)_point_lights.size();
+        mapping[0].sun_dir = glm::normalize(_sun_direction);
+
+        auto cube_mesh = std::make_shared<StaticMesh>(cube_mesh_data());
+        _cube = SceneObject(cube_mesh, std::make_shared<Material>(Material::aabb_material()));
+
+        Material query_material = Material::aabb_material();
+        query_material.set_depth_test_mode(DepthTestMode::Standard);
+        _query_cube = SceneObject(cube_mesh, std::make_shared<Material>(std::move(query_material)));
+    }
+
+    std::unique_ptr<Scene> Scene::synthetic(size_t instances, size_t subdivisions, BuildStrategy strategy, size_t vehicles)
+    {
+        auto scene = std::make_unique<Scene>();
+
+        auto mesh = std::make_shared<StaticMesh>(cube_mesh_data());
+        auto material = Material::empty_material();
+
+        // City-like layout: buildings of random height on a jittered grid
+        std::mt19937 rng(0x0A3D);
+        std::uniform_real_distribution<float> jitter(-1.0f, 1.0f);
+        std::uniform_real_distribution<float> height(1.0f, 20.0f);
+
+        const size_t side = size_t(std::ceil(std::sqrt(double(instances))));
+        const float spacing = 4.0f;
+
+        for (size_t i = 0; i < instances; i++)
+        {
+            const float h = height(rng);
+            const glm::vec3 position((i % side) * spacing + jitter(rng), h * 0.5f, (i / side) * spacing + jitter(rng));
+
+            SceneObject object(mesh, material);
+            object.set_transform(glm::translate(glm::mat4(1.0f), position) * glm::scale(glm::mat4(1.0f), glm::vec3(2.0f, h, 2.0f)));
+            scene->add_object(std::move(object));
+        }
+
+        // Vehicles drive along the streets between the rows of buildings
+        std::uniform_real_distribution<float> speed(5.0f, 20.0f);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        const size_t rows = (instances + side - 1) / side;
+        scene->_street_length = side * spacing;
+
+        for (size_t i = 0; i < vehicles; i++)
+        {
+            const glm::vec3 start(unit(rng) * scene->_street_length, 0.75f, ((i % rows) + 0.5f) * spacing);
+
+            SceneObject object(mesh, material);
+            object.set_transform(vehicle_transform(start, scene->_street_length));
+
+            std::shared_ptr<SceneObject> new_object;
+            scene->add_object(std::move(object), &new_object);
+            scene->_vehicles.push_back(Vehicle{new_object, start, i % 2 ? speed(rng) : -speed(rng)});
+        }
+
+        scene->create_bounding_volume_hierarchy(subdivisions, strategy);
+        scene->init_light_buffer();
+
+        return scene;
+    }
+
+    // Objects that can be instanced together have the same key, different ones almost never do
+    static u64 group_key(const SceneObject &obj)
+    {
+        const Material *material = obj.get_material().get();
+        return content_hash(&material, sizeof(material), obj.get_mesh()->content_hash());
     }
 
     void Scene::add_object(SceneObject obj, std::shared_ptr<SceneObject> *new_address)
     {
         _render_info.objects++;
 
-        for (size_t i = 0; i < _objects.size(); i++)
+        // The key only finds the candidate groups, the object is still compared with them in case two keys collide
+        std::vector<size_t> &candidates = _group_indices[group_key(obj)];
+        for (const size_t index : candidates)
         {
-            if (obj == *_objects[i].front())
+            auto &group = _objects[index];
+            if (!group.empty() && obj == *group.front())
             {
-                obj.id = i;
-                _objects[i].emplace_back(std::make_shared<SceneObject>(std::move(obj)));
+                obj.id = index;
+                group.emplace_back(std::make_shared<SceneObject>(std::move(obj)));
                 if (new_address)
-                    *new_address = _objects[i].back();
+                    *new_address = group.back();
                 return;
             }
         }
 
+        // A group emptied by dynamic_remove_object() among the candidates is refilled in place, its index stays in use
+        const auto emptied = std::find_if(candidates.begin(), candidates.end(), [&](size_t index) { return _objects[index].empty(); });
+        if (emptied != candidates.end())
+        {
+            obj.id = *emptied;
+            _objects[*emptied].emplace_back(std::make_shared<SceneObject>(std::move(obj)));
+            if (new_address)
+                *new_address = _objects[*emptied].back();
+            return;
+        }
+
         _nb_different_objects++;
+        candidates.push_back(_objects.size());
 
         obj.id = _objects.size();
         _objects.emplace_back(std::vector<std::shared_ptr<SceneObject>>());
@@ -93,42 +213,174 @@ namespace OM3D
         }
     }
 
-    void Scene::dynamic_add_object(SceneObject obj, size_t subdivisions)
+    InstanceHandle Scene::dynamic_add_object(SceneObject obj, size_t subdivisions)
     {
         std::shared_ptr<SceneObject> new_object;
         add_object(std::move(obj), &new_object);
 
-        BoundingTree new_leaf(new_object);
-        _bounding_tree.insert(new_leaf, subdivisions);
+        const InstanceHandle handle = _bounding_tree.insert(new_object, subdivisions);
+        if (handle >= _instance_slots.size())
+            _instance_slots.resize(handle + 1);
+        _instance_slots[handle] = {u32(new_object->id), u32(_objects[new_object->id].size() - 1)};
+        new_object->handle = handle;
+
+        _visible_objects_valid = false;
+        _gpu_hierarchy_valid = false;
+        _query_state_valid = false;
+        _hlod.clear();
+        _hlod_dirty = true;
+        return handle;
+    }
+
+    void Scene::dynamic_remove_object(InstanceHandle handle)
+    {
+        if (!_bounding_tree.remove(handle))
+            return;
+        _visible_objects_valid = false;
+        _gpu_hierarchy_valid = false;
+        _query_state_valid = false;
+        _hlod.clear();
+        _hlod_dirty = true;
+
+        // Swap and pop, the last object of the group takes the slot
+        const InstanceSlot slot = _instance_slots[handle];
+        auto &v = _objects[slot.group];
+        v[slot.slot]->handle = u32(-1);
+        v[slot.slot] = std::move(v.back());
+        v.pop_back();
+        if (slot.slot < v.size())
+            _instance_slots[v[slot.slot]->handle].slot = slot.slot;
+
+        _render_info.objects--;
     }
 
-    void Scene::dynamic_remove_object(const std::shared_ptr<SceneObject> &object)
+    const std::shared_ptr<SceneObject> &Scene::get_object(InstanceHandle handle) const
     {
-        if (_bounding_tree.remove(object) == Delete)
+        const InstanceSlot slot = _instance_slots[handle];
+        return _objects[slot.group][slot.slot];
+    }
+
+    void Scene::move_object(InstanceHandle handle, const glm::mat4 &transform, HierarchyUpdate update)
+    {
+        const std::shared_ptr<SceneObject> &object = get_object(handle);
+        object->set_transform(transform);
+
+        if (update == HierarchyUpdate::RemoveInsert)
         {
-            _bounding_tree = BoundingTree();
+            // The freed handle is the first one to be reused, so the object keeps it
+            _bounding_tree.remove(handle);
+            const InstanceHandle new_handle = _bounding_tree.insert(object, _bvh_subdivisions);
+            ALWAYS_ASSERT(new_handle == handle, "Reinserted object changed handle");
+            _visible_objects_valid = false;
+            _gpu_hierarchy_valid = false;
+            _query_state_valid = false;
+            _hlod.clear();
+            _hlod_dirty = true;
+            return;
         }
 
-        auto &v = _objects[object->id];
-        v.erase(std::find(v.begin(), v.end(), object));
-        _render_info.objects--;
+        // Proxies above the leaf hold a copy of the object where it was, the others are still valid
+        _hlod.invalidate(_bounding_tree, _bounding_tree.leaf(handle));
+
+        _bounding_tree.mark_moved(handle);
+    }
+
+    void Scene::update_hierarchy()
+    {
+        if (!_bounding_tree.has_moved_objects())
+            return;
+
+        const RefitStats stats = _bounding_tree.refit(&ThreadPool::global());
+        _render_info.rebuilt_subtrees += stats.rebuilt_subtrees;
+        _visible_objects_valid = false;
+        _gpu_hierarchy_valid = false;
+        // Refitted nodes keep their index, rebuilt subtrees do not
+        if (stats.rebuilt_subtrees > 0)
+        {
+            _query_state_valid = false;
+            _hlod.clear();
+            _hlod_dirty = true;
+        }
     }
 
-    void Scene::create_bounding_volume_hierarchy(size_t subdivisions)
+    void Scene::animate_vehicles(float time, HierarchyUpdate update)
     {
-        std::vector<BoundingTree> trees;
+        if (_vehicles.empty())
+            return;
 
-        for (auto &v : _objects)
+        const double update_start = program_time();
+        for (const Vehicle &vehicle : _vehicles)
         {
-            for (auto &o : v)
+            glm::vec3 position = vehicle.start;
+            position.x += vehicle.speed * time;
+            move_object(vehicle.object->handle, vehicle_transform(position, _street_length), update);
+        }
+        update_hierarchy();
+
+        _render_info.moved_objects = _vehicles.size();
+        _render_info.update_time = (program_time() - update_start) * 1000.0;
+    }
+
+    size_t Scene::get_nb_vehicles() const
+    {
+        return _vehicles.size();
+    }
+
+    const std::shared_ptr<SceneObject> &Scene::get_vehicle(size_t index) const
+    {
+        return _vehicles[index].object;
+    }
+
+    const std::vector<std::vector<std::shared_ptr<SceneObject>>> &Scene::get_objects() const
+    {
+        return _objects;
+    }
+
+    const BoundingTree &Scene::get_bounding_tree() const
+    {
+        return _bounding_tree;
+    }
+
+    size_t Scene::get_bvh_subdivisions() const
+    {
+        return _bvh_subdivisions;
+    }
+
+    void Scene::create_bounding_volume_hierarchy(size_t subdivisions, BuildStrategy strategy)
+    {
+        std::vector<std::shared_ptr<SceneObject>> instances;
+        instances.reserve(_render_info.objects);
+        _instance_slots.clear();
+        _instance_slots.reserve(_render_info.objects);
+
+        // Handles are the indices in instances
+        for (u32 group = 0; group < _objects.size(); group++)
+        {
+            for (u32 slot = 0; slot < _objects[group].size(); slot++)
             {
-                trees.emplace_back(BoundingTree(o));
+                _objects[group][slot]->handle = u32(instances.size());
+                _instance_slots.push_back({group, slot});
+                instances.emplace_back(_objects[group][slot]);
             }
         }
 
-        _bounding_tree = BoundingTree(trees);
-        if (subdivisions > 1)
-            _bounding_tree.subdivise(subdivisions);
+        const double build_start = program_time();
+        _bounding_tree.build(std::move(instances), subdivisions, strategy, &ThreadPool::global());
+        _render_info.build_time = (program_time() - build_start) * 1000.0;
+        _render_info.sah_cost = _bounding_tree.sah_cost();
+        _render_info.rebuilt_subtrees = 0;
+        _bvh_subdivisions = subdivisions;
+        _visible_objects_valid = false;
+        _gpu_hierarchy_valid = false;
+        _query_state_valid = false;
+        _hlod.clear();
+        _hlod_dirty = true;
+    }
+
+    void Scene::build_hlod()
+    {
+        _hlod.start_build(_bounding_tree, _hlod_cache_directory, ThreadPool::global());
+        _hlod_dirty = false;
     }
 
     void Scene::update_frame(const Camera &camera)
@@ -137,53 +389,364 @@ namespace OM3D
         mapping[0].camera.view_proj = camera.view_proj_matrix();
 
         _frustum = camera.build_frustum();
+
+        update_hierarchy();
     }
 
-    void Scene::render(const Camera &camera)
+    void Scene::render(const Camera &camera, DepthPyramid *depth_pyramid)
     {
         _buffer.bind(BufferUsage::Uniform, 0);
+        _instance_stream.begin_frame();
+        _render_queue.begin_frame(camera.position());
+        _render_info.render_queue = {};
 
         _render_info.rendered = 0;
-        _render_info.checks = 0;
+        _render_info.draw_calls = 0;
+        _render_info.streamed_bytes = 0;
+        _render_info.drawn_proxies = 0;
+        if (_hlod_screen_size > 0.0f && _hlod_dirty && !_hlod.is_building())
+            build_hlod();
+        if (_hlod.finish_build())
+        {
+            _visible_objects_valid = false;
+            _render_info.hlod_build_time = _hlod.build_time();
+            _render_info.hlod_cache_hits = _hlod.cache_hits();
+        }
+        // Dropped with the proxies
+        _render_info.hlod_proxies = _hlod.proxy_count();
+        _render_info.hlod_proxy_triangles = _hlod.total_triangles();
+        _render_info.triangles = 0;
+        _render_info.full_detail_triangles = 0;
+        _render_info.meshlet_objects = 0;
+        _render_info.meshlets = 0;
+        _render_info.meshlet_triangles = 0;
+        _render_info.first_phase_objects = 0;
+        _render_info.second_phase_objects = 0;
+
+        const bool two_phase = _occlusion_mode == OcclusionMode::TwoPhaseHiZ && depth_pyramid;
+        const bool queries = _occlusion_mode == OcclusionMode::Queries;
+        const bool occlusion_buffer = _occlusion_mode == OcclusionMode::Occluders || _occlusion_mode == OcclusionMode::TwoPhaseHiZ;
+        const bool hlod = hlod_active();
+
+        if (_meshlet_culling_enabled)
+            _meshlet_culling.begin_frame(_frustum, camera.position());
+
+        const double cull_start = program_time();
+        if (_gpu_culling_enabled)
+        {
+            if (!_gpu_hierarchy_valid)
+            {
+                _gpu_culling.upload(_bounding_tree, _objects);
+                _gpu_hierarchy_valid = true;
+                _render_info.gpu_upload_time = (program_time() - cull_start) * 1000.0;
+            }
 
-        auto objects = std::vector<std::vector<std::shared_ptr<SceneObject>>>(_nb_different_objects);
+            _gpu_culling.cull(_frustum);
+            _gpu_culling.draw(_objects);
 
-        _bounding_tree.frustum_cull(objects, _frustum, _render_info.checks);
+            // Only the submission is timed, the visible count is only known after verify_gpu_culling()
+            _render_info.gpu_dispatches = _gpu_culling.dispatch_count();
+            _render_info.cull_time = (program_time() - cull_start) * 1000.0;
+            return;
+        }
 
-        // Render every object
-        for (auto &v : objects)
+        // Query results change the visible set even if the view does not
+        _render_info.reused_visible_set = !queries && _visible_objects_valid && camera.view_proj_matrix() == _culled_view_proj;
+        if (_render_info.reused_visible_set)
+        {
+            _render_info.checks = 0;
+            _render_info.plane_tests = 0;
+            _render_info.saved_plane_tests = _last_traversal_plane_tests;
+            _render_info.sphere_rejections = 0;
+            _render_info.sphere_tests = 0;
+            _render_info.occlusion_tests = 0;
+            _render_info.occluded_nodes = 0;
+            _render_info.occlusion_time = 0.0;
+        }
+        else
         {
-            // If there are not enough objects, the instancing overhead is too big and performances are lower
-            if (v.size() < 50)
+            _render_info.occluders = 0;
+            _render_info.occluder_triangles = 0;
+            _render_info.occlusion_time = 0.0;
+            if (_occlusion_mode == OcclusionMode::Occluders)
+                rasterize_occluders(camera);
+            else if (two_phase)
+                render_first_phase(camera, *depth_pyramid);
+            else if (queries)
             {
-                for (const auto &o : v)
+                if (!_query_state_valid)
                 {
-                    o->render();
-                    _render_info.rendered++;
+                    _occlusion_queries.reset(_bounding_tree);
+                    _query_state_valid = true;
                 }
+                _occlusion_queries.update();
+                _occlusion_queries.begin_frame(camera.position());
+            }
+            if (hlod)
+                _hlod.begin_frame(camera.position(), camera.projection_matrix()[1][1], _hlod_screen_size);
 
-                continue;
+            _visible_objects.assign(_nb_different_objects, {});
+
+            CullingStats stats;
+            _bounding_tree.frustum_cull(_visible_objects, _frustum, stats, _culling_kernel,
+                                        occlusion_buffer ? &_occlusion_buffer : nullptr, queries ? &_occlusion_queries : nullptr,
+                                        hlod ? &_hlod : nullptr);
+
+            _render_info.checks = stats.checks;
+            _render_info.plane_tests = stats.plane_tests;
+            _render_info.saved_plane_tests = stats.saved_plane_tests;
+            _render_info.sphere_rejections = stats.sphere_rejections;
+            _render_info.sphere_tests = stats.sphere_tests;
+            _render_info.occlusion_tests = stats.occlusion_tests;
+            _render_info.occluded_nodes = stats.occluded_nodes;
+            _last_traversal_plane_tests = stats.plane_tests + stats.saved_plane_tests;
+
+            select_lods(camera);
+
+            _culled_view_proj = camera.view_proj_matrix();
+            _visible_objects_valid = true;
+        }
+        _render_info.cull_time = (program_time() - cull_start) * 1000.0;
+
+        if (queries)
+        {
+            // The boxes are tested against the depth of the visible objects, the results are read in a later frame
+            render_groups(_visible_objects);
+            render_proxies();
+            submit_draws();
+            _occlusion_queries.issue(_query_cube);
+
+            _render_info.queries = _occlusion_queries.issued_queries();
+            _render_info.query_boxes = _occlusion_queries.queried_boxes();
+            _render_info.pending_queries = _occlusion_queries.pending_queries();
+            _render_info.hidden_nodes = _occlusion_queries.hidden_nodes().size();
+            _render_info.hidden_objects = 0;
+            for (const u32 node : _occlusion_queries.hidden_nodes())
+                _render_info.hidden_objects += _bounding_tree.leaf_count(node);
+            return;
+        }
+
+        if (!two_phase || _render_info.reused_visible_set)
+        {
+            render_groups(_visible_objects);
+            render_proxies();
+            submit_draws();
+            return;
+        }
+
+        // Second phase: only the objects that were not visible in the previous frame
+        std::vector<std::vector<std::shared_ptr<SceneObject>>> second_phase(_visible_objects.size());
+        for (size_t group = 0; group < _visible_objects.size(); group++)
+        {
+            for (const std::shared_ptr<SceneObject> &object : _visible_objects[group])
+            {
+                if (!_first_phase_objects[object->handle])
+                    second_phase[group].push_back(object);
             }
+        }
+
+        const size_t first_phase_rendered = _render_info.rendered;
+        render_groups(second_phase);
+        render_proxies();
+        submit_draws();
+        _render_info.second_phase_objects = _render_info.rendered - first_phase_rendered;
+    }
 
-            size_t i = 0;
+    void Scene::select_lods(const Camera &camera)
+    {
+        const glm::vec3 eye = camera.position();
+        const float scale = camera.projection_matrix()[1][1];
 
-            // Fill and bind objects buffer
-            TypedBuffer<shader::mat4> object_buffer(nullptr, std::max(v.size(), size_t(1)));
+        _render_info.screen_size_culled = 0;
+        for (auto &group : _visible_objects)
+        {
+            const auto tiny = std::remove_if(group.begin(), group.end(), [&](const std::shared_ptr<SceneObject> &object) {
+                const std::shared_ptr<StaticMesh> &mesh = object->get_mesh();
+                const BoundingSphere &sphere = object->get_bounding_sphere();
+                const float distance = glm::length(sphere.origin - eye);
+                if (!mesh || distance <= sphere.radius)
+                {
+                    object->lod = 0;
+                    return false;
+                }
+
+                const float size = sphere.radius * scale / distance;
+                if (size < _min_screen_size)
+                    return true;
+
+                const float level = size >= full_detail_screen_size ? 0.0f : std::floor(std::log2(full_detail_screen_size / size)) + 1.0f;
+                object->lod = u32(std::min(level, float(mesh->lod_count() - 1)));
+                return false;
+            });
+
+            _render_info.screen_size_culled += size_t(group.end() - tiny);
+            group.erase(tiny, group.end());
+        }
+    }
+
+    void Scene::render_groups(const std::vector<std::vector<std::shared_ptr<SceneObject>>> &groups)
+    {
+        // Render every object, instances of a group are drawn together as long as they use the same level of detail
+        for (auto &v : groups)
+        {
+            if (v.empty())
+                continue;
+
+            const std::shared_ptr<StaticMesh> &mesh = v.front()->get_mesh();
+            const u32 lod_count = mesh ? mesh->lod_count() : 1;
+            _lod_buckets.resize(std::max(size_t(lod_count), _lod_buckets.size()));
+            for (const auto &o : v)
+                _lod_buckets[std::min(o->lod, lod_count - 1)].push_back(o.get());
+
+            for (u32 lod = 0; lod < _lod_buckets.size(); lod++)
             {
-                auto mapping = object_buffer.map(AccessType::WriteOnly);
-                for (const std::shared_ptr<SceneObject> &obj : v)
+                if (mesh)
                 {
-                    mapping[i++] = {
-                        obj->transform(),
-                    };
-                    _render_info.rendered++;
+                    _render_info.triangles += size_t(mesh->lod_triangle_count(lod)) * _lod_buckets[lod].size();
+                    _render_info.full_detail_triangles += size_t(mesh->lod_triangle_count(0)) * _lod_buckets[lod].size();
                 }
+                render_instances(_lod_buckets[lod]);
+                _lod_buckets[lod].clear();
             }
-            object_buffer.bind(BufferUsage::Storage, 2);
+        }
+    }
 
-            // Render every instance of this object
-            v.front()->render(int(i));
+    void Scene::render_instances(const std::vector<const SceneObject *> &v)
+    {
+        // If there are not enough objects, the instancing overhead is too big and performances are lower
+        if (v.size() < 50)
+        {
+            for (const SceneObject *o : v)
+            {
+                const std::shared_ptr<StaticMesh> &mesh = o->get_mesh();
+                if (_meshlet_culling_enabled && o->lod == 0 && mesh && mesh->meshlet_count())
+                {
+                    _render_queue.push_meshlets(*o);
+                    _render_info.meshlet_objects++;
+                    _render_info.meshlets += mesh->meshlet_count();
+                    _render_info.meshlet_triangles += mesh->lod_triangle_count(0);
+                }
+                else
+                    _render_queue.push(*o);
+                _render_info.rendered++;
+            }
+            _render_info.draw_calls += v.size();
+
+            return;
+        }
+
+        size_t i = 0;
+
+        // Fill and bind objects buffer
+        const StreamAllocation objects = _instance_stream.allocate(v.size() * sizeof(shader::mat4));
+        shader::mat4 *models = objects.as<shader::mat4>();
+        for (const SceneObject *obj : v)
+        {
+            models[i++] = {
+                obj->transform(),
+            };
+            _render_info.rendered++;
+        }
+
+        // Render every instance of this object
+        _render_queue.push_instances(v, objects);
+        _render_info.draw_calls++;
+    }
+
+    void Scene::render_proxies()
+    {
+        if (!hlod_active())
+            return;
+
+        for (const u32 node : _hlod.selected_nodes())
+        {
+            for (const SceneObject &part : _hlod.parts(node))
+                _render_queue.push(part);
+
+            _render_info.draw_calls += _hlod.parts(node).size();
+            _render_info.drawn_proxies++;
+            _render_info.triangles += _hlod.triangle_count(node);
+            _render_info.full_detail_triangles += _hlod.replaced_triangles(node);
+        }
+    }
+
+    void Scene::submit_draws()
+    {
+        _render_queue.submit(_meshlet_culling, _instance_stream);
+        _render_info.render_queue = _render_queue.stats();
+        _render_info.streamed_bytes = _instance_stream.streamed_bytes();
+        _render_info.stream_growths = _instance_stream.growth_count();
+    }
+
+    bool Scene::hlod_active() const
+    {
+        return !_hlod.is_empty() && _hlod_screen_size > 0.0f;
+    }
+
+    void Scene::rasterize_occluders(const Camera &camera)
+    {
+        const double start = program_time();
+        _occlusion_buffer.clear(camera.view_proj_matrix());
+
+        // The visible set still holds the previous traversal, its objects are ranked by their approximate size on screen
+        const glm::vec3 eye = camera.position();
+        std::vector<std::pair<float, const SceneObject *>> candidates;
+        for (const auto &group : _visible_objects)
+        {
+            for (const std::shared_ptr<SceneObject> &object : group)
+            {
+                const std::shared_ptr<StaticMesh> &mesh = object->get_mesh();
+                if (!mesh || mesh->get_indices().size() > 3 * max_occluder_triangles)
+                    continue;
+
+                const auto [min, max] = object->get_aabb();
+                const float radius = glm::length(max - min) * 0.5f;
+                const float size = radius / std::max(glm::length((min + max) * 0.5f - eye), radius);
+                if (size >= min_occluder_size)
+                    candidates.emplace_back(size, object.get());
+            }
+        }
+
+        const size_t count = std::min(candidates.size(), max_occluders);
+        std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(),
+                          [](const auto &a, const auto &b) { return a.first > b.first; });
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const SceneObject &occluder = *candidates[i].second;
+            _occlusion_buffer.rasterize(occluder.transform(), occluder.get_mesh()->get_vertices(), occluder.get_mesh()->get_indices());
         }
+        _occlusion_buffer.build_pyramid();
+
+        _render_info.occluders = count;
+        _render_info.occluder_triangles = _occlusion_buffer.rasterized_triangles();
+        _render_info.occlusion_time = (program_time() - start) * 1000.0;
+    }
+
+    void Scene::render_first_phase(const Camera &camera, DepthPyramid &depth_pyramid)
+    {
+        // The visible set still holds the previous traversal, objects removed since then are dropped
+        _first_phase_objects.assign(_instance_slots.size(), 0);
+        for (auto &group : _visible_objects)
+        {
+            group.erase(std::remove_if(group.begin(), group.end(), [](const auto &object) { return object->handle == u32(-1); }), group.end());
+            for (const std::shared_ptr<SceneObject> &object : group)
+                _first_phase_objects[object->handle] = 1;
+        }
+
+        render_groups(_visible_objects);
+        submit_draws();
+        _render_info.first_phase_objects = _render_info.rendered;
+
+        // Reading the pyramid back waits for the first phase to be drawn
+        const double start = program_time();
+        depth_pyramid.build();
+        const glm::uvec2 size = depth_pyramid.read_back(OcclusionBuffer::default_width, _pyramid_depths);
+
+        // The reversed infinite projection stores near / w as depth
+        const float scale = (1.0f - hiz_depth_tolerance) / camera.projection_matrix()[3][2];
+        _occlusion_buffer.load(camera.view_proj_matrix(), size.x, size.y, _pyramid_depths.data(), scale);
+        _render_info.occlusion_time = (program_time() - start) * 1000.0;
     }
 
     void Scene::render_aabb(size_t level) {
@@ -196,6 +759,196 @@ namespace OM3D
         _light_buffer.bind(BufferUsage::Storage, 1);
     }
 
+    void Scene::set_culling_kernel(CullingKernel kernel)
+    {
+        if (is_supported(kernel))
+        {
+            _culling_kernel = kernel;
+            _visible_objects_valid = false;
+        }
+    }
+
+    CullingKernel Scene::get_culling_kernel() const
+    {
+        return _culling_kernel;
+    }
+
+    void Scene::set_occlusion_mode(OcclusionMode mode)
+    {
+        _occlusion_mode = mode;
+        _visible_objects_valid = false;
+    }
+
+    OcclusionMode Scene::get_occlusion_mode() const
+    {
+        return _occlusion_mode;
+    }
+
+    void Scene::set_min_screen_size(float size)
+    {
+        _min_screen_size = size;
+        _visible_objects_valid = false;
+    }
+
+    float Scene::get_min_screen_size() const
+    {
+        return _min_screen_size;
+    }
+
+    void Scene::set_hlod_screen_size(float size)
+    {
+        _hlod_screen_size = size;
+        _visible_objects_valid = false;
+    }
+
+    float Scene::get_hlod_screen_size() const
+    {
+        return _hlod_screen_size;
+    }
+
+    void Scene::set_hlod_cache_directory(const std::string &directory)
+    {
+        _hlod_cache_directory = directory;
+    }
+
+    void Scene::set_meshlet_culling(bool enabled)
+    {
+        _meshlet_culling_enabled = enabled;
+    }
+
+    bool Scene::get_meshlet_culling() const
+    {
+        return _meshlet_culling_enabled;
+    }
+
+    void Scene::read_meshlet_stats()
+    {
+        const MeshletStats stats = _meshlet_culling_enabled ? _meshlet_culling.read_stats() : MeshletStats();
+        _render_info.visible_meshlets = stats.visible_meshlets;
+        _render_info.visible_meshlet_triangles = stats.visible_triangles;
+    }
+
+    void Scene::set_gpu_culling(bool enabled)
+    {
+        _gpu_culling_enabled = enabled;
+    }
+
+    bool Scene::get_gpu_culling() const
+    {
+        return _gpu_culling_enabled;
+    }
+
+    std::vector<std::vector<u32>> Scene::read_gpu_visible_instances()
+    {
+        if (!_gpu_culling_enabled || !_gpu_hierarchy_valid)
+            return {};
+        return _gpu_culling.read_visible_instances();
+    }
+
+    bool Scene::raycast(const Ray &ray, RayHit &hit) const
+    {
+        return _bounding_tree.raycast(ray, hit);
+    }
+
+    bool Scene::raycast_any(const Ray &ray) const
+    {
+        return _bounding_tree.raycast_any(ray);
+    }
+
+    void Scene::overlap_box(const glm::vec3 &min, const glm::vec3 &max, std::vector<InstanceHandle> &handles) const
+    {
+        _bounding_tree.overlap_box(min, max, handles);
+    }
+
+    void Scene::overlap_sphere(const glm::vec3 &center, float radius, std::vector<InstanceHandle> &handles) const
+    {
+        _bounding_tree.overlap_sphere(center, radius, handles);
+    }
+
+    void Scene::nearest(const glm::vec3 &point, size_t k, std::vector<InstanceHandle> &handles) const
+    {
+        _bounding_tree.nearest(point, k, handles);
+    }
+
+    void Scene::raycast(const std::vector<Ray> &rays, std::vector<RayHit> &hits) const
+    {
+        hits.assign(rays.size(), RayHit{});
+        ThreadPool::global().parallel_for(0, rays.size(), ray_batch_grain, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+                _bounding_tree.raycast(rays[i], hits[i]);
+        });
+    }
+
+    void Scene::raycast_any(const std::vector<Ray> &rays, std::vector<u8> &hits) const
+    {
+        hits.assign(rays.size(), 0);
+        ThreadPool::global().parallel_for(0, rays.size(), ray_batch_grain, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+                hits[i] = _bounding_tree.raycast_any(rays[i]);
+        });
+    }
+
+    void Scene::cull_views(const std::vector<Frustum> &frustums, std::vector<ViewVisibility> &visible, CullingStats &stats) const
+    {
+        _bounding_tree.frustum_cull_views(frustums, visible, stats, _culling_kernel);
+    }
+
+    std::vector<Frustum> Scene::build_shadow_cascades(const Camera &camera, size_t count) const
+    {
+        std::vector<Frustum> cascades;
+        if (_bounding_tree.is_empty())
+            return cascades;
+
+        // Casters between the sun and a slice are kept by pulling the near plane back by the size of the scene
+        const float scene_size = glm::length(_bounding_tree.max_corner(0) - _bounding_tree.min_corner(0));
+        const glm::vec3 sun = glm::normalize(_sun_direction);
+        const glm::vec3 up = std::abs(sun.y) > 0.99f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+
+        const glm::mat4 &view_proj = camera.view_proj_matrix();
+        const glm::mat4 inv_view_proj = glm::inverse(view_proj);
+        const auto ndc_depth = [&](float distance) {
+            const glm::vec4 clip = view_proj * glm::vec4(camera.position() + camera.forward() * distance, 1.0f);
+            return clip.z / clip.w;
+        };
+
+        float near_distance = 0.0f;
+        float far_distance = first_cascade_depth;
+        for (size_t c = 0; c < count; c++)
+        {
+            // Corners of the slice of the view
+            std::array<glm::vec3, 8> corners;
+            const float depths[2] = { c ? ndc_depth(near_distance) : 1.0f, ndc_depth(far_distance) };
+            glm::vec3 center(0.0f);
+            for (u32 i = 0; i != 8; ++i)
+            {
+                const glm::vec4 point = inv_view_proj * glm::vec4(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, depths[i >> 2], 1.0f);
+                corners[i] = glm::vec3(point) / point.w;
+                center += corners[i] / 8.0f;
+            }
+
+            const glm::mat4 light_view = glm::lookAt(center + sun, center, up);
+            glm::vec3 min(std::numeric_limits<float>::max());
+            glm::vec3 max(-std::numeric_limits<float>::max());
+            for (const glm::vec3 &corner : corners)
+            {
+                const glm::vec3 p = glm::vec3(light_view * glm::vec4(corner, 1.0f));
+                min = glm::min(min, p);
+                max = glm::max(max, p);
+            }
+
+            // The light looks down -z
+            const glm::mat4 light_proj = glm::orthoRH_ZO(min.x, max.x, min.y, max.y, -max.z - scene_size, -min.z);
+            cascades.push_back(Frustum::from_view_proj(light_proj * light_view));
+
+            near_distance = far_distance;
+            far_distance *= cascade_depth_ratio;
+        }
+
+        return cascades;
+    }
+
     const RenderInfo &Scene::get_render_info() const
     {
         return _render_info;
@@ -6,16 +6,108 @@
 #include <Camera.h>
 #include <shader_structs.h>
 #include <BoundingTree.h>
+#include <GPUCulling.h>
+#include <Meshlets.h>
+#include <DepthPyramid.h>
+#include <StreamBuffer.h>
+#include <RenderQueue.h>
 
 #include <vector>
 #include <memory>
+#include <unordered_map>
 
 namespace OM3D {
 
+// How the hierarchy follows moving objects
+enum class HierarchyUpdate {
+    // Batched bottom-up refit, once per frame
+    Refit,
+    // Every moved object is removed and inserted again
+    RemoveInsert,
+};
+
+enum class OcclusionMode {
+    Disabled,
+    // Large objects of the previous visible set are rasterized on the CPU
+    Occluders,
+    // The previous visible set is drawn first, the rest is tested against the Hi-Z pyramid of its depth and drawn next
+    TwoPhaseHiZ,
+    // Boxes of hierarchy nodes are tested with hardware occlusion queries, whose results are used in later frames
+    Queries,
+
+    OcclusionMode_Size,
+};
+
 struct RenderInfo {
     size_t objects = 0;
     size_t rendered = 0;
+    // Triangles drawn with the selected levels of detail, and what the same objects cost at full detail
+    size_t triangles = 0;
+    size_t full_detail_triangles = 0;
+    // Objects dropped by the screen size cutoff in the last traversal
+    size_t screen_size_culled = 0;
+    // Instanced batches count as one draw
+    size_t draw_calls = 0;
+    // Transforms and multi-draw commands written to the stream buffer, and how many times it had to grow
+    size_t streamed_bytes = 0;
+    size_t stream_growths = 0;
+    // State bound by the draws of the render queue, and what it avoided
+    RenderQueueStats render_queue;
+
+    // Hierarchical levels of detail: proxies drawn instead of their subtree, and the last build
+    size_t drawn_proxies = 0;
+    size_t hlod_proxies = 0;
+    size_t hlod_proxy_triangles = 0;
+    size_t hlod_cache_hits = 0;
+    double hlod_build_time = 0.0; // ms
+
+    // Meshlet culling: objects drawn by meshlets and their meshlets, then what the last read back found visible in them
+    size_t meshlet_objects = 0;
+    size_t meshlets = 0;
+    size_t meshlet_triangles = 0;
+    size_t visible_meshlets = 0;
+    size_t visible_meshlet_triangles = 0;
+
     size_t checks = 0;
+    size_t plane_tests = 0;
+    // Compared to testing every plane of every reached node, including the whole traversal when the visible set is reused
+    size_t saved_plane_tests = 0;
+    size_t sphere_rejections = 0;
+    size_t sphere_tests = 0;
+    bool reused_visible_set = false;
+    double cull_time = 0.0; // ms
+
+    // Occlusion culling, included in the culling time
+    size_t occluders = 0;
+    size_t occluder_triangles = 0;
+    size_t occlusion_tests = 0;
+    size_t occluded_nodes = 0;
+    double occlusion_time = 0.0; // ms, rasterization of the occluders, or build and read back of the Hi-Z pyramid
+
+    // Two-phase Hi-Z: objects drawn before and after the occlusion test
+    size_t first_phase_objects = 0;
+    size_t second_phase_objects = 0;
+
+    // Occlusion queries: boxes drawn in the queries of the last frame, and the objects below the nodes they kept hidden
+    size_t queries = 0;
+    size_t query_boxes = 0;
+    size_t pending_queries = 0;
+    size_t hidden_nodes = 0;
+    size_t hidden_objects = 0;
+
+    // GPU culling
+    size_t gpu_dispatches = 0;
+    double gpu_upload_time = 0.0; // ms, last upload of the hierarchy
+
+    // Last hierarchy build
+    double build_time = 0.0; // ms
+    float sah_cost = 0.0f;
+
+    // Moving objects
+    size_t moved_objects = 0;
+    double update_time = 0.0; // ms
+    // Since the last build
+    size_t rebuilt_subtrees = 0;
 };
 
 class Scene : NonMovable {
@@ -24,40 +116,182 @@ class Scene : NonMovable {
         Scene();
 
         static Result<std::unique_ptr<Scene>> from_gltf(const std::string& file_name);
+        // Generated scene used to benchmark the hierarchy on large instance counts
+        // Vehicles drive along the streets, see animate_vehicles()
+        static std::unique_ptr<Scene> synthetic(size_t instances, size_t subdivisions = 4, BuildStrategy strategy = BuildStrategy::Median, size_t vehicles = 0);
 
-        void create_bounding_volume_hierarchy(size_t subdivisions = 4);
+        void create_bounding_volume_hierarchy(size_t subdivisions = 4, BuildStrategy strategy = BuildStrategy::Median);
         
         void init_light_buffer();
         void update_frame(const Camera& camera);
         void bind_buffers() const;
 
-        void render(const Camera& camera);
+        // The depth pyramid is needed by OcclusionMode::TwoPhaseHiZ, it must be built from the depth buffer being rendered to
+        void render(const Camera& camera, DepthPyramid *depth_pyramid = nullptr);
         void render_aabb(size_t level);
 
         void add_object(SceneObject obj, std::shared_ptr<SceneObject> *object = nullptr);
         void add_object(PointLight obj);
 
-        void dynamic_add_object(SceneObject obj, size_t subdivisions = 4);
-        void dynamic_remove_object(const std::shared_ptr<SceneObject> &object);
+        // Handles stay valid until the object is removed or the hierarchy is rebuilt
+        InstanceHandle dynamic_add_object(SceneObject obj, size_t subdivisions = 4);
+        void dynamic_remove_object(InstanceHandle handle);
+        const std::shared_ptr<SceneObject> &get_object(InstanceHandle handle) const;
+
+        // With HierarchyUpdate::Refit, the hierarchy is only updated by the next update_hierarchy()
+        void move_object(InstanceHandle handle, const glm::mat4 &transform, HierarchyUpdate update = HierarchyUpdate::Refit);
+        void update_hierarchy();
+        void animate_vehicles(float time, HierarchyUpdate update);
+
+        size_t get_nb_vehicles() const;
+        const std::shared_ptr<SceneObject> &get_vehicle(size_t index) const;
+
+        // Instances of the same mesh content and material, indexed by SceneObject::id. Emptied groups keep their index.
+        const std::vector<std::vector<std::shared_ptr<SceneObject>>> &get_objects() const;
+        const BoundingTree &get_bounding_tree() const;
+        size_t get_bvh_subdivisions() const;
+
+        void set_culling_kernel(CullingKernel kernel);
+        CullingKernel get_culling_kernel() const;
+
+        void set_occlusion_mode(OcclusionMode mode);
+        OcclusionMode get_occlusion_mode() const;
+
+        // Objects whose bounding diameter covers less than this fraction of the screen height are not drawn, 0 disables it
+        void set_min_screen_size(float size);
+        float get_min_screen_size() const;
+
+        // Builds a proxy for the large nodes of the hierarchy, or loads it from the cache, see HlodProxies.
+        // Built in the background, from the first frame rendered with proxies enabled, and swapped in by the first frame after.
+        // A moved object drops the proxies above it. Inserted or removed objects and a new hierarchy drop them all and start a new build.
+        void build_hlod();
+        // Nodes smaller on screen are drawn with their proxy, 0 disables the proxies
+        void set_hlod_screen_size(float size);
+        float get_hlod_screen_size() const;
+        // Proxies are cached there, an empty directory disables the cache. Scenes loaded from a file use a directory next to it.
+        void set_hlod_cache_directory(const std::string &directory);
+
+        // Objects drawn one by one at full detail are culled by meshlet on the GPU, if their mesh has meshlets
+        void set_meshlet_culling(bool enabled);
+        bool get_meshlet_culling() const;
+        // Stalls until the last frame is drawn, and reads how many meshlets were visible
+        void read_meshlet_stats();
+
+        // Culls in a compute shader and draws with indirect commands, the visible set never comes back to the CPU.
+        // The occlusion buffer is not used by this path.
+        void set_gpu_culling(bool enabled);
+        bool get_gpu_culling() const;
+        // Stalls until the last GPU culling is done, returns the visible handles of every group. Empty when the GPU culling is disabled
+        // or when the hierarchy changed since it ran.
+        std::vector<std::vector<u32>> read_gpu_visible_instances();
+
+        // Spatial queries on the hierarchy, see BoundingTree. Objects are given by their handle.
+        bool raycast(const Ray &ray, RayHit &hit) const;
+        bool raycast_any(const Ray &ray) const;
+        void overlap_box(const glm::vec3 &min, const glm::vec3 &max, std::vector<InstanceHandle> &handles) const;
+        void overlap_sphere(const glm::vec3 &center, float radius, std::vector<InstanceHandle> &handles) const;
+        void nearest(const glm::vec3 &point, size_t k, std::vector<InstanceHandle> &handles) const;
+        // Batched queries run on the thread pool. Missed rays get an invalid handle.
+        void raycast(const std::vector<Ray> &rays, std::vector<RayHit> &hits) const;
+        void raycast_any(const std::vector<Ray> &rays, std::vector<u8> &hits) const;
+
+        // Culls several views in one traversal of the hierarchy, see BoundingTree::frustum_cull_views()
+        void cull_views(const std::vector<Frustum> &frustums, std::vector<ViewVisibility> &visible, CullingStats &stats) const;
+        // Orthographic frustums of the sun covering consecutive depth slices of the view, each one four times as deep as the previous
+        std::vector<Frustum> build_shadow_cascades(const Camera &camera, size_t count) const;
 
         const RenderInfo &get_render_info() const;
         const size_t get_nb_lights() const;
 
     private:
+        // Occluders are picked among the objects visible in the previous traversal
+        void rasterize_occluders(const Camera &camera);
+        // Draws the previous visible set and loads the depth it left into the occlusion buffer
+        void render_first_phase(const Camera &camera, DepthPyramid &depth_pyramid);
+        // Picks the level of detail of the visible objects and drops the ones below the screen size cutoff
+        void select_lods(const Camera &camera);
+        // These queue their draws, submit_draws() issues them
+        void render_groups(const std::vector<std::vector<std::shared_ptr<SceneObject>>> &groups);
+        void render_instances(const std::vector<const SceneObject *> &objects);
+        // Proxies selected by the last traversal
+        void render_proxies();
+        void submit_draws();
+        bool hlod_active() const;
+
         std::vector<std::vector<std::shared_ptr<SceneObject>>> _objects;
+        // Groups of _objects of every mesh content and material, see group_key(). Almost always one, more when keys collide.
+        std::unordered_map<u64, std::vector<size_t>> _group_indices;
         std::vector<PointLight> _point_lights;
         TypedBuffer<shader::PointLight> _light_buffer;
         glm::vec3 _sun_direction = glm::vec3(0.2f, 1.0f, 0.1f);
 
         BoundingTree _bounding_tree;
+        size_t _bvh_subdivisions = 4;
+
+        // Position of every instance of the hierarchy in _objects
+        struct InstanceSlot {
+            u32 group;
+            u32 slot;
+        };
+        std::vector<InstanceSlot> _instance_slots;
         size_t _nb_different_objects = 0;
 
+        struct Vehicle {
+            std::shared_ptr<SceneObject> object;
+            glm::vec3 start;
+            float speed;
+        };
+        std::vector<Vehicle> _vehicles;
+        float _street_length = 0.0f;
+
         SceneObject _cube;
+        // Same cube, depth tested
+        SceneObject _query_cube;
 
         // Updated each frame
         TypedBuffer<shader::FrameData> _buffer = TypedBuffer<shader::FrameData>(nullptr, 1);
         Frustum _frustum;
         RenderInfo _render_info;
+
+        CullingKernel _culling_kernel = best_culling_kernel();
+
+        OcclusionBuffer _occlusion_buffer;
+        OcclusionMode _occlusion_mode = OcclusionMode::Disabled;
+
+        float _min_screen_size = 0.0f;
+        // Objects of the group being drawn, by level of detail
+        std::vector<std::vector<const SceneObject *>> _lod_buckets;
+
+        HlodProxies _hlod;
+        float _hlod_screen_size = 0.0f;
+        std::string _hlod_cache_directory;
+        // The nodes changed since the last build started, rendering with proxies enabled starts a new one
+        bool _hlod_dirty = true;
+
+        // Indexed by handle, set for the objects of the first phase
+        std::vector<u8> _first_phase_objects;
+        std::vector<float> _pyramid_depths;
+
+        OcclusionQueries _occlusion_queries;
+        // Cleared whenever node indices may change
+        bool _query_state_valid = false;
+
+        MeshletCulling _meshlet_culling;
+        // Transforms of the instanced batches
+        StreamBuffer _instance_stream;
+        RenderQueue _render_queue;
+        bool _meshlet_culling_enabled = true;
+
+        GPUCulling _gpu_culling;
+        bool _gpu_culling_enabled = false;
+        // Cleared whenever the hierarchy changes, the GPU copy is uploaded again before the next culling
+        bool _gpu_hierarchy_valid = false;
+
+        // Visible set of the last traversal, reused as long as the view and the hierarchy do not change
+        std::vector<std::vector<std::shared_ptr<SceneObject>>> _visible_objects;
+        glm::mat4 _culled_view_proj = glm::mat4(0.0f);
+        bool _visible_objects_valid = false;
+        size_t _last_traversal_plane_tests = 0;
 };
 
 }
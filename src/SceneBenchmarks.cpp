@@ -0,0 +1,269 @@
+#include "SceneBenchmarks.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <iterator>
+#include <random>
+#include <unordered_set>
+
+namespace OM3D
+{
+    // Distinct meshes and materials of the loading benchmark, every mesh is also loaded a second time as another StaticMesh
+    static constexpr size_t benchmark_meshes = 1000;
+    static constexpr size_t benchmark_materials = 10;
+
+    // Flat disk of the given number of triangles, meshes of the same size differ by their color
+    static MeshData disk_mesh_data(u32 triangles, glm::vec3 color)
+    {
+        Vertex center = {};
+        center.normal = glm::vec3(0.0f, 1.0f, 0.0f);
+        center.color = color;
+
+        MeshData data;
+        data.vertices.push_back(center);
+        for (u32 i = 0; i <= triangles; i++)
+        {
+            const float angle = 2.0f * glm::pi<float>() * float(i) / float(triangles);
+            Vertex v = center;
+            v.position = glm::vec3(std::cos(angle), 0.0f, std::sin(angle));
+            data.vertices.push_back(v);
+        }
+        for (u32 i = 0; i < triangles; i++)
+            data.indices.insert(data.indices.end(), {0, i + 2, i + 1});
+        return data;
+    }
+
+    // Visible instances of every group of the scene
+    static std::vector<std::vector<std::shared_ptr<SceneObject>>> cull(const Scene &scene, const Frustum &frustum, CullingStats &stats)
+    {
+        std::vector<std::vector<std::shared_ptr<SceneObject>>> visible(scene.get_objects().size());
+        scene.get_bounding_tree().frustum_cull(visible, frustum, stats, scene.get_culling_kernel());
+        return visible;
+    }
+
+    void run_soak_test(Scene &scene, size_t operations, const Camera &camera, BenchmarkResults &results)
+    {
+        // Vehicles are left alone, they are moved every frame
+        std::unordered_set<const SceneObject *> vehicles;
+        for (size_t i = 0; i < scene.get_nb_vehicles(); i++)
+            vehicles.insert(scene.get_vehicle(i).get());
+
+        std::vector<InstanceHandle> handles;
+        for (const auto &v : scene.get_objects())
+        {
+            for (const auto &o : v)
+            {
+                if (!vehicles.count(o.get()))
+                    handles.push_back(o->handle);
+            }
+        }
+
+        results.soak_checks.clear();
+        results.soak_sah_cost.clear();
+        if (handles.empty())
+            return;
+
+        std::mt19937 rng(0x50A4);
+        std::uniform_real_distribution<float> jitter(-2.0f, 2.0f);
+
+        const Frustum frustum = camera.build_frustum();
+        const size_t sample_interval = std::max(operations / 20, size_t(1));
+
+        for (size_t op = 0; op <= operations; op++)
+        {
+            if (op % sample_interval == 0 || op == operations)
+            {
+                CullingStats stats;
+                cull(scene, frustum, stats);
+
+                results.soak_checks.push_back(float(stats.checks));
+                results.soak_sah_cost.push_back(scene.get_bounding_tree().sah_cost());
+            }
+
+            if (op == operations)
+                break;
+
+            // The new object takes the place of another random object, slightly moved
+            const size_t removed = rng() % handles.size();
+            const SceneObject &model = *scene.get_object(handles[rng() % handles.size()]);
+            const SceneObject &old_object = *scene.get_object(handles[removed]);
+
+            SceneObject object(old_object.get_mesh(), old_object.get_material());
+            object.set_transform(glm::translate(glm::mat4(1.0f), glm::vec3(jitter(rng), 0.0f, jitter(rng))) * model.transform());
+
+            scene.dynamic_remove_object(handles[removed]);
+            handles[removed] = scene.dynamic_add_object(std::move(object), scene.get_bvh_subdivisions());
+        }
+    }
+
+    void compare_builders(const Scene &scene, BenchmarkResults &results)
+    {
+        std::vector<std::shared_ptr<SceneObject>> instances;
+        for (const auto &group : scene.get_objects())
+        {
+            instances.insert(instances.end(), group.begin(), group.end());
+        }
+
+        results.builder_times.clear();
+        results.builder_sah_costs.clear();
+
+        for (int strategy = 0; strategy < int(BuildStrategy::BuildStrategy_Size); strategy++)
+        {
+            BoundingTree tree;
+            const double build_start = program_time();
+            tree.build(instances, scene.get_bvh_subdivisions(), BuildStrategy(strategy), &ThreadPool::global());
+            results.builder_times.push_back((program_time() - build_start) * 1000.0);
+            results.builder_sah_costs.push_back(tree.sah_cost());
+        }
+    }
+
+    void verify_gpu_culling(Scene &scene, const Camera &camera, BenchmarkResults &results)
+    {
+        results.gpu_visible = 0;
+        results.gpu_mismatches = 0;
+
+        std::vector<std::vector<u32>> gpu_visible = scene.read_gpu_visible_instances();
+        if (gpu_visible.empty())
+            return;
+
+        CullingStats stats;
+        const std::vector<std::vector<std::shared_ptr<SceneObject>>> cpu_visible = cull(scene, camera.build_frustum(), stats);
+
+        // Instances missing from either side
+        for (size_t group = 0; group < gpu_visible.size(); group++)
+        {
+            std::vector<u32> &gpu = gpu_visible[group];
+            std::vector<u32> cpu;
+            if (group < cpu_visible.size())
+            {
+                for (const std::shared_ptr<SceneObject> &object : cpu_visible[group])
+                    cpu.push_back(object->handle);
+            }
+
+            std::sort(gpu.begin(), gpu.end());
+            std::sort(cpu.begin(), cpu.end());
+            std::vector<u32> difference;
+            std::set_symmetric_difference(gpu.begin(), gpu.end(), cpu.begin(), cpu.end(), std::back_inserter(difference));
+
+            results.gpu_visible += gpu.size();
+            results.gpu_mismatches += difference.size();
+        }
+    }
+
+    void benchmark_rays(const Scene &scene, const Camera &camera, size_t count, BenchmarkResults &results)
+    {
+        // Points are unprojected at an arbitrary depth, the projection has no far plane
+        const glm::mat4 inv_view_proj = glm::inverse(camera.view_proj_matrix());
+        const glm::vec3 origin = camera.position();
+
+        std::mt19937 rng(0x0A3D);
+        std::uniform_real_distribution<float> ndc(-1.0f, 1.0f);
+        std::vector<Ray> rays(count);
+        for (Ray &ray : rays)
+        {
+            const glm::vec4 point = inv_view_proj * glm::vec4(ndc(rng), ndc(rng), 0.5f, 1.0f);
+            ray.origin = origin;
+            ray.direction = glm::normalize(glm::vec3(point) / point.w - origin);
+        }
+
+        // Triangle trees are built on first use, they are not part of the timing
+        for (const auto &group : scene.get_objects())
+        {
+            if (!group.empty())
+                group.front()->get_mesh()->triangle_tree();
+        }
+
+        std::vector<RayHit> hits;
+        const double closest_start = program_time();
+        scene.raycast(rays, hits);
+        results.closest_hit_time = (program_time() - closest_start) * 1000.0;
+
+        std::vector<u8> any_hits;
+        const double any_start = program_time();
+        scene.raycast_any(rays, any_hits);
+        results.any_hit_time = (program_time() - any_start) * 1000.0;
+
+        results.rays = count;
+        results.ray_hits = std::count_if(hits.begin(), hits.end(), [](const RayHit &hit) { return hit.handle != BoundingTree::invalid_index; });
+    }
+
+    void benchmark_multi_view(const Scene &scene, const Camera &camera, size_t cascades, BenchmarkResults &results)
+    {
+        std::vector<Frustum> frustums = { camera.build_frustum() };
+        const std::vector<Frustum> shadow_cascades = scene.build_shadow_cascades(camera, std::min(cascades, BoundingTree::max_views - 1));
+        frustums.insert(frustums.end(), shadow_cascades.begin(), shadow_cascades.end());
+
+        size_t handle_count = 0;
+        for (const auto &group : scene.get_objects())
+        {
+            for (const std::shared_ptr<SceneObject> &object : group)
+                handle_count = std::max(handle_count, size_t(object->handle) + 1);
+        }
+
+        // Views of every handle, from one traversal per view
+        std::vector<u32> separate_views(handle_count, 0);
+        CullingStats separate_stats;
+        const double separate_start = program_time();
+        for (u32 v = 0; v < frustums.size(); v++)
+        {
+            for (const auto &group : cull(scene, frustums[v], separate_stats))
+            {
+                for (const std::shared_ptr<SceneObject> &object : group)
+                    separate_views[object->handle] |= 1u << v;
+            }
+        }
+        results.separate_view_time = (program_time() - separate_start) * 1000.0;
+
+        std::vector<ViewVisibility> visible;
+        CullingStats multi_stats;
+        const double multi_start = program_time();
+        scene.cull_views(frustums, visible, multi_stats);
+        results.multi_view_time = (program_time() - multi_start) * 1000.0;
+
+        std::vector<u32> multi_views(separate_views.size(), 0);
+        for (const ViewVisibility &instance : visible)
+            multi_views[instance.handle] = instance.views;
+
+        results.views = frustums.size();
+        results.multi_view_visible = visible.size();
+        results.separate_view_checks = separate_stats.checks;
+        results.multi_view_checks = multi_stats.checks;
+        results.multi_view_mismatches = 0;
+        for (size_t handle = 0; handle < multi_views.size(); handle++)
+            results.multi_view_mismatches += multi_views[handle] != separate_views[handle];
+    }
+
+    void benchmark_loading(size_t objects, BenchmarkResults &results)
+    {
+        std::vector<std::shared_ptr<StaticMesh>> meshes;
+        for (size_t i = 0; i < benchmark_meshes; i++)
+        {
+            const MeshData data = disk_mesh_data(u32(i % 100 + 1), glm::vec3(float(i) / float(benchmark_meshes), 0.5f, 1.0f));
+            meshes.push_back(std::make_shared<StaticMesh>(data));
+            meshes.push_back(std::make_shared<StaticMesh>(data));
+        }
+        std::vector<std::shared_ptr<Material>> materials;
+        for (size_t i = 0; i < benchmark_materials; i++)
+            materials.push_back(std::make_shared<Material>(Material::aabb_material()));
+
+        std::vector<SceneObject> loaded;
+        loaded.reserve(objects);
+        for (size_t i = 0; i < objects; i++)
+        {
+            loaded.emplace_back(meshes[i % meshes.size()], materials[(i / meshes.size()) % benchmark_materials]);
+            loaded.back().set_transform(glm::translate(glm::mat4(1.0f), glm::vec3(float(i % 1000), 0.0f, float(i / 1000))));
+        }
+
+        // Only adding the objects is timed, not building their meshes
+        auto scene = std::make_unique<Scene>();
+        const double start = program_time();
+        for (SceneObject &object : loaded)
+            scene->add_object(std::move(object));
+        results.load_time = (program_time() - start) * 1000.0;
+
+        results.load_objects = objects;
+        results.load_groups = scene->get_objects().size();
+    }
+
+}
@@ -0,0 +1,62 @@
+#ifndef SCENEBENCHMARKS_H
+#define SCENEBENCHMARKS_H
+
+#include <Scene.h>
+
+#include <vector>
+
+namespace OM3D {
+
+// Tests and benchmarks of the hierarchy, run on demand through the public API of Scene. Every one fills its part of the results.
+struct BenchmarkResults {
+    // GPU culling: the instances found visible by the last verification, and how many differ from the CPU traversal
+    size_t gpu_visible = 0;
+    size_t gpu_mismatches = 0;
+
+    // Last multi-view benchmark: the camera and the shadow cascades of the sun, culled by one traversal per view then by a single one
+    size_t views = 0;
+    // Instances visible in at least one view
+    size_t multi_view_visible = 0;
+    size_t separate_view_checks = 0;
+    size_t multi_view_checks = 0;
+    double separate_view_time = 0.0; // ms
+    double multi_view_time = 0.0; // ms
+    // Instances whose views differ between both
+    size_t multi_view_mismatches = 0;
+
+    // Last ray benchmark, closest hits then any hits of the same rays
+    size_t rays = 0;
+    size_t ray_hits = 0;
+    double closest_hit_time = 0.0; // ms
+    double any_hit_time = 0.0; // ms
+
+    // Last loading benchmark, objects added to groups of instances
+    size_t load_objects = 0;
+    size_t load_groups = 0;
+    double load_time = 0.0; // ms
+
+    // Sampled during the last soak test
+    std::vector<float> soak_checks;
+    std::vector<float> soak_sah_cost;
+
+    // Every builder on the current objects, indexed by BuildStrategy
+    std::vector<double> builder_times; // ms
+    std::vector<float> builder_sah_costs;
+};
+
+// Replaces random objects with dynamic removals and insertions, and samples the culling cost of the view
+void run_soak_test(Scene &scene, size_t operations, const Camera &camera, BenchmarkResults &results);
+// Builds a separate hierarchy with every strategy, the scene keeps its own
+void compare_builders(const Scene &scene, BenchmarkResults &results);
+// Reads back the result of the last GPU culling and compares it with a CPU traversal of the camera it was rendered with
+void verify_gpu_culling(Scene &scene, const Camera &camera, BenchmarkResults &results);
+// Casts rays through random points of the view with both batched queries
+void benchmark_rays(const Scene &scene, const Camera &camera, size_t count, BenchmarkResults &results);
+// Culls the view and its shadow cascades with one traversal per view, then with a single traversal
+void benchmark_multi_view(const Scene &scene, const Camera &camera, size_t cascades, BenchmarkResults &results);
+// Adds objects of many meshes and materials to a new scene, some meshes are different objects of the same data
+void benchmark_loading(size_t objects, BenchmarkResults &results);
+
+}
+
+#endif // SCENEBENCHMARKS_H
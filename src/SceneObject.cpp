@@ -1,12 +1,16 @@
 #include "SceneObject.h"
 
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtx/norm.hpp>
+
+#include <algorithm>
 
 namespace OM3D {
 
 SceneObject::SceneObject(std::shared_ptr<StaticMesh> mesh, std::shared_ptr<Material> material) :
     _mesh(std::move(mesh)),
     _material(std::move(material)) {
+    update_bounds();
 }
 
 void SceneObject::render() const {
@@ -16,8 +20,10 @@ void SceneObject::render() const {
 
     _material->set_uniform(HASH("model"), transform());
     _material->set_uniform(HASH("instanced"), 0u);
+    _material->set_uniform(HASH("indirect"), 0u);
     _material->bind();
-    _mesh->draw();
+    _mesh->bind();
+    _mesh->draw(lod);
 }
 
 void SceneObject::render(int nb_instances) const {
@@ -26,8 +32,10 @@ void SceneObject::render(int nb_instances) const {
     }
 
     _material->set_uniform(HASH("instanced"), 1u);
+    _material->set_uniform(HASH("indirect"), 0u);
     _material->bind();
-    _mesh->draw(nb_instances);
+    _mesh->bind();
+    _mesh->draw(nb_instances, lod);
 }
 
 void SceneObject::render(const glm::mat4 &trnsfrm) const {
@@ -37,33 +45,88 @@ void SceneObject::render(const glm::mat4 &trnsfrm) const {
 
     _material->set_uniform(HASH("model"), trnsfrm);
     _material->set_uniform(HASH("instanced"), 0u);
+    _material->set_uniform(HASH("indirect"), 0u);
     _material->bind();
+    _mesh->bind();
     _mesh->draw();
 }
 
+void SceneObject::render_indirect(size_t command_offset) const {
+    if(!_material || !_mesh) {
+        return;
+    }
+
+    _material->set_uniform(HASH("indirect"), 1u);
+    _material->bind();
+    _mesh->bind();
+    _mesh->draw_indirect(command_offset);
+}
+
+void SceneObject::render_meshlets() const {
+    if(!_material || !_mesh) {
+        return;
+    }
+
+    _material->set_uniform(HASH("model"), transform());
+    _material->set_uniform(HASH("instanced"), 0u);
+    _material->set_uniform(HASH("indirect"), 0u);
+    _material->bind();
+    _mesh->bind();
+    _mesh->draw_meshlets();
+}
+
 void SceneObject::set_transform(const glm::mat4 &tr) {
     _transform = tr;
+    update_bounds();
+}
+
+void SceneObject::update_bounds() {
+    const glm::vec3 position = glm::vec3(_transform[3]);
+    if (!_mesh) {
+        _aabb = { position, position };
+        _bounding_sphere = { position, 0.0f };
+        return;
+    }
+
+    // Arvo: the extents of the transformed box are the absolute value of the linear part applied to the local extents
+    const auto &[min, max] = _mesh->get_aabb();
+    const glm::vec3 center = glm::vec3(_transform * glm::vec4((min + max) * 0.5f, 1.0f));
+    const glm::vec3 extent = (max - min) * 0.5f;
+    const glm::vec3 world_extent = glm::abs(glm::vec3(_transform[0])) * extent.x
+                                 + glm::abs(glm::vec3(_transform[1])) * extent.y
+                                 + glm::abs(glm::vec3(_transform[2])) * extent.z;
+    _aabb = { center - world_extent, center + world_extent };
+
+    // Without shear the largest axis scale bounds the scale of the radius, otherwise the Frobenius norm does
+    const glm::vec3 x = glm::vec3(_transform[0]);
+    const glm::vec3 y = glm::vec3(_transform[1]);
+    const glm::vec3 z = glm::vec3(_transform[2]);
+    const float length2_sum = glm::length2(x) + glm::length2(y) + glm::length2(z);
+    const float shear = std::abs(glm::dot(x, y)) + std::abs(glm::dot(y, z)) + std::abs(glm::dot(z, x));
+    const float scale2 = shear > 1e-4f * length2_sum ? length2_sum : std::max(glm::length2(x), std::max(glm::length2(y), glm::length2(z)));
+
+    const BoundingSphere &sphere = _mesh->get_bounding_sphere();
+    _bounding_sphere = { glm::vec3(_transform * glm::vec4(sphere.origin, 1.0f)), sphere.radius * std::sqrt(scale2) };
 }
 
 const glm::mat4& SceneObject::transform() const {
     return _transform;
 }
 
+const std::shared_ptr<StaticMesh>& SceneObject::get_mesh() const {
+    return _mesh;
+}
+
 const std::shared_ptr<Material>& SceneObject::get_material() const {
     return _material;
 }
 
-std::pair<glm::vec3, glm::vec3> SceneObject::get_aabb() const {
-
-    auto coords = _mesh->get_aabb();
-    
-    // Change the AABB depending on the scale and position of the object
-    const glm::mat4 &t = transform();
-    const glm::vec3 position = glm::vec3(t[3].x, t[3].y, t[3].z);
-
-    glm::vec3 scale = { glm::length(t[0]), glm::length(t[1]), glm::length(t[2]) };
+const std::pair<glm::vec3, glm::vec3> &SceneObject::get_aabb() const {
+    return _aabb;
+}
 
-    return { coords.first * scale + position, coords.second * scale + position };
+const BoundingSphere &SceneObject::get_bounding_sphere() const {
+    return _bounding_sphere;
 }
 
 bool SceneObject::operator==(const SceneObject& other) const {
@@ -15,23 +15,39 @@ class SceneObject : NonCopyable {
     public:
         SceneObject(std::shared_ptr<StaticMesh> mesh = nullptr, std::shared_ptr<Material> material = nullptr);
 
+        // Both draw the level of detail in lod
         void render() const;
         void render(int nb_instances) const;
         void render(const glm::mat4 &trnsfrm) const;
+        // Instances come from the visible instance attribute, see GPUCulling::draw()
+        void render_indirect(size_t command_offset) const;
+        // Full detail, the commands of the meshlets must have been written by MeshletCulling::cull()
+        void render_meshlets() const;
 
         void set_transform(const glm::mat4& tr);
         const glm::mat4& transform() const;
 
+        const std::shared_ptr<StaticMesh> &get_mesh() const;
         const std::shared_ptr<Material> &get_material() const;
-        std::pair<glm::vec3, glm::vec3> get_aabb() const;
+        // World bounds, updated by set_transform()
+        const std::pair<glm::vec3, glm::vec3> &get_aabb() const;
+        const BoundingSphere &get_bounding_sphere() const;
 
         bool operator==(const SceneObject& other) const;
 
         // Instanciation ID to sort objects during frustum culling
         size_t id = 0;
+        // Handle of the instance in the scene hierarchy
+        u32 handle = u32(-1);
+        // Level of detail of the mesh, picked from the size on screen during culling
+        u32 lod = 0;
 
     private:
+        void update_bounds();
+
         glm::mat4 _transform = glm::mat4(1.0f);
+        std::pair<glm::vec3, glm::vec3> _aabb = {};
+        BoundingSphere _bounding_sphere = {};
 
         std::shared_ptr<StaticMesh> _mesh;
         std::shared_ptr<Material> _material;
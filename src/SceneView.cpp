@@ -17,9 +17,9 @@ void SceneView::update_frame() {
     _scene->update_frame(_camera);
 }
 
-void SceneView::render() const {
+void SceneView::render(DepthPyramid *depth_pyramid) const {
     if(_scene) {
-        _scene->render(_camera);
+        _scene->render(_camera, depth_pyramid);
     }
 }
 
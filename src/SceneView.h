@@ -15,7 +15,7 @@ class SceneView {
 
         void update_frame();
 
-        void render() const;
+        void render(DepthPyramid *depth_pyramid = nullptr) const;
         void compute_lights(Material &m, const glm::uvec2 &window_size) const;
 
     private:
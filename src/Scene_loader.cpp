@@ -1,11 +1,16 @@
 #include "Scene.h"
 #include "StaticMesh.h"
+#include "MeshSimplification.h"
+#include "Meshlets.h"
 
 #include <glm/gtc/quaternion.hpp>
 
 #include <utils.h>
 
+#include <cstring>
+#include <filesystem>
 #include <iostream>
+#include <map>
 
 #define TINYGLTF_IMPLEMENTATION
 #define TINYGLTF_NO_STB_IMAGE_WRITE
@@ -181,7 +186,10 @@ static Result<MeshData> build_mesh_data(const tinygltf::Model& gltf, const tinyg
         }
     }
 
-    return {true, MeshData{std::move(vertices), std::move(indices)}};
+    MeshData mesh;
+    mesh.vertices = std::move(vertices);
+    mesh.indices = std::move(indices);
+    return {true, std::move(mesh)};
 }
 
 static Result<TextureData> build_texture_data(const tinygltf::Image& image, bool as_sRGB) {
@@ -285,6 +293,23 @@ static void compute_tangents(MeshData& mesh) {
     }
 }
 
+namespace {
+
+// Mesh built from a primitive, with the indices the primitive had before build_lods() and build_meshlets() reordered them
+struct LoadedMesh {
+    std::vector<u32> source_indices;
+    std::shared_ptr<StaticMesh> mesh;
+};
+
+}
+
+// Vertices are not changed by the processing, only the indices are
+static bool same_geometry(const MeshData& data, const LoadedMesh& loaded) {
+    const std::vector<Vertex>& vertices = loaded.mesh->get_vertices();
+    return data.indices == loaded.source_indices && data.vertices.size() == vertices.size()
+        && std::memcmp(data.vertices.data(), vertices.data(), data.vertices.size() * sizeof(Vertex)) == 0;
+}
+
 Result<std::unique_ptr<Scene>> Scene::from_gltf(const std::string& file_name) {
     const double time = program_time();
     DEFER(std::cout << file_name << " loaded in " << std::round((program_time() - time) * 100.0) / 100.0 << "s" << std::endl);
@@ -321,6 +346,12 @@ Result<std::unique_ptr<Scene>> Scene::from_gltf(const std::string& file_name) {
     std::unordered_map<int, std::shared_ptr<Material>> materials;
     std::unordered_map<int, glm::mat4> node_transforms;
 
+    // A glTF mesh used by several nodes is only built once, and primitives with the same data share one StaticMesh,
+    // so one range of the geometry pool and one group of instances per material
+    std::map<std::pair<int, size_t>, std::shared_ptr<StaticMesh>> primitive_meshes;
+    std::unordered_map<u64, std::vector<LoadedMesh>> content_meshes;
+    size_t primitive_count = 0;
+
     {
         std::vector<int> node_indices;
         if(gltf.defaultScene >= 0) {
@@ -352,13 +383,33 @@ Result<std::unique_ptr<Scene>> Scene::from_gltf(const std::string& file_name) {
                 continue;
             }
 
-            auto mesh = build_mesh_data(gltf, prim);
-            if(!mesh.is_ok) {
-                return {false, {}};
-            }
+            ++primitive_count;
+            auto& static_mesh = primitive_meshes[{node.mesh, j}];
+            if(!static_mesh) {
+                auto mesh = build_mesh_data(gltf, prim);
+                if(!mesh.is_ok) {
+                    return {false, {}};
+                }
 
-            if(mesh.value.vertices[0].tangent_bitangent_sign == glm::vec4(0.0f)) {
-                compute_tangents(mesh.value);
+                if(mesh.value.vertices[0].tangent_bitangent_sign == glm::vec4(0.0f)) {
+                    compute_tangents(mesh.value);
+                }
+
+                auto& candidates = content_meshes[mesh.value.content_hash()];
+                for(const LoadedMesh& candidate : candidates) {
+                    if(same_geometry(mesh.value, candidate)) {
+                        static_mesh = candidate.mesh;
+                        break;
+                    }
+                }
+
+                if(!static_mesh) {
+                    std::vector<u32> source_indices = mesh.value.indices;
+                    build_lods(mesh.value);
+                    build_meshlets(mesh.value);
+                    static_mesh = std::make_shared<StaticMesh>(mesh.value);
+                    candidates.push_back({ std::move(source_indices), static_mesh });
+                }
             }
 
             std::shared_ptr<Material> material;
@@ -411,12 +462,19 @@ Result<std::unique_ptr<Scene>> Scene::from_gltf(const std::string& file_name) {
                 material = mat;
             }
 
-            auto scene_object = SceneObject(std::make_shared<StaticMesh>(mesh.value), std::move(material));
+            auto scene_object = SceneObject(static_mesh, std::move(material));
             scene_object.set_transform(node_transform);
             scene->add_object(std::move(scene_object));
         }
     }
 
+    size_t unique_meshes = 0;
+    for(const auto& [hash, candidates] : content_meshes) {
+        unique_meshes += candidates.size();
+    }
+    std::cout << primitive_count << " primitives share " << unique_meshes << " meshes" << std::endl;
+
+    scene->set_hlod_cache_directory((std::filesystem::path(file_name).parent_path() / "hlod_cache").string());
     scene->create_bounding_volume_hierarchy();
     scene->init_light_buffer();
 
@@ -3,12 +3,47 @@
 #include <glad/glad.h>
 #include <glm/gtx/norm.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
 namespace OM3D {
 
+static std::vector<u32> concatenate_lods(const MeshData& data) {
+    std::vector<u32> indices = data.indices;
+    for (const std::vector<u32> &lod : data.lods) {
+        indices.insert(indices.end(), lod.begin(), lod.end());
+    }
+    return indices;
+}
+
+u64 MeshData::content_hash() const {
+    u64 hash = OM3D::content_hash(vertices.data(), vertices.size() * sizeof(Vertex));
+    hash = OM3D::content_hash(indices.data(), indices.size() * sizeof(u32), hash);
+    for (const std::vector<u32> &lod : lods) {
+        hash = OM3D::content_hash(lod.data(), lod.size() * sizeof(u32), hash);
+    }
+    return hash;
+}
+
 StaticMesh::StaticMesh(const MeshData& data) :
-    _vertex_buffer(data.vertices),
-    _index_buffer(data.indices) {
+    _geometry(data.vertices, concatenate_lods(data)),
+    _meshlets(data.meshlets),
+    _vertices(data.vertices),
+    _indices(data.indices),
+    _lod_indices(data.lods),
+    _content_hash(data.content_hash()) {
     
+    _lods.push_back({ 0, u32(data.indices.size()) });
+    for (const std::vector<u32> &lod : data.lods) {
+        _lods.push_back({ _lods.back().first_index + _lods.back().index_count, u32(lod.size()) });
+    }
+
+    if (!_meshlets.empty()) {
+        _meshlet_buffer = TypedBuffer<shader::Meshlet>(_meshlets);
+        _meshlet_commands = TypedBuffer<shader::DrawElementsIndirectCommand>(nullptr, _meshlets.size());
+    }
+
     auto &vert = data.vertices;
 
     _min_coords = vert[0].position;
@@ -33,76 +68,122 @@ StaticMesh::StaticMesh(const MeshData& data) :
         else if (_max_coords.z < pos.z)
             _max_coords.z = pos.z;
     }
+
+    _bounding_sphere.origin = (_min_coords + _max_coords) * 0.5f;
+    float radius2 = 0.0f;
+    for (const Vertex &v : _vertices) {
+        radius2 = std::max(radius2, glm::distance2(v.position, _bounding_sphere.origin));
+    }
+    _bounding_sphere.radius = std::sqrt(radius2);
 }
 
-void StaticMesh::draw() const {
-    _vertex_buffer.bind(BufferUsage::Attribute);
-    _index_buffer.bind(BufferUsage::Index);
+void StaticMesh::bind() const {
+    GeometryPool::current().bind();
+}
 
-    // Vertex position
-    glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(Vertex), nullptr);
-    // Vertex normal
-    glVertexAttribPointer(1, 3, GL_FLOAT, false, sizeof(Vertex), reinterpret_cast<void*>(3 * sizeof(float)));
-    // Vertex uv
-    glVertexAttribPointer(2, 2, GL_FLOAT, false, sizeof(Vertex), reinterpret_cast<void*>(6 * sizeof(float)));
-    // Tangent / bitangent sign
-    glVertexAttribPointer(3, 4, GL_FLOAT, false, sizeof(Vertex), reinterpret_cast<void*>(8 * sizeof(float)));
-    // Vertex color
-    glVertexAttribPointer(4, 3, GL_FLOAT, false, sizeof(Vertex), reinterpret_cast<void*>(12 * sizeof(float)));
+void StaticMesh::draw(u32 lod) const {
+    const LodRange &range = _lods[std::min(lod, lod_count() - 1)];
+    const GeometryRange geometry = _geometry.range();
+    glDrawElementsBaseVertex(GL_TRIANGLES, int(range.index_count), GL_UNSIGNED_INT, reinterpret_cast<void*>((geometry.first_index + range.first_index) * sizeof(u32)),
+                             int(geometry.first_vertex));
+}
 
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
-    glEnableVertexAttribArray(3);
-    glEnableVertexAttribArray(4);
+void StaticMesh::draw(int nb_instances, u32 lod) const {
+    const LodRange &range = _lods[std::min(lod, lod_count() - 1)];
+    const GeometryRange geometry = _geometry.range();
+    glDrawElementsInstancedBaseVertex(GL_TRIANGLES, int(range.index_count), GL_UNSIGNED_INT, reinterpret_cast<void*>((geometry.first_index + range.first_index) * sizeof(u32)),
+                                      nb_instances, int(geometry.first_vertex));
+}
 
-    glDrawElements(GL_TRIANGLES, int(_index_buffer.element_count()), GL_UNSIGNED_INT, nullptr);
+void StaticMesh::draw_indirect(size_t command_offset) const {
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, reinterpret_cast<void*>(command_offset), 1, 0);
 }
 
-void StaticMesh::draw(int nb_instances) const {
-    _vertex_buffer.bind(BufferUsage::Attribute);
-    _index_buffer.bind(BufferUsage::Index);
+void StaticMesh::draw_meshlets() const {
+    _meshlet_commands.bind(BufferUsage::Indirect);
 
-    // Vertex position
-    glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(Vertex), nullptr);
-    // Vertex normal
-    glVertexAttribPointer(1, 3, GL_FLOAT, false, sizeof(Vertex), reinterpret_cast<void*>(3 * sizeof(float)));
-    // Vertex uv
-    glVertexAttribPointer(2, 2, GL_FLOAT, false, sizeof(Vertex), reinterpret_cast<void*>(6 * sizeof(float)));
-    // Tangent / bitangent sign
-    glVertexAttribPointer(3, 4, GL_FLOAT, false, sizeof(Vertex), reinterpret_cast<void*>(8 * sizeof(float)));
-    // Vertex color
-    glVertexAttribPointer(4, 3, GL_FLOAT, false, sizeof(Vertex), reinterpret_cast<void*>(12 * sizeof(float)));
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, int(_meshlets.size()), 0);
+}
 
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
-    glEnableVertexAttribArray(3);
-    glEnableVertexAttribArray(4);
+u32 StaticMesh::index_count() const {
+    return _lods.front().index_count;
+}
 
-    //glDrawElements(GL_TRIANGLES, int(_index_buffer.element_count()), GL_UNSIGNED_INT, nullptr);
-    glDrawElementsInstanced(GL_TRIANGLES, int(_index_buffer.element_count()), GL_UNSIGNED_INT, nullptr, nb_instances);
+u32 StaticMesh::lod_count() const {
+    return u32(_lods.size());
 }
 
-bool StaticMesh::operator==(const StaticMesh& other) const {
-    return _vertex_buffer.element_count() == other._vertex_buffer.element_count()
-        && _index_buffer.element_count() == other._index_buffer.element_count();
+u32 StaticMesh::lod_triangle_count(u32 lod) const {
+    return _lods[std::min(lod, lod_count() - 1)].index_count / 3;
 }
 
-void StaticMesh::draw_light_volume() const {
-    _vertex_buffer.bind(BufferUsage::Attribute);
-    _index_buffer.bind(BufferUsage::Index);
+u32 StaticMesh::meshlet_count() const {
+    return u32(_meshlets.size());
+}
 
-    // Vertex position
-    glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(Vertex), nullptr);
+const std::vector<shader::Meshlet> &StaticMesh::get_meshlets() const {
+    return _meshlets;
+}
 
-    glEnableVertexAttribArray(0);
+const TypedBuffer<shader::Meshlet> &StaticMesh::meshlet_buffer() const {
+    return _meshlet_buffer;
+}
 
-    glDrawElements(GL_TRIANGLES, int(_index_buffer.element_count()), GL_UNSIGNED_INT, nullptr);
+const TypedBuffer<shader::DrawElementsIndirectCommand> &StaticMesh::meshlet_commands() const {
+    return _meshlet_commands;
+}
+
+// The hash rules out almost every different mesh, the contents are only compared when it matches
+bool StaticMesh::operator==(const StaticMesh& other) const {
+    if (this == &other) {
+        return true;
+    }
+    if (_content_hash != other._content_hash || _vertices.size() != other._vertices.size() || _indices != other._indices
+        || _lod_indices != other._lod_indices) {
+        return false;
+    }
+    return std::memcmp(_vertices.data(), other._vertices.data(), _vertices.size() * sizeof(Vertex)) == 0;
+}
+
+u64 StaticMesh::content_hash() const {
+    return _content_hash;
+}
+
+void StaticMesh::draw_light_volume() const {
+    bind();
+    draw();
+}
+
+shader::DrawElementsIndirectCommand StaticMesh::draw_command(u32 lod, u32 base_instance) const {
+    const LodRange &range = _lods[std::min(lod, lod_count() - 1)];
+    const GeometryRange geometry = _geometry.range();
+    return { range.index_count, 1, geometry.first_index + range.first_index, int(geometry.first_vertex), base_instance };
 }
 
 std::pair<glm::vec3, glm::vec3> StaticMesh::get_aabb() const {
     return { _min_coords, _max_coords };
 }
 
+const BoundingSphere &StaticMesh::get_bounding_sphere() const {
+    return _bounding_sphere;
+}
+
+const std::vector<Vertex> &StaticMesh::get_vertices() const {
+    return _vertices;
+}
+
+const std::vector<u32> &StaticMesh::get_indices() const {
+    return _indices;
+}
+
+const std::vector<u32> &StaticMesh::get_lod_indices(u32 lod) const {
+    lod = std::min(lod, lod_count() - 1);
+    return lod ? _lod_indices[lod - 1] : _indices;
+}
+
+const TriangleTree &StaticMesh::triangle_tree() const {
+    std::call_once(_triangle_tree->built, [this] { _triangle_tree->tree = TriangleTree(_vertices, _indices); });
+    return _triangle_tree->tree;
+}
+
 }
@@ -3,8 +3,13 @@
 
 #include <graphics.h>
 #include <TypedBuffer.h>
+#include <GeometryPool.h>
 #include <Vertex.h>
+#include <TriangleTree.h>
+#include <shader_structs.h>
 
+#include <memory>
+#include <mutex>
 #include <vector>
 
 namespace OM3D {
@@ -12,6 +17,13 @@ namespace OM3D {
 struct MeshData {
     std::vector<Vertex> vertices;
     std::vector<u32> indices;
+    // Simplified versions of indices, coarsest last, see build_lods()
+    std::vector<std::vector<u32>> lods;
+    // Clusters of the full detail level, each one a range of indices, see build_meshlets()
+    std::vector<shader::Meshlet> meshlets;
+
+    // Of the vertices, indices and levels of detail, meshlets are built from them
+    u64 content_hash() const;
 };
 
 struct BoundingSphere {
@@ -28,20 +40,80 @@ class StaticMesh : NonCopyable {
 
         StaticMesh(const MeshData& data);
 
-        void draw() const;
-        void draw(int nb_instances) const;
+        // Vertex array of the geometry pool, shared by every mesh, the draws below expect it bound
+        void bind() const;
+
+        void draw(u32 lod = 0) const;
+        void draw(int nb_instances, u32 lod) const;
+        // Draws the command at command_offset in the bound indirect buffer, see draw_command()
+        void draw_indirect(size_t command_offset) const;
+        // Draws the full detail level with one command per meshlet, written by MeshletCulling
+        void draw_meshlets() const;
         void draw_light_volume() const;
 
+        // Draws one instance of lod, for multi-draws of several meshes of the pool
+        shader::DrawElementsIndirectCommand draw_command(u32 lod, u32 base_instance) const;
+
         std::pair<glm::vec3, glm::vec3> get_aabb() const;
+        // Centered on the bounding box
+        const BoundingSphere &get_bounding_sphere() const;
+
+        // CPU copy of the geometry, used to rasterize occluders, to trace rays and to merge meshes
+        const std::vector<Vertex> &get_vertices() const;
+        const std::vector<u32> &get_indices() const;
+        const std::vector<u32> &get_lod_indices(u32 lod) const;
 
+        // Built on first use, can be called from several threads
+        const TriangleTree &triangle_tree() const;
+
+        // Meshes built from the same data are equal, even when they are different objects
         bool operator==(const StaticMesh& other) const;
+        // Computed once at construction, see MeshData::content_hash()
+        u64 content_hash() const;
+
+        // Of the full detail level
+        u32 index_count() const;
+
+        // Level 0 is the full detail mesh, every level shares its vertices
+        u32 lod_count() const;
+        u32 lod_triangle_count(u32 lod) const;
+
+        u32 meshlet_count() const;
+        const std::vector<shader::Meshlet> &get_meshlets() const;
+        const TypedBuffer<shader::Meshlet> &meshlet_buffer() const;
+        const TypedBuffer<shader::DrawElementsIndirectCommand> &meshlet_commands() const;
 
     private:
-        TypedBuffer<Vertex> _vertex_buffer;
-        TypedBuffer<u32> _index_buffer;
+        // Every level of detail, one after the other, in the index range
+        GeometryAllocation _geometry;
+
+        struct LodRange {
+            u32 first_index;
+            u32 index_count;
+        };
+        std::vector<LodRange> _lods;
+
+        std::vector<shader::Meshlet> _meshlets;
+        TypedBuffer<shader::Meshlet> _meshlet_buffer;
+        // Written by the culling pass every time the mesh is drawn
+        TypedBuffer<shader::DrawElementsIndirectCommand> _meshlet_commands;
+
+        std::vector<Vertex> _vertices;
+        std::vector<u32> _indices;
+        // Levels after the first
+        std::vector<std::vector<u32>> _lod_indices;
+
+        u64 _content_hash = 0;
 
         glm::vec3 _min_coords;
         glm::vec3 _max_coords;
+        BoundingSphere _bounding_sphere = {};
+
+        struct LazyTriangleTree {
+            std::once_flag built;
+            TriangleTree tree;
+        };
+        std::unique_ptr<LazyTriangleTree> _triangle_tree = std::make_unique<LazyTriangleTree>();
 };
 
 }
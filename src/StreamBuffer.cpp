@@ -0,0 +1,156 @@
+#include "StreamBuffer.h"
+
+#include <GLState.h>
+
+#include <glad/glad.h>
+
+#include <algorithm>
+
+namespace OM3D {
+
+// Fits the transforms of 16k instances per frame before the first growth
+static constexpr size_t initial_region_size = 1 << 20;
+static constexpr GLbitfield mapping_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+void StreamAllocation::bind(BufferUsage usage) const {
+    DEBUG_ASSERT(buffer);
+    GLState::current().bind_buffer(buffer_usage_to_gl(usage), buffer);
+}
+
+void StreamAllocation::bind(BufferUsage usage, u32 index) const {
+    ALWAYS_ASSERT(usage == BufferUsage::Uniform || usage == BufferUsage::Storage, "Index bind is only available for uniform and storage buffers");
+    DEBUG_ASSERT(buffer && size);
+    GLState::current().bind_buffer_range(buffer_usage_to_gl(usage), index, buffer, offset, size);
+}
+
+StreamBuffer::~StreamBuffer() {
+    release();
+    delete_retired(true);
+}
+
+void StreamBuffer::begin_frame() {
+    if (!_handle.is_valid()) {
+        create(initial_region_size);
+    } else {
+        _fences[_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        _region = (_region + 1) % frame_count;
+
+        for (RetiredBuffer& retired : _retired) {
+            if (!retired.fence) {
+                retired.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            }
+        }
+        delete_retired(false);
+
+        if (GLsync fence = static_cast<GLsync>(_fences[_region])) {
+            while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {
+            }
+            glDeleteSync(fence);
+            _fences[_region] = nullptr;
+        }
+    }
+
+    _offset = 0;
+    _streamed_bytes = 0;
+}
+
+StreamAllocation StreamBuffer::allocate(size_t size) {
+    DEBUG_ASSERT(size);
+    if (!_handle.is_valid()) {
+        begin_frame();
+    }
+
+    // What was allocated before stays in the old buffer, which is only deleted once the GPU no longer uses it
+    if (_offset + size > _region_size) {
+        size_t region_size = _region_size * 2;
+        while (region_size < size) {
+            region_size *= 2;
+        }
+        retire();
+        create(region_size);
+        _growth_count++;
+    }
+
+    const StreamAllocation allocation = { _mapping + _region * _region_size + _offset, _handle.get(), _region * _region_size + _offset, size };
+    _offset = std::min(size_t(align_up_to(u32(_offset + size), u32(_alignment))), _region_size);
+    _streamed_bytes += size;
+    return allocation;
+}
+
+size_t StreamBuffer::streamed_bytes() const {
+    return _streamed_bytes;
+}
+
+u32 StreamBuffer::growth_count() const {
+    return _growth_count;
+}
+
+void StreamBuffer::create(size_t region_size) {
+    GLint uniform_alignment = 0;
+    GLint storage_alignment = 0;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_alignment);
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storage_alignment);
+    _alignment = size_t(std::max({ uniform_alignment, storage_alignment, GLint(16) }));
+    _region_size = align_up_to(u32(region_size), u32(_alignment));
+
+    _handle = GLHandle(create_buffer_handle());
+    glNamedBufferStorage(_handle.get(), _region_size * frame_count, nullptr, mapping_flags);
+    _mapping = static_cast<byte*>(glMapNamedBufferRange(_handle.get(), 0, _region_size * frame_count, mapping_flags));
+    ALWAYS_ASSERT(_mapping, "Stream buffer could not be mapped");
+
+    _region = 0;
+    _offset = 0;
+}
+
+// The fences of the previous frames are dropped, the fence of the current frame covers them as well
+void StreamBuffer::retire() {
+    for (void*& fence : _fences) {
+        if (fence) {
+            glDeleteSync(static_cast<GLsync>(fence));
+            fence = nullptr;
+        }
+    }
+
+    _retired.push_back({ _handle.get(), nullptr });
+    _handle = GLHandle();
+    _mapping = nullptr;
+}
+
+void StreamBuffer::delete_retired(bool all) {
+    const auto done = [all](const RetiredBuffer& retired) {
+        if (!all && !retired.fence) {
+            return false;
+        }
+        if (retired.fence) {
+            GLsync fence = static_cast<GLsync>(retired.fence);
+            if (!all && glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+                return false;
+            }
+            glDeleteSync(fence);
+        }
+        GLState::current().forget_buffer(retired.handle);
+        glUnmapNamedBuffer(retired.handle);
+        glDeleteBuffers(1, &retired.handle);
+        return true;
+    };
+    _retired.erase(std::remove_if(_retired.begin(), _retired.end(), done), _retired.end());
+}
+
+void StreamBuffer::release() {
+    for (void*& fence : _fences) {
+        if (fence) {
+            glDeleteSync(static_cast<GLsync>(fence));
+            fence = nullptr;
+        }
+    }
+
+    if (auto handle = _handle.get()) {
+        GLState::current().forget_buffer(handle);
+        glUnmapNamedBuffer(handle);
+        glDeleteBuffers(1, &handle);
+        _handle = GLHandle();
+    }
+    _mapping = nullptr;
+}
+
+}
@@ -0,0 +1,80 @@
+#ifndef STREAMBUFFER_H
+#define STREAMBUFFER_H
+
+#include <graphics.h>
+
+#include <array>
+#include <vector>
+
+namespace OM3D {
+
+// Part of a StreamBuffer, written by the CPU until the next begin_frame()
+struct StreamAllocation {
+    void* data = nullptr;
+    u32 buffer = 0;
+    size_t offset = 0;
+    size_t size = 0;
+
+    template<typename T>
+    T* as() const {
+        return static_cast<T*>(data);
+    }
+
+    // Binds the whole buffer, offsets given to GL are relative to it
+    void bind(BufferUsage usage) const;
+    void bind(BufferUsage usage, u32 index) const;
+};
+
+// Data rewritten every frame, suballocated from a single buffer that stays mapped.
+// The buffer is split into one region per frame in flight, a region is written again only once the GPU is done with the
+// frame that last used it. Nothing is created in steady state, the buffer only grows when a frame does not fit its region.
+// Allocations made before a growth stay valid: the old buffer stays mapped until the GPU is done with the frame.
+class StreamBuffer : NonCopyable {
+    public:
+        static constexpr u32 frame_count = 3;
+
+        StreamBuffer() = default;
+        ~StreamBuffer();
+
+        // Moves to the next region, and waits for the GPU if it still reads it
+        void begin_frame();
+
+        // Offsets are aligned for uniform and storage bindings
+        StreamAllocation allocate(size_t size);
+
+        // Since the last begin_frame()
+        size_t streamed_bytes() const;
+
+        u32 growth_count() const;
+
+    private:
+        // Replaced by a larger buffer, deleted once its fence is signaled
+        struct RetiredBuffer {
+            u32 handle = 0;
+            // Set by the begin_frame() after the last frame that used the buffer
+            void* fence = nullptr;
+        };
+
+        void create(size_t region_size);
+        void release();
+        void retire();
+        // With all, also the buffers the GPU may still read, GL keeps their storage until it is done
+        void delete_retired(bool all);
+
+        GLHandle _handle;
+        byte* _mapping = nullptr;
+        size_t _region_size = 0;
+        size_t _alignment = 0;
+
+        std::array<void*, frame_count> _fences = {};
+        u32 _region = 0;
+        size_t _offset = 0;
+        size_t _streamed_bytes = 0;
+        u32 _growth_count = 0;
+
+        std::vector<RetiredBuffer> _retired;
+};
+
+}
+
+#endif // STREAMBUFFER_H
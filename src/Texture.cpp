@@ -1,5 +1,7 @@
 #include "Texture.h"
 
+#include <GLState.h>
+
 #include <glad/glad.h>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -50,27 +52,33 @@ Texture::Texture(const TextureData& data) :
     glGenerateTextureMipmap(_handle.get());
 }
 
-Texture::Texture(const glm::uvec2 &size, ImageFormat format) :
+Texture::Texture(const glm::uvec2 &size, ImageFormat format, u32 levels) :
     _handle(create_texture_handle()),
     _size(size),
     _format(format) {
 
     const ImageFormatGL gl_format = image_format_to_gl(_format);
-    glTextureStorage2D(_handle.get(), 1, gl_format.internal_format, _size.x, _size.y);
+    glTextureStorage2D(_handle.get(), levels, gl_format.internal_format, _size.x, _size.y);
 }
 
 Texture::~Texture() {
     if(auto handle = _handle.get()) {
+        GLState::current().forget_texture(handle);
         glDeleteTextures(1, &handle);
     }
 }
 
 void Texture::bind(u32 index) const {
-    glBindTextureUnit(index, _handle.get());
+    GLState::current().bind_texture(index, _handle.get());
+}
+
+void Texture::bind_as_image(u32 index, AccessType access, u32 level) {
+    GLState::current().bind_image(index, _handle.get(), level, access_type_to_gl(access), image_format_to_gl(_format).internal_format);
 }
 
-void Texture::bind_as_image(u32 index, AccessType access) {
-    glBindImageTexture(index, _handle.get(), 0, false, 0, access_type_to_gl(access), image_format_to_gl(_format).internal_format);
+void Texture::read_level(u32 level, void *data, size_t size) const {
+    const ImageFormatGL gl_format = image_format_to_gl(_format);
+    glGetTextureImage(_handle.get(), level, gl_format.format, gl_format.component_type, GLsizei(size), data);
 }
 
 const glm::uvec2& Texture::size() const {
@@ -30,10 +30,13 @@ class Texture {
         ~Texture();
 
         Texture(const TextureData& data);
-        Texture(const glm::uvec2 &size, ImageFormat format);
+        Texture(const glm::uvec2 &size, ImageFormat format, u32 levels = 1);
 
         void bind(u32 index) const;
-        void bind_as_image(u32 index, AccessType access);
+        void bind_as_image(u32 index, AccessType access, u32 level = 0);
+
+        // Copies a mip level to the CPU, size must match the level
+        void read_level(u32 level, void *data, size_t size) const;
 
         const glm::uvec2& size() const;
 
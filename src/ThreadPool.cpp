@@ -0,0 +1,123 @@
+#include "ThreadPool.h"
+
+namespace OM3D {
+
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local size_t current_queue = 0;
+
+ThreadPool::ThreadPool(size_t worker_count) {
+    for (size_t i = 0; i <= worker_count; i++) {
+        _queues.emplace_back(std::make_unique<Queue>());
+    }
+
+    for (size_t i = 1; i <= worker_count; i++) {
+        _threads.emplace_back([this, i] { worker_loop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(_sleep_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+
+    for (auto &t : _threads) {
+        t.join();
+    }
+}
+
+size_t ThreadPool::thread_count() const {
+    return _threads.size() + 1;
+}
+
+size_t ThreadPool::queue_index() const {
+    return current_pool == this ? current_queue : 0;
+}
+
+void ThreadPool::run(TaskGroup &group, std::function<void()> task) {
+    group._pending++;
+
+    Queue &queue = *_queues[queue_index()];
+    {
+        std::lock_guard lock(queue.mutex);
+        queue.tasks.push_back(Task{ std::move(task), &group });
+    }
+
+    _queued++;
+    {
+        // Make sure a worker can not miss the notification between its check and its wait
+        std::lock_guard lock(_sleep_mutex);
+    }
+    _wake.notify_one();
+}
+
+void ThreadPool::wait(TaskGroup &group) {
+    const size_t queue = queue_index();
+    while (group._pending > 0) {
+        if (!try_run_one(queue))
+            std::this_thread::yield();
+    }
+}
+
+bool ThreadPool::try_run_one(size_t home) {
+    Task task;
+    bool found = false;
+
+    // Own queue first, newest task
+    {
+        Queue &queue = *_queues[home];
+        std::lock_guard lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            found = true;
+        }
+    }
+
+    // Otherwise steal the oldest task of another queue
+    for (size_t i = 1; !found && i < _queues.size(); i++) {
+        Queue &queue = *_queues[(home + i) % _queues.size()];
+        std::lock_guard lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            found = true;
+        }
+    }
+
+    if (!found)
+        return false;
+
+    _queued--;
+    task.function();
+    task.group->_pending--;
+    return true;
+}
+
+void ThreadPool::worker_loop(size_t queue) {
+    current_pool = this;
+    current_queue = queue;
+
+    for (;;) {
+        if (try_run_one(queue))
+            continue;
+
+        std::unique_lock lock(_sleep_mutex);
+        _wake.wait(lock, [&] { return _stop || _queued > 0; });
+        if (_stop)
+            return;
+    }
+}
+
+ThreadPool &ThreadPool::global() {
+    static ThreadPool pool;
+    return pool;
+}
+
+size_t ThreadPool::default_worker_count() {
+    const size_t hardware = std::thread::hardware_concurrency();
+    return hardware > 1 ? hardware - 1 : 0;
+}
+
+}
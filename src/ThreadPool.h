@@ -0,0 +1,84 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <utils.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace OM3D {
+
+// Work-stealing task pool.
+// Every worker owns a queue: it pops its own tasks in LIFO order and steals from the others in FIFO order.
+// Threads waiting on a TaskGroup execute pending tasks instead of blocking, so tasks can spawn and wait on subtasks.
+class ThreadPool : NonMovable {
+    public:
+        class TaskGroup : NonMovable {
+            public:
+                TaskGroup() = default;
+
+                // Every task submitted so far has returned, for callers polling instead of waiting
+                bool is_done() const { return _pending == 0; }
+
+            private:
+                friend class ThreadPool;
+                std::atomic<size_t> _pending = 0;
+        };
+
+        ThreadPool(size_t worker_count = default_worker_count());
+        ~ThreadPool();
+
+        // Workers plus the calling thread
+        size_t thread_count() const;
+
+        void run(TaskGroup &group, std::function<void()> task);
+        void wait(TaskGroup &group);
+
+        // Calls f(chunk_begin, chunk_end) on chunks of at most grain elements and waits for completion
+        template<typename F>
+        void parallel_for(size_t begin, size_t end, size_t grain, F &&f) {
+            TaskGroup group;
+            for (size_t b = begin; b < end; b += grain) {
+                const size_t e = std::min(end, b + grain);
+                run(group, [&f, b, e] { f(b, e); });
+            }
+            wait(group);
+        }
+
+        static ThreadPool &global();
+        static size_t default_worker_count();
+
+    private:
+        struct Task {
+            std::function<void()> function;
+            TaskGroup *group = nullptr;
+        };
+
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        size_t queue_index() const;
+        bool try_run_one(size_t queue);
+        void worker_loop(size_t queue);
+
+        // Queue 0 receives the tasks submitted from threads that are not workers of this pool
+        std::vector<std::unique_ptr<Queue>> _queues;
+        std::vector<std::thread> _threads;
+
+        std::atomic<size_t> _queued = 0;
+        std::mutex _sleep_mutex;
+        std::condition_variable _wake;
+        bool _stop = false;
+};
+
+}
+
+#endif // THREADPOOL_H
@@ -0,0 +1,252 @@
+#include "TriangleTree.h"
+
+#include <glm/geometric.hpp>
+
+#include <array>
+
+namespace OM3D {
+
+// Number of bins evaluated per axis by the SAH builder
+static constexpr u32 triangle_sah_bins = 16;
+// Leaves never hold more triangles than this, smaller ranges become leaves when splitting does not lower the cost
+static constexpr u32 max_leaf_triangles = 8;
+// Cost of a node test relative to a triangle test
+static constexpr float node_test_cost = 0.5f;
+// Deeper nodes are split at the median, which bounds the depth to this plus log2 of the triangle count
+static constexpr u32 max_sah_depth = 64;
+// Holds max_sah_depth plus log2 of any triangle count
+static constexpr u32 traversal_stack_size = 128;
+
+static float surface_area(const glm::vec3 &min, const glm::vec3 &max) {
+    const glm::vec3 d = glm::max(max - min, glm::vec3(0.0f));
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+struct TriangleTree::BuildContext {
+    std::vector<u32> order;
+    std::vector<glm::vec3> min_corners;
+    std::vector<glm::vec3> max_corners;
+    std::vector<glm::vec3> centroids;
+};
+
+TriangleTree::TriangleTree(const std::vector<Vertex> &vertices, const std::vector<u32> &indices) {
+    const u32 count = u32(indices.size() / 3);
+    if (!count)
+        return;
+
+    BuildContext ctx;
+    ctx.order.resize(count);
+    ctx.min_corners.resize(count);
+    ctx.max_corners.resize(count);
+    ctx.centroids.resize(count);
+    for (u32 i = 0; i < count; i++) {
+        const glm::vec3 &a = vertices[indices[3 * i]].position;
+        const glm::vec3 &b = vertices[indices[3 * i + 1]].position;
+        const glm::vec3 &c = vertices[indices[3 * i + 2]].position;
+        ctx.order[i] = i;
+        ctx.min_corners[i] = glm::min(a, glm::min(b, c));
+        ctx.max_corners[i] = glm::max(a, glm::max(b, c));
+        ctx.centroids[i] = (ctx.min_corners[i] + ctx.max_corners[i]) * 0.5f;
+    }
+
+    _nodes.reserve(2 * size_t(count));
+    _nodes.emplace_back();
+    build_recursive(ctx, 0, 0, count, 0);
+
+    // Triangles are stored in leaf order
+    _triangles.reserve(count);
+    for (const u32 i : ctx.order) {
+        const glm::vec3 &a = vertices[indices[3 * i]].position;
+        const glm::vec3 &b = vertices[indices[3 * i + 1]].position;
+        const glm::vec3 &c = vertices[indices[3 * i + 2]].position;
+        _triangles.push_back({ a, b - a, c - a, 3 * i });
+    }
+}
+
+void TriangleTree::build_recursive(BuildContext &ctx, u32 node, u32 begin, u32 end, u32 depth) {
+    glm::vec3 min(std::numeric_limits<float>::max());
+    glm::vec3 max(-std::numeric_limits<float>::max());
+    glm::vec3 centroid_min = min;
+    glm::vec3 centroid_max = max;
+    for (u32 i = begin; i < end; i++) {
+        const u32 t = ctx.order[i];
+        min = glm::min(min, ctx.min_corners[t]);
+        max = glm::max(max, ctx.max_corners[t]);
+        centroid_min = glm::min(centroid_min, ctx.centroids[t]);
+        centroid_max = glm::max(centroid_max, ctx.centroids[t]);
+    }
+
+    _nodes[node].min = min;
+    _nodes[node].max = max;
+    _nodes[node].first = begin;
+    _nodes[node].count = end - begin;
+
+    const u32 count = end - begin;
+    if (count <= 2)
+        return;
+
+    // Binned SAH over every axis
+    struct Bin {
+        glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+        glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+        u32 count = 0;
+    };
+
+    const glm::vec3 extent = centroid_max - centroid_min;
+    float best_cost = std::numeric_limits<float>::max();
+    u32 best_axis = 0;
+    u32 best_split = 0;
+    for (u32 axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0.0f || depth >= max_sah_depth)
+            continue;
+
+        std::array<Bin, triangle_sah_bins> bins;
+        const float scale = triangle_sah_bins / extent[axis];
+        for (u32 i = begin; i < end; i++) {
+            const u32 t = ctx.order[i];
+            const u32 b = std::min(u32((ctx.centroids[t][axis] - centroid_min[axis]) * scale), triangle_sah_bins - 1);
+            bins[b].min = glm::min(bins[b].min, ctx.min_corners[t]);
+            bins[b].max = glm::max(bins[b].max, ctx.max_corners[t]);
+            bins[b].count++;
+        }
+
+        // Sweep from the right to get the area of every right side, then from the left
+        std::array<float, triangle_sah_bins> right_costs;
+        Bin right;
+        for (u32 b = triangle_sah_bins - 1; b > 0; b--) {
+            right.min = glm::min(right.min, bins[b].min);
+            right.max = glm::max(right.max, bins[b].max);
+            right.count += bins[b].count;
+            right_costs[b] = right.count ? surface_area(right.min, right.max) * right.count : 0.0f;
+        }
+
+        Bin left;
+        for (u32 b = 0; b + 1 < triangle_sah_bins; b++) {
+            left.min = glm::min(left.min, bins[b].min);
+            left.max = glm::max(left.max, bins[b].max);
+            left.count += bins[b].count;
+            if (!left.count || left.count == count)
+                continue;
+
+            const float cost = surface_area(left.min, left.max) * left.count + right_costs[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b + 1;
+            }
+        }
+    }
+
+    u32 middle = begin;
+    if (best_cost == std::numeric_limits<float>::max()) {
+        // Every centroid is at the same position, or the tree is too deep
+        if (count <= max_leaf_triangles)
+            return;
+        const u32 axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+        middle = begin + count / 2;
+        std::nth_element(ctx.order.begin() + begin, ctx.order.begin() + middle, ctx.order.begin() + end, [&](u32 a, u32 b) {
+            return ctx.centroids[a][axis] < ctx.centroids[b][axis];
+        });
+    } else {
+        const float leaf_cost = float(count);
+        const float split_cost = node_test_cost + best_cost / surface_area(min, max);
+        if (count <= max_leaf_triangles && leaf_cost <= split_cost)
+            return;
+
+        const float scale = triangle_sah_bins / extent[best_axis];
+        const auto it = std::partition(ctx.order.begin() + begin, ctx.order.begin() + end, [&](u32 t) {
+            return std::min(u32((ctx.centroids[t][best_axis] - centroid_min[best_axis]) * scale), triangle_sah_bins - 1) < best_split;
+        });
+        middle = u32(it - ctx.order.begin());
+    }
+
+    const u32 first_child = u32(_nodes.size());
+    _nodes.emplace_back();
+    _nodes.emplace_back();
+    _nodes[node].first = first_child;
+    _nodes[node].count = 0;
+
+    build_recursive(ctx, first_child, begin, middle, depth + 1);
+    build_recursive(ctx, first_child + 1, middle, end, depth + 1);
+}
+
+bool TriangleTree::intersect(const Ray &ray, float &distance, u32 &triangle, bool any_hit) const {
+    if (_nodes.empty())
+        return false;
+
+    const glm::vec3 inv_direction = 1.0f / ray.direction;
+
+    float entry = 0.0f;
+    if (!intersect_ray_box(_nodes[0].min, _nodes[0].max, ray.origin, inv_direction, distance, entry))
+        return false;
+
+    bool hit = false;
+
+    // Nodes are pushed with the distance at which the ray enters them
+    std::array<std::pair<u32, float>, traversal_stack_size> stack;
+    u32 stack_size = 0;
+    stack[stack_size++] = { 0, entry };
+    while (stack_size) {
+        const auto [index, node_entry] = stack[--stack_size];
+        if (node_entry > distance)
+            continue;
+
+        const Node &node = _nodes[index];
+        if (node.count) {
+            // Möller-Trumbore
+            for (u32 i = node.first; i < node.first + node.count; i++) {
+                const Triangle &t = _triangles[i];
+                const glm::vec3 p = glm::cross(ray.direction, t.e2);
+                const float det = glm::dot(t.e1, p);
+                if (det == 0.0f)
+                    continue;
+
+                const float inv_det = 1.0f / det;
+                const glm::vec3 s = ray.origin - t.v0;
+                const float u = glm::dot(s, p) * inv_det;
+                if (u < 0.0f || u > 1.0f)
+                    continue;
+
+                const glm::vec3 q = glm::cross(s, t.e1);
+                const float v = glm::dot(ray.direction, q) * inv_det;
+                if (v < 0.0f || u + v > 1.0f)
+                    continue;
+
+                const float d = glm::dot(t.e2, q) * inv_det;
+                if (d >= 0.0f && d < distance) {
+                    distance = d;
+                    triangle = t.index;
+                    hit = true;
+                    if (any_hit)
+                        return true;
+                }
+            }
+            continue;
+        }
+
+        // The nearest child is visited first
+        float entries[2];
+        const bool hits[2] = {
+            intersect_ray_box(_nodes[node.first].min, _nodes[node.first].max, ray.origin, inv_direction, distance, entries[0]),
+            intersect_ray_box(_nodes[node.first + 1].min, _nodes[node.first + 1].max, ray.origin, inv_direction, distance, entries[1]),
+        };
+        const u32 nearest = hits[0] && hits[1] ? u32(entries[1] < entries[0]) : u32(hits[1]);
+        const u32 farthest = 1 - nearest;
+        if (hits[farthest])
+            stack[stack_size++] = { node.first + farthest, entries[farthest] };
+        if (hits[nearest])
+            stack[stack_size++] = { node.first + nearest, entries[nearest] };
+    }
+
+    return hit;
+}
+
+size_t TriangleTree::node_count() const {
+    return _nodes.size();
+}
+
+size_t TriangleTree::triangle_count() const {
+    return _triangles.size();
+}
+
+}
@@ -0,0 +1,73 @@
+#ifndef TRIANGLETREE_H
+#define TRIANGLETREE_H
+
+#include <glm/common.hpp>
+#include <glm/vec3.hpp>
+
+#include <utils.h>
+#include <Vertex.h>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace OM3D {
+
+// Distances along the ray are in units of the direction, which does not have to be normalized
+struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float max_distance = std::numeric_limits<float>::infinity();
+};
+
+// Distance at which the ray enters the box, if it does before max_distance. inv_direction is 1 / direction.
+inline bool intersect_ray_box(const glm::vec3 &min, const glm::vec3 &max, const glm::vec3 &origin, const glm::vec3 &inv_direction, float max_distance, float &entry) {
+    const glm::vec3 t0 = (min - origin) * inv_direction;
+    const glm::vec3 t1 = (max - origin) * inv_direction;
+    const glm::vec3 t_near = glm::min(t0, t1);
+    const glm::vec3 t_far = glm::max(t0, t1);
+    entry = std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, 0.0f));
+    return entry <= std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, max_distance));
+}
+
+// Binary bounding volume hierarchy over the triangles of a mesh, in mesh space, for exact ray hits
+class TriangleTree {
+    public:
+        TriangleTree() = default;
+        TriangleTree(const std::vector<Vertex> &vertices, const std::vector<u32> &indices);
+
+        // Closest hit before distance, which is updated along with the index of the first vertex of the triangle.
+        // With any_hit, the search stops at the first hit found. Both windings are hit.
+        bool intersect(const Ray &ray, float &distance, u32 &triangle, bool any_hit = false) const;
+
+        size_t node_count() const;
+        size_t triangle_count() const;
+
+    private:
+        // Leaves hold count triangles starting at first, inner nodes have count 0 and their children at first and first + 1
+        struct Node {
+            glm::vec3 min;
+            u32 first;
+            glm::vec3 max;
+            u32 count;
+        };
+
+        // Edges are precomputed for the ray test
+        struct Triangle {
+            glm::vec3 v0;
+            glm::vec3 e1;
+            glm::vec3 e2;
+            u32 index;
+        };
+
+        struct BuildContext;
+
+        void build_recursive(BuildContext &ctx, u32 node, u32 begin, u32 end, u32 depth);
+
+        std::vector<Node> _nodes;
+        std::vector<Triangle> _triangles;
+};
+
+}
+
+#endif // TRIANGLETREE_H
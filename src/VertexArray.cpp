@@ -0,0 +1,57 @@
+#include "VertexArray.h"
+
+#include <GLState.h>
+
+#include <glad/glad.h>
+
+namespace OM3D {
+
+static GLuint create_vertex_array_handle() {
+    GLuint handle = 0;
+    glCreateVertexArrays(1, &handle);
+    return handle;
+}
+
+VertexArray::VertexArray(Span<const VertexAttribute> attributes) : _handle(create_vertex_array_handle()) {
+    for(const VertexAttribute& attribute : attributes) {
+        if(attribute.integer) {
+            glVertexArrayAttribIFormat(_handle.get(), attribute.location, attribute.components, attribute.type, attribute.offset);
+        } else {
+            glVertexArrayAttribFormat(_handle.get(), attribute.location, attribute.components, attribute.type, attribute.normalized, attribute.offset);
+        }
+        glVertexArrayAttribBinding(_handle.get(), attribute.location, attribute.binding);
+        glEnableVertexArrayAttrib(_handle.get(), attribute.location);
+    }
+}
+
+VertexArray::~VertexArray() {
+    if(auto handle = _handle.get()) {
+        GLState::current().forget_vertex_array(handle);
+        glDeleteVertexArrays(1, &handle);
+    }
+}
+
+void VertexArray::bind() const {
+    GLState::current().bind_vertex_array(_handle.get());
+}
+
+void VertexArray::set_vertex_buffer(u32 binding, u32 buffer, size_t offset, u32 stride, u32 divisor) const {
+    glVertexArrayVertexBuffer(_handle.get(), binding, buffer, offset, stride);
+    glVertexArrayBindingDivisor(_handle.get(), binding, divisor);
+}
+
+void VertexArray::set_index_buffer(u32 buffer) const {
+    glVertexArrayElementBuffer(_handle.get(), buffer);
+    // Changes the index buffer binding if the array is bound
+    GLState::current().forget_binding(GL_ELEMENT_ARRAY_BUFFER);
+}
+
+void VertexArray::set_attribute_enabled(u32 location, bool enabled) const {
+    if(enabled) {
+        glEnableVertexArrayAttrib(_handle.get(), location);
+    } else {
+        glDisableVertexArrayAttrib(_handle.get(), location);
+    }
+}
+
+}
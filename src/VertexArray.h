@@ -0,0 +1,46 @@
+#ifndef VERTEXARRAY_H
+#define VERTEXARRAY_H
+
+#include <graphics.h>
+
+namespace OM3D {
+
+struct VertexAttribute {
+    u32 location;
+    // Vertex buffer binding it reads from
+    u32 binding;
+    u32 components;
+    u32 type;
+    // In bytes, from the start of a vertex
+    u32 offset;
+    bool normalized = false;
+    // Read as an integer instead of being converted to float
+    bool integer = false;
+};
+
+// Vertex format and the buffers it reads from, set once with DSA so that drawing only binds it
+class VertexArray : NonCopyable {
+
+    public:
+        VertexArray() = default;
+        VertexArray(VertexArray&&) = default;
+        VertexArray& operator=(VertexArray&&) = default;
+
+        // Every attribute starts enabled
+        VertexArray(Span<const VertexAttribute> attributes);
+        ~VertexArray();
+
+        void bind() const;
+
+        // A divisor of 1 advances once per instance instead of once per vertex
+        void set_vertex_buffer(u32 binding, u32 buffer, size_t offset, u32 stride, u32 divisor = 0) const;
+        void set_index_buffer(u32 buffer) const;
+        void set_attribute_enabled(u32 location, bool enabled) const;
+
+    private:
+        GLHandle _handle;
+};
+
+}
+
+#endif // VERTEXARRAY_H
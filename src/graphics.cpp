@@ -35,6 +35,9 @@ u32 buffer_usage_to_gl(BufferUsage usage) {
 
         case BufferUsage::Storage:
             return GL_SHADER_STORAGE_BUFFER;
+
+        case BufferUsage::Indirect:
+            return GL_DRAW_INDIRECT_BUFFER;
     }
 
     FATAL("Unknown usage value");
@@ -63,6 +66,19 @@ u32 align_up_to(u32 val, u32 up_to) {
     return val;
 }
 
+static u64 buffer_count = 0;
+
+u32 create_buffer_handle() {
+    GLuint handle = 0;
+    glCreateBuffers(1, &handle);
+    buffer_count++;
+    return handle;
+}
+
+u64 created_buffer_count() {
+    return buffer_count;
+}
+
 static GLuint global_vao = 0;
 
 void init_graphics() {
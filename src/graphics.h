@@ -47,6 +47,7 @@ enum class BufferUsage {
     Index,
     Uniform,
     Storage,
+    Indirect,
 };
 
 enum class AccessType {
@@ -60,6 +61,11 @@ u32 access_type_to_gl(AccessType access);
 
 u32 align_up_to(u32 val, u32 up_to);
 
+// Every buffer object is created through this, so that they can be counted
+u32 create_buffer_handle();
+// Since the start of the program
+u64 created_buffer_count();
+
 void init_graphics();
 
 }
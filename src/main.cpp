@@ -11,6 +11,10 @@
 #include <Texture.h>
 #include <Framebuffer.h>
 #include <ImGuiRenderer.h>
+#include <DepthPyramid.h>
+#include <GLState.h>
+#include <GeometryPool.h>
+#include <SceneBenchmarks.h>
 
 #include <imgui/imgui.h>
 
@@ -161,6 +165,7 @@ int main(int, char**) {
 
     std::unique_ptr<Scene> scene = create_default_scene();
     SceneView scene_view(scene.get());
+    BenchmarkResults benchmarks;
 
     auto shading_program = Program::from_file("shading.comp", {"NB_LIGHTS " + std::to_string(scene->get_nb_lights())});
     auto tonemap_program = Program::from_file("tonemap.comp");
@@ -175,11 +180,25 @@ int main(int, char**) {
     Framebuffer g_buffer(&depth, std::array{&albedo, &normals});
     Framebuffer shading_buffer(&depth, std::array{&lit});
 
+    DepthPyramid depth_pyramid(depth);
+
     Material debug_material = Material::debug_material();
 
     shading_program->set_uniform(HASH("screen_size"), window_size);
 
+    u64 frame_buffer_count = created_buffer_count();
+    u64 buffers_created_last_frame = 0;
+
     for(;;) {
+        // Zero in steady state, per-frame data goes through stream buffers
+        buffers_created_last_frame = created_buffer_count() - frame_buffer_count;
+        frame_buffer_count = created_buffer_count();
+        const GLStateStats gl_state_stats = GLState::current().stats();
+        GLState::current().reset_stats();
+
+        // Meshes released last frame may have left holes in the geometry pool
+        GeometryPool::current().compact_if_fragmented();
+
         glfwPollEvents();
         if(glfwWindowShouldClose(window) || glfwGetKey(window, GLFW_KEY_ESCAPE)) {
             break;
@@ -192,6 +211,9 @@ int main(int, char**) {
             process_inputs(window, scene_view.camera());
         }
 
+        if (imgui.animate_vehicles)
+            scene->animate_vehicles(float(program_time()), HierarchyUpdate(imgui.hierarchy_update));
+
         // Update the frame data
         scene_view.update_frame();
 
@@ -201,7 +223,11 @@ int main(int, char**) {
 
             if (imgui.debug_mode == AABB)
                 scene->render_aabb(imgui.aabb_render_level);
-            scene_view.render();
+            scene_view.render(&depth_pyramid);
+
+            // The two-phase occlusion culling already built it
+            if (imgui.debug_mode == HiZ && scene->get_occlusion_mode() != OcclusionMode::TwoPhaseHiZ)
+                depth_pyramid.build();
         }
 
         // Set the textures as input
@@ -210,12 +236,14 @@ int main(int, char**) {
         normals.bind(1);
         depth.bind(2);
 
-        if (imgui.debug_mode >= Albedo && imgui.debug_mode <= Depth) // Debug view
+        if ((imgui.debug_mode >= Albedo && imgui.debug_mode <= Depth) || imgui.debug_mode == HiZ) // Debug view
         {
             debug_material.bind();
+            depth_pyramid.texture().bind(3);
+            debug_material.set_uniform(HASH("hiz_level"), u32(std::min(imgui.hiz_level, int(depth_pyramid.level_count()) - 1)));
 
-            if (imgui.debug_mode == 3) // Allow background fragments to be modified for Depth view
-                glDepthFunc(GL_LEQUAL);
+            if (imgui.debug_mode == 3 || imgui.debug_mode == HiZ) // Allow background fragments to be modified for Depth views
+                GLState::current().set_depth_func(GL_LEQUAL);
 
             debug_material.set_uniform(HASH("debug"), imgui.debug_mode);
             glDrawArrays(GL_TRIANGLES, 0, 3);
@@ -241,7 +269,7 @@ int main(int, char**) {
             glDispatchCompute(align_up_to(window_size.x, 8) / 8, align_up_to(window_size.y, 8) / 8, 1);
         }
         // Blit tonemap result to screen
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        GLState::current().bind_framebuffer(0);
         tonemap_framebuffer.blit();
 
         // GUI
@@ -258,25 +286,181 @@ int main(int, char**) {
                 } else {
                     scene = std::move(result.value);
                     scene_view = SceneView(scene.get());
+                    benchmarks = {};
                     size_t size = scene->get_nb_lights();
                     shading_program = Program::from_file("shading.comp", {"NB_LIGHTS " + std::to_string(size == 0 ? 1 : size)});
                 }
             }
 
+            ImGui::InputInt("Synthetic instances", &imgui.synthetic_instances, 10000, 100000);
+            ImGui::InputInt("Synthetic vehicles", &imgui.synthetic_vehicles, 1000, 10000);
+            if(ImGui::Button("Generate synthetic scene")) {
+                scene = Scene::synthetic(size_t(std::max(imgui.synthetic_instances, 1)), imgui.bvh_subdivisions, BuildStrategy(imgui.bvh_strategy),
+                                         size_t(std::max(imgui.synthetic_vehicles, 0)));
+                scene_view = SceneView(scene.get());
+                benchmarks = {};
+                shading_program = Program::from_file("shading.comp", {"NB_LIGHTS 1"});
+            }
+
             imgui.display_debug_mode();
 
             ImGui::Spacing();
             ImGui::Separator();
             ImGui::Spacing();
 
-            if (ImGui::SliderInt("BVH Subdivisions", &imgui.bvh_subdivisions, 1, 10)) {
-                scene->create_bounding_volume_hierarchy(imgui.bvh_subdivisions);
+            const bool strategy_changed = ImGui::Combo("BVH Builder", &imgui.bvh_strategy, imgui.bvh_strategies, int(BuildStrategy::BuildStrategy_Size));
+            if (ImGui::SliderInt("BVH Subdivisions", &imgui.bvh_subdivisions, 1, 10) || strategy_changed) {
+                scene->create_bounding_volume_hierarchy(imgui.bvh_subdivisions, BuildStrategy(imgui.bvh_strategy));
             }
             ImGui::SliderInt("Debug Hierarchy Render Level", &imgui.aabb_render_level, 0, 10);
 
+            imgui.culling_kernel = int(scene->get_culling_kernel());
+            if (ImGui::Combo("Culling kernel", &imgui.culling_kernel, imgui.culling_kernels, int(CullingKernel::CullingKernel_Size))) {
+                scene->set_culling_kernel(CullingKernel(imgui.culling_kernel));
+            }
+
             const RenderInfo &info = scene->get_render_info();
             ImGui::Text("Number of objects: %i\nNumber of culled objects: %i\nNumber of checks: %i",
                         info.objects, info.objects - info.rendered, info.checks);
+            ImGui::Text("Culling time: %.3f ms (%.1f Mnodes/s)%s", info.cull_time, info.cull_time > 0.0 ? info.checks / (info.cull_time * 1000.0) : 0.0,
+                        info.reused_visible_set ? " - reused" : "");
+            ImGui::Text("Plane tests: %zu (saved: %zu)\nSphere tests: %zu, leaves rejected by their sphere: %zu", info.plane_tests, info.saved_plane_tests,
+                        info.sphere_tests, info.sphere_rejections);
+
+            imgui.min_screen_size = scene->get_min_screen_size();
+            if (ImGui::SliderFloat("Min screen size", &imgui.min_screen_size, 0.0f, 0.05f, "%.4f")) {
+                scene->set_min_screen_size(imgui.min_screen_size);
+            }
+            ImGui::Text("Triangles: %zu (full detail: %zu, saved: %.1f%%)\nCulled by screen size: %zu", info.triangles, info.full_detail_triangles,
+                        info.full_detail_triangles ? 100.0 * (1.0 - double(info.triangles) / double(info.full_detail_triangles)) : 0.0, info.screen_size_culled);
+            ImGui::Text("Draw calls: %zu", info.draw_calls);
+            {
+                const RenderQueueStats &queue = info.render_queue;
+                ImGui::Text("Binds (skipped): %zu programs (%zu), %zu materials (%zu), %zu meshes (%zu)\nDraw sort: %.3f ms",
+                            queue.program_binds, queue.skipped_program_binds, queue.material_binds, queue.skipped_material_binds,
+                            queue.mesh_binds, queue.skipped_mesh_binds, queue.sort_time);
+                ImGui::Text("Multi-draws: %zu, for %zu objects", queue.multi_draws, queue.multi_drawn_objects);
+            }
+            {
+                const GeometryPoolStats pool = GeometryPool::current().stats();
+                ImGui::Text("Geometry pool: %u meshes, vertices %.1f / %.1f MB, indices %.1f / %.1f MB", pool.meshes,
+                            pool.vertices.used * sizeof(Vertex) / (1024.0 * 1024.0), pool.vertices.capacity * sizeof(Vertex) / (1024.0 * 1024.0),
+                            pool.indices.used * sizeof(u32) / (1024.0 * 1024.0), pool.indices.capacity * sizeof(u32) / (1024.0 * 1024.0));
+                ImGui::Text("Fragmentation: vertices %.1f%% (%u free blocks), indices %.1f%% (%u free blocks)\nGrowths: %u, compactions: %u (%.1f MB moved)",
+                            pool.vertices.fragmentation() * 100.0f, pool.vertices.free_blocks, pool.indices.fragmentation() * 100.0f, pool.indices.free_blocks,
+                            pool.growth_count, pool.compaction_count, pool.compacted_bytes / (1024.0 * 1024.0));
+            }
+            if (ImGui::Checkbox("Validate GL state", &imgui.validate_gl_state)) {
+                GLState::current().set_validation(imgui.validate_gl_state);
+            }
+            ImGui::Text("GL state calls: %zu issued, %zu skipped (mismatches: %zu)", gl_state_stats.issued_calls, gl_state_stats.skipped_calls,
+                        gl_state_stats.mismatches);
+            ImGui::Text("Instance data streamed: %.1f KB (stream growths: %zu)\nBuffer objects created last frame: %llu", info.streamed_bytes / 1024.0,
+                        info.stream_growths, (unsigned long long)buffers_created_last_frame);
+
+            imgui.hlod_screen_size = scene->get_hlod_screen_size();
+            if (ImGui::SliderFloat("HLOD screen size", &imgui.hlod_screen_size, 0.0f, 0.5f, "%.3f")) {
+                scene->set_hlod_screen_size(imgui.hlod_screen_size);
+            }
+            if (ImGui::Button("Build HLOD proxies")) {
+                scene->build_hlod();
+            }
+            ImGui::Text("Proxies: %zu (%zu triangles, %zu from the cache, %.1f ms)\nProxies drawn: %zu", info.hlod_proxies, info.hlod_proxy_triangles,
+                        info.hlod_cache_hits, info.hlod_build_time, info.drawn_proxies);
+
+            imgui.meshlet_culling = scene->get_meshlet_culling();
+            if (ImGui::Checkbox("Meshlet culling", &imgui.meshlet_culling)) {
+                scene->set_meshlet_culling(imgui.meshlet_culling);
+            }
+            if (ImGui::Button("Count visible meshlets")) {
+                scene->read_meshlet_stats();
+            }
+            ImGui::Text("Meshlets: %zu in %zu objects (%zu triangles)\nVisible meshlets: %zu (%zu triangles)", info.meshlets, info.meshlet_objects,
+                        info.meshlet_triangles, info.visible_meshlets, info.visible_meshlet_triangles);
+
+            imgui.occlusion_mode = int(scene->get_occlusion_mode());
+            if (ImGui::Combo("Occlusion culling", &imgui.occlusion_mode, imgui.occlusion_modes, int(OcclusionMode::OcclusionMode_Size))) {
+                scene->set_occlusion_mode(OcclusionMode(imgui.occlusion_mode));
+            }
+            ImGui::Text("Occluders: %zu (%zu triangles, %.3f ms)\nOcclusion tests: %zu (occluded nodes: %zu)", info.occluders, info.occluder_triangles,
+                        info.occlusion_time, info.occlusion_tests, info.occluded_nodes);
+            if (imgui.occlusion_mode == int(OcclusionMode::TwoPhaseHiZ)) {
+                ImGui::Text("First phase: %zu objects\nSecond phase: %zu objects", info.first_phase_objects, info.second_phase_objects);
+            }
+            if (imgui.occlusion_mode == int(OcclusionMode::Queries)) {
+                ImGui::Text("Queries: %zu (%zu boxes, %zu pending)\nHidden nodes: %zu (saved draws: %zu)", info.queries, info.query_boxes,
+                            info.pending_queries, info.hidden_nodes, info.hidden_objects);
+            }
+            if (imgui.debug_mode == HiZ) {
+                ImGui::SliderInt("Hi-Z level", &imgui.hiz_level, 0, int(depth_pyramid.level_count()) - 1);
+            }
+
+            imgui.gpu_culling = scene->get_gpu_culling();
+            if (ImGui::Checkbox("GPU culling (indirect draws)", &imgui.gpu_culling)) {
+                scene->set_gpu_culling(imgui.gpu_culling);
+            }
+            if (imgui.gpu_culling) {
+                ImGui::Text("Dispatches: %zu\nLast hierarchy upload: %.3f ms", info.gpu_dispatches, info.gpu_upload_time);
+                if (ImGui::Button("Verify GPU culling")) {
+                    verify_gpu_culling(*scene, scene_view.camera(), benchmarks);
+                }
+                ImGui::Text("GPU visible: %zu (mismatches with the CPU: %zu)", benchmarks.gpu_visible, benchmarks.gpu_mismatches);
+            }
+            ImGui::Text("BVH build time: %.3f ms\nBVH SAH cost: %.2f", info.build_time, info.sah_cost);
+            if (ImGui::Button("Compare builders")) {
+                compare_builders(*scene, benchmarks);
+            }
+            for (size_t i = 0; i < benchmarks.builder_times.size(); i++) {
+                ImGui::Text("%s: %.3f ms, SAH cost %.2f", imgui.bvh_strategies[i], benchmarks.builder_times[i], benchmarks.builder_sah_costs[i]);
+            }
+
+            ImGui::Checkbox("Animate vehicles", &imgui.animate_vehicles);
+            ImGui::Combo("Moving objects update", &imgui.hierarchy_update, imgui.hierarchy_updates, 2);
+            ImGui::Text("Hierarchy update: %.3f ms for %zu objects (%.3f us/object)\nRebuilt subtrees: %zu", info.update_time, info.moved_objects,
+                        info.moved_objects ? info.update_time * 1000.0 / info.moved_objects : 0.0, info.rebuilt_subtrees);
+
+            ImGui::InputInt("Soak operations", &imgui.soak_operations, 10000, 100000);
+            if (ImGui::Button("Run insert/remove soak test")) {
+                run_soak_test(*scene, size_t(std::max(imgui.soak_operations, 0)), scene_view.camera(), benchmarks);
+            }
+            if (!benchmarks.soak_checks.empty()) {
+                ImGui::PlotLines("Checks", benchmarks.soak_checks.data(), int(benchmarks.soak_checks.size()), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 50));
+                ImGui::PlotLines("SAH cost", benchmarks.soak_sah_cost.data(), int(benchmarks.soak_sah_cost.size()), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 50));
+            }
+
+            RayHit center_hit;
+            if (scene->raycast(Ray{ scene_view.camera().position(), scene_view.camera().forward() }, center_hit)) {
+                ImGui::Text("View center: object %u at %.2f", center_hit.handle, center_hit.distance);
+            } else {
+                ImGui::Text("View center: no object");
+            }
+            ImGui::SliderInt("Shadow cascades", &imgui.shadow_cascades, 1, int(BoundingTree::max_views) - 1);
+            if (ImGui::Button("Run multi-view culling benchmark")) {
+                benchmark_multi_view(*scene, scene_view.camera(), size_t(imgui.shadow_cascades), benchmarks);
+            }
+            if (benchmarks.views) {
+                ImGui::Text("%zu views, %zu visible objects (mismatches: %zu)\nOne traversal per view: %.3f ms (%zu checks)\nSingle traversal: %.3f ms (%zu checks)",
+                            benchmarks.views, benchmarks.multi_view_visible, benchmarks.multi_view_mismatches, benchmarks.separate_view_time,
+                            benchmarks.separate_view_checks, benchmarks.multi_view_time, benchmarks.multi_view_checks);
+            }
+
+            ImGui::InputInt("Benchmark rays", &imgui.benchmark_rays, 100000, 1000000);
+            if (ImGui::Button("Run ray benchmark")) {
+                benchmark_rays(*scene, scene_view.camera(), size_t(std::max(imgui.benchmark_rays, 0)), benchmarks);
+            }
+            if (benchmarks.rays) {
+                ImGui::Text("%zu rays, %zu hits\nClosest hit: %.3f ms (%.2f Mrays/s)\nAny hit: %.3f ms (%.2f Mrays/s)", benchmarks.rays,
+                            benchmarks.ray_hits, benchmarks.closest_hit_time, benchmarks.rays / (benchmarks.closest_hit_time * 1000.0),
+                            benchmarks.any_hit_time, benchmarks.rays / (benchmarks.any_hit_time * 1000.0));
+            }
+
+            ImGui::InputInt("Benchmark objects", &imgui.benchmark_load_objects, 10000, 100000);
+            if (ImGui::Button("Run loading benchmark")) {
+                benchmark_loading(size_t(std::max(imgui.benchmark_load_objects, 0)), benchmarks);
+            }
+            if (benchmarks.load_objects) {
+                ImGui::Text("%zu objects in %zu groups: %.3f ms", benchmarks.load_objects, benchmarks.load_groups, benchmarks.load_time);
+            }
         }
         imgui.finish();
 
@@ -3,6 +3,7 @@
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include <iostream>
 #include <chrono>
@@ -92,4 +93,63 @@ bool ends_with(std::string_view str, std::string_view suffix) {
     return str.substr(str.size() - suffix.size()) == suffix;
 }
 
+static constexpr u64 prime_1 = 0x9E3779B185EBCA87ull;
+static constexpr u64 prime_2 = 0xC2B2AE3D27D4EB4Full;
+static constexpr u64 prime_3 = 0x165667B19E3779F9ull;
+static constexpr u64 prime_4 = 0x85EBCA77C2B2AE63ull;
+static constexpr u64 prime_5 = 0x27D4EB2F165667C5ull;
+
+static u64 rotate_left(u64 x, u32 r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static u64 read_u64(const u8* bytes) {
+    u64 value = 0;
+    std::memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static u64 hash_round(u64 acc, u64 input) {
+    return rotate_left(acc + input * prime_2, 31) * prime_1;
+}
+
+static u64 merge_round(u64 hash, u64 lane) {
+    return (hash ^ hash_round(0, lane)) * prime_1 + prime_4;
+}
+
+u64 content_hash(const void* data, size_t size, u64 seed) {
+    const u8* bytes = static_cast<const u8*>(data);
+    const u8* end = bytes + size;
+
+    u64 hash = seed + prime_5;
+    if(size >= 32) {
+        u64 lanes[4] = { seed + prime_1 + prime_2, seed + prime_2, seed, seed - prime_1 };
+        for(; end - bytes >= 32; bytes += 32) {
+            for(u32 l = 0; l != 4; ++l) {
+                lanes[l] = hash_round(lanes[l], read_u64(bytes + 8 * l));
+            }
+        }
+
+        hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+        for(const u64 lane : lanes) {
+            hash = merge_round(hash, lane);
+        }
+    }
+    hash += u64(size);
+
+    for(; end - bytes >= 8; bytes += 8) {
+        hash = rotate_left(hash ^ hash_round(0, read_u64(bytes)), 27) * prime_1 + prime_4;
+    }
+    for(; bytes != end; ++bytes) {
+        hash = rotate_left(hash ^ (*bytes * prime_5), 11) * prime_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= prime_2;
+    hash ^= hash >> 29;
+    hash *= prime_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
 }
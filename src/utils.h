@@ -8,6 +8,10 @@
 #include <string>
 #include <array>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #define FWD(var) std::forward<decltype(var)>(var)
 #define HASH(str) ([] { static constexpr u32 result = str_hash(str); return result; }())
 
@@ -187,6 +191,51 @@ inline constexpr u32 str_hash(std::string_view str, u32 seed = 0xCAFECAFE) {
     return ~crc;
 }
 
+// 64-bit hash of a block of memory, strong enough to tell contents apart (xxHash64).
+// Blocks of 32 bytes feed four independent lanes, which the compiler can interleave or vectorize.
+u64 content_hash(const void* data, size_t size, u64 seed = 0);
+
+// x must not be 0
+inline u32 count_leading_zeros(u32 x) {
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanReverse(&index, x);
+    return 31 - u32(index);
+#else
+    return u32(__builtin_clz(x));
+#endif
+}
+
+// x must not be 0
+inline u32 count_leading_zeros(u64 x) {
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanReverse64(&index, x);
+    return 63 - u32(index);
+#else
+    return u32(__builtin_clzll(x));
+#endif
+}
+
+// x must not be 0
+inline u32 count_trailing_zeros(u32 x) {
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanForward(&index, x);
+    return u32(index);
+#else
+    return u32(__builtin_ctz(x));
+#endif
+}
+
+inline u32 count_set_bits(u32 x) {
+#ifdef _MSC_VER
+    return u32(__popcnt(x));
+#else
+    return u32(__builtin_popcount(x));
+#endif
+}
+
 template<typename T>
 inline constexpr T to_rad(T deg) {
     return deg * T(0.01745329251994329576923690768489);